@@ -0,0 +1,156 @@
+#include <unordered_map>
+
+namespace Batch {
+
+struct draw_command_t {
+  GLuint count;
+  GLuint instance_count;
+  GLuint first_index;
+  GLint  base_vertex;
+  GLuint base_instance;
+};
+
+// Matches draw_t in batch_vs_src and cull_cs_src (std430)
+struct draw_data_t {
+  mat4x4 model;
+  float sphere[4]; // world space bounds, for culling on the gpu
+  GLuint material;
+  GLuint index_count, first_index;
+  GLint base_vertex;
+};
+
+// Every static mesh already lives in the standard geometry arena, so
+// every opaque object goes out in a single glMultiDrawElementsIndirect.
+// Per draw transforms and material indices go into a storage buffer,
+// the draw reaches its entry through an instanced attribute that the
+// command's base instance offsets to the draw index.
+class Batcher
+{
+  private:
+    std::vector<Meshes::Handle> meshes;
+    std::vector<Vector4> materials;
+    std::vector<draw_data_t> draws;
+    std::vector<draw_command_t> commands;
+    GLuint vao; // the standard arena's
+    Resources::Object ids, draw_buffer, material_buffer, command_buffer;
+    int capacity;
+
+  public:
+    int addMesh(Meshes::Handle mesh);
+    int addMaterial(const Vector3 &tint, float texture_scale);
+    void finalize(int max_draws);
+    void release();
+
+    void begin() { draws.clear(); commands.clear(); }
+    void add(int mesh, const Matrix4 &model, int material);
+    void upload();
+    void draw(GLuint indirect, GLintptr offset, int count);
+    void submit();
+    int size() const { return draws.size(); }
+    int getCapacity() const { return capacity; }
+};
+
+// Only standard format meshes share the arena the batch draws from
+int Batcher::addMesh(Meshes::Handle mesh)
+{
+  if (Meshes::get(mesh)->format != Geometry::FORMAT_STANDARD) {
+    logError("Only meshes of the standard format can be batched");
+    exit(12);
+  }
+  meshes.push_back(mesh);
+  return meshes.size() - 1;
+}
+
+int Batcher::addMaterial(const Vector3 &tint, float texture_scale)
+{
+  materials.push_back(Vector4(tint, texture_scale));
+  return materials.size() - 1;
+}
+
+void Batcher::finalize(int max_draws)
+{
+  capacity = max_draws;
+  vao = Geometry::arenas[Geometry::FORMAT_STANDARD].vao;
+
+  // 0, 1, 2, ... stepped once per instance, base instance picks the draw.
+  // Added to the arena vao, the other standard shaders ignore it.
+  std::vector<GLuint> sequence(capacity);
+  for(int i=0; i<capacity; i++) sequence[i] = i;
+  ids = Resources::Object(Resources::KIND_BUFFER, Meshes::createBuffer(capacity * sizeof(GLuint), sequence.data()));
+  glVertexArrayVertexBuffer(vao, D_DRAW_INDEX, ids, 0, sizeof(GLuint));
+  glVertexArrayAttribIFormat(vao, D_DRAW_INDEX, 1, GL_UNSIGNED_INT, 0);
+  glVertexArrayAttribBinding(vao, D_DRAW_INDEX, D_DRAW_INDEX);
+  glVertexArrayBindingDivisor(vao, D_DRAW_INDEX, 1);
+  glEnableVertexArrayAttrib(vao, D_DRAW_INDEX);
+
+  draw_buffer = Resources::createBuffer();
+  glNamedBufferStorage(draw_buffer, capacity * sizeof(draw_data_t), NULL, GL_DYNAMIC_STORAGE_BIT);
+  material_buffer = Resources::createBuffer();
+  materials.resize(std::max(materials.size(), (size_t)1));
+  glNamedBufferStorage(material_buffer, materials.size() * sizeof(Vector4), materials.data(), 0);
+  command_buffer = Resources::createBuffer();
+  glNamedBufferStorage(command_buffer, capacity * sizeof(draw_command_t), NULL, GL_DYNAMIC_STORAGE_BIT);
+}
+
+void Batcher::release()
+{
+  ids.reset();
+  draw_buffer.reset();
+  material_buffer.reset();
+  command_buffer.reset();
+}
+
+void Batcher::add(int mesh, const Matrix4 &model, int material)
+{
+  if ((int)draws.size() == capacity) return;
+  // Looked up every time, the arena moves meshes when it compacts
+  const Meshes::Mesh* m = Meshes::get(meshes[mesh]);
+  const Meshes::draw_range_t r = Meshes::range(m);
+  draw_data_t d;
+  model.unpack(d.model);
+  Vector4 center = model * Vector4(m->center, 1);
+  float scale = 0;
+  for(int c=0; c<3; c++)
+    scale = std::max(scale, Vector3(model[c][0], model[c][1], model[c][2]).length());
+  d.sphere[0] = center.x;
+  d.sphere[1] = center.y;
+  d.sphere[2] = center.z;
+  d.sphere[3] = m->radius * scale;
+  d.material = material;
+  d.index_count = r.count;
+  d.first_index = r.first;
+  d.base_vertex = r.base_vertex;
+  commands.push_back({ (GLuint)r.count, 1, (GLuint)r.first, r.base_vertex, (GLuint)draws.size() });
+  draws.push_back(d);
+}
+
+// Makes the draws of this frame visible to the shaders
+void Batcher::upload()
+{
+  glNamedBufferSubData(draw_buffer, 0, draws.size() * sizeof(draw_data_t), draws.data());
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, D_DRAWS_BLOCK_BINDING, draw_buffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, D_MATERIALS_BLOCK_BINDING, material_buffer);
+}
+
+// Expects the batch shader to be bound, commands may come from anywhere
+void Batcher::draw(GLuint indirect, GLintptr offset, int count)
+{
+  if (count == 0) return;
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect);
+  GLState::bindVertexArray(vao);
+  glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)offset, count, 0);
+  GLState::bindVertexArray(0);
+}
+
+// Draws everything that was added, culling is up to the caller
+void Batcher::submit()
+{
+  if (draws.empty()) return;
+  upload();
+  glNamedBufferSubData(command_buffer, 0, commands.size() * sizeof(draw_command_t), commands.data());
+  draw(command_buffer, 0, commands.size());
+}
+
+Batcher batcher;
+
+}
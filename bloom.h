@@ -0,0 +1,73 @@
+namespace Bloom {
+
+using namespace Textures;
+
+// Glow around the bright parts of the image. The scene is thresholded
+// into a chain of ever smaller targets and then walked back up, each
+// level adding a blurred copy of the one below, which gets a wide and
+// smooth falloff for a handful of cheap passes.
+struct pyramid_t {
+  float threshold;
+  GpuTimer down[D_BLOOM_LEVELS];
+  GpuTimer up[D_BLOOM_LEVELS - 1];
+  int frame;
+
+  void init() {
+    threshold = 0.8f;
+    frame = 0;
+    for(int i=0; i<D_BLOOM_LEVELS; i++) down[i].init();
+    for(int i=0; i<D_BLOOM_LEVELS - 1; i++) up[i].init();
+  }
+
+  double total() const {
+    double ms = 0;
+    for(int i=0; i<D_BLOOM_LEVELS; i++) ms += down[i].ms;
+    for(int i=0; i<D_BLOOM_LEVELS - 1; i++) ms += up[i].ms;
+    return ms;
+  }
+
+  void report() const {
+    for(int i=0; i<D_BLOOM_LEVELS; i++)
+      logDebug("Bloom level %i (%ix%i): down %.3fms up %.3fms", i,
+          FBO::bloom_chain.width[i], FBO::bloom_chain.height[i],
+          down[i].ms, i < D_BLOOM_LEVELS - 1 ? up[i].ms : 0.0);
+    logDebug("Bloom total: %.3fms", total());
+  }
+
+  // Leaves the result in level 0 of the bloom chain
+  void render(Texture scene, Texture cones, const Meshes::Mesh* quad) {
+    GLState::disable(GL_DEPTH_TEST);
+
+    down[0].begin();
+    FBO::bloom_chain.bind(0);
+    Shaders::sh_bloom_prefilter.use(scene, cones, threshold);
+    Meshes::draw(quad);
+    down[0].end();
+
+    for(int i=1; i<D_BLOOM_LEVELS; i++) {
+      down[i].begin();
+      FBO::bloom_chain.bind(i);
+      Shaders::sh_bloom_down.use(FBO::bloom_chain.tex[i - 1]);
+      Meshes::draw(quad);
+      down[i].end();
+    }
+
+    GLState::enable(GL_BLEND);
+    GLState::blendFunc(GL_ONE, GL_ONE);
+    for(int i=D_BLOOM_LEVELS - 2; i>=0; i--) {
+      up[i].begin();
+      FBO::bloom_chain.bind(i);
+      Shaders::sh_bloom_up.use(FBO::bloom_chain.tex[i + 1]);
+      Meshes::draw(quad);
+      up[i].end();
+    }
+    GLState::disable(GL_BLEND);
+
+    GLState::bindVertexArray(0);
+    GLState::enable(GL_DEPTH_TEST);
+
+    if (++frame % 600 == 0) report();
+  }
+} pyramid;
+
+}
@@ -0,0 +1,547 @@
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+namespace Spatial {
+
+enum item_kind { ITEM_MESH, ITEM_LIGHT };
+
+struct item_t {
+  item_kind kind;
+  int index;
+};
+
+// Bounding volume hierarchy over the scene. Moving an item only refits
+// the boxes above its leaf, once enough of the tree has been refit the
+// whole thing is rebuilt on a worker thread and swapped in by update().
+// The worker is started with the first rebuild and sleeps in between.
+class DynamicTree
+{
+  private:
+    struct node_t {
+      AABB box;
+      int parent, left, right; // left is -1 for leaves
+      int proxy;               // leaves only
+    };
+
+    struct proxy_t {
+      AABB box;                // fattened by margin
+      item_t item;
+      int leaf;                // -1 when not in the tree
+      bool alive;
+    };
+
+    struct build_leaf_t {
+      AABB box;
+      Vector3 center;
+      int proxy;
+    };
+
+    struct job_t {
+      std::vector<build_leaf_t> leaves;
+      std::vector<node_t> nodes;
+      int root;
+      std::thread thread;
+      std::mutex lock;
+      std::condition_variable wake;
+      bool requested, quit;     // guarded by lock
+      std::atomic<bool> done;
+      bool running;
+    };
+
+    std::vector<node_t> nodes;
+    std::vector<proxy_t> proxies;
+    std::vector<int> free_nodes, free_proxies;
+    mutable std::vector<int> stack; // queries are not reentrant
+    int root;
+    int leaves;
+    int refits;
+    job_t job;
+
+    int allocNode();
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+    void refitUp(int node);
+    static int build(std::vector<node_t> &out, std::vector<build_leaf_t> &in, int begin, int end, int parent);
+    void startRebuild();
+    void finishRebuild();
+    void work();
+
+    friend void benchmark(int count);
+
+  public:
+    float margin;   // slack added to every box so jitter does not touch the tree
+    int rebuilds;   // completed background rebuilds
+    // A rebuild starts once there are more than min_rebuild_leaves and
+    // more refits since the last one than there are leaves
+    int min_rebuild_leaves;
+
+    DynamicTree();
+    ~DynamicTree();
+
+    int insert(const AABB &box, item_t item);
+    void remove(int proxy);
+    void move(int proxy, const AABB &box);
+    void update();
+    int size() const { return leaves; }
+
+    template <typename F> void query(const Frustum &frustum, F visit) const;
+    template <typename F> void query(const Vector3 &center, float radius, F visit) const;
+    template <typename F> void query(const Ray &ray, F visit) const;
+    template <typename F> void query(const Plane &plane, F visit) const;
+};
+
+DynamicTree::DynamicTree()
+{
+  root = -1;
+  leaves = 0;
+  refits = 0;
+  margin = 0.5f;
+  rebuilds = 0;
+  min_rebuild_leaves = 256;
+  job.done = false;
+  job.running = false;
+  job.requested = false;
+  job.quit = false;
+}
+
+DynamicTree::~DynamicTree()
+{
+  if (!job.thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> guard(job.lock);
+    job.quit = true;
+  }
+  job.wake.notify_one();
+  job.thread.join();
+}
+
+int DynamicTree::allocNode()
+{
+  if (!free_nodes.empty()) {
+    int n = free_nodes.back();
+    free_nodes.pop_back();
+    return n;
+  }
+  nodes.push_back(node_t());
+  return nodes.size() - 1;
+}
+
+void DynamicTree::refitUp(int node)
+{
+  while (node != -1) {
+    node_t &n = nodes[node];
+    n.box = AABB::Merge(nodes[n.left].box, nodes[n.right].box);
+    node = n.parent;
+  }
+}
+
+void DynamicTree::insertLeaf(int leaf)
+{
+  leaves++;
+  if (root == -1) {
+    root = leaf;
+    nodes[leaf].parent = -1;
+    return;
+  }
+
+  // Walk down to the sibling that grows the total surface area the least
+  const AABB box = nodes[leaf].box;
+  int index = root;
+  while (nodes[index].left != -1) {
+    const node_t &n = nodes[index];
+    float area = n.box.surfaceArea();
+    float combined = AABB::Merge(n.box, box).surfaceArea();
+    float cost = 2 * combined;
+    float inherited = 2 * (combined - area);
+
+    float child_cost[2];
+    int children[2] = { n.left, n.right };
+    for(int c=0; c<2; c++) {
+      const node_t &child = nodes[children[c]];
+      float grown = AABB::Merge(child.box, box).surfaceArea();
+      if (child.left == -1) child_cost[c] = grown + inherited;
+      else                  child_cost[c] = grown - child.box.surfaceArea() + inherited;
+    }
+
+    if (cost < child_cost[0] && cost < child_cost[1]) break;
+    index = child_cost[0] < child_cost[1] ? children[0] : children[1];
+  }
+
+  int sibling = index;
+  int old_parent = nodes[sibling].parent;
+  int parent = allocNode();
+  nodes[parent].parent = old_parent;
+  nodes[parent].left = sibling;
+  nodes[parent].right = leaf;
+  nodes[parent].proxy = -1;
+  nodes[sibling].parent = parent;
+  nodes[leaf].parent = parent;
+
+  if (old_parent == -1) root = parent;
+  else if (nodes[old_parent].left == sibling) nodes[old_parent].left = parent;
+  else nodes[old_parent].right = parent;
+
+  refitUp(parent);
+}
+
+void DynamicTree::removeLeaf(int leaf)
+{
+  leaves--;
+  if (leaf == root) {
+    root = -1;
+    return;
+  }
+
+  int parent = nodes[leaf].parent;
+  int grand = nodes[parent].parent;
+  int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+  nodes[sibling].parent = grand;
+  if (grand == -1) root = sibling;
+  else {
+    if (nodes[grand].left == parent) nodes[grand].left = sibling;
+    else nodes[grand].right = sibling;
+    refitUp(grand);
+  }
+  free_nodes.push_back(parent);
+}
+
+int DynamicTree::insert(const AABB &box, item_t item)
+{
+  int p;
+  if (!free_proxies.empty()) {
+    p = free_proxies.back();
+    free_proxies.pop_back();
+  } else {
+    proxies.push_back(proxy_t());
+    p = proxies.size() - 1;
+  }
+
+  int leaf = allocNode();
+  nodes[leaf].box = box.fattened(margin);
+  nodes[leaf].left = nodes[leaf].right = -1;
+  nodes[leaf].proxy = p;
+  insertLeaf(leaf);
+
+  proxies[p].box = nodes[leaf].box;
+  proxies[p].item = item;
+  proxies[p].leaf = leaf;
+  proxies[p].alive = true;
+  return p;
+}
+
+void DynamicTree::remove(int proxy)
+{
+  int leaf = proxies[proxy].leaf;
+  removeLeaf(leaf);
+  free_nodes.push_back(leaf);
+  proxies[proxy].leaf = -1;
+  proxies[proxy].alive = false;
+  free_proxies.push_back(proxy);
+}
+
+void DynamicTree::move(int proxy, const AABB &box)
+{
+  proxy_t &p = proxies[proxy];
+  if (p.box.contains(box)) return;
+
+  // Incremental refit, the topology stays until the next rebuild
+  p.box = box.fattened(margin);
+  nodes[p.leaf].box = p.box;
+  refitUp(nodes[p.leaf].parent);
+  refits++;
+}
+
+int DynamicTree::build(std::vector<node_t> &out, std::vector<build_leaf_t> &in, int begin, int end, int parent)
+{
+  int n = out.size();
+  out.push_back(node_t());
+  out[n].parent = parent;
+  out[n].proxy = -1;
+
+  if (end - begin == 1) {
+    out[n].box = in[begin].box;
+    out[n].left = out[n].right = -1;
+    out[n].proxy = in[begin].proxy;
+    return n;
+  }
+
+  // Median split along the widest axis of the centers
+  AABB centers;
+  for(int i=begin; i<end; i++) centers.grow(in[i].center);
+  Vector3 e = centers.extent();
+  int axis = e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2);
+  int mid = (begin + end) / 2;
+  std::nth_element(in.begin() + begin, in.begin() + mid, in.begin() + end,
+      [axis](const build_leaf_t &a, const build_leaf_t &b) {
+        if (axis == 0) return a.center.x < b.center.x;
+        if (axis == 1) return a.center.y < b.center.y;
+        return a.center.z < b.center.z;
+      });
+
+  int left = build(out, in, begin, mid, n);
+  int right = build(out, in, mid, end, n);
+  out[n].left = left;
+  out[n].right = right;
+  out[n].box = AABB::Merge(out[left].box, out[right].box);
+  return n;
+}
+
+void DynamicTree::startRebuild()
+{
+  job.leaves.clear();
+  for(int p=0; p<(int)proxies.size(); p++)
+    if (proxies[p].alive)
+      job.leaves.push_back({ proxies[p].box, proxies[p].box.center(), p });
+
+  refits = 0;
+  job.done = false;
+  job.running = true;
+  if (!job.thread.joinable()) job.thread = std::thread([this]() { work(); });
+  {
+    std::lock_guard<std::mutex> guard(job.lock);
+    job.requested = true;
+  }
+  job.wake.notify_one();
+}
+
+// Worker thread, owns job.nodes from a request until it sets done
+void DynamicTree::work()
+{
+  while(true) {
+    {
+      std::unique_lock<std::mutex> guard(job.lock);
+      job.wake.wait(guard, [this]() { return job.quit || job.requested; });
+      if (job.quit) return;
+      job.requested = false;
+    }
+    job.nodes.clear();
+    job.nodes.reserve(job.leaves.size() * 2);
+    job.root = build(job.nodes, job.leaves, 0, job.leaves.size(), -1);
+    job.done = true;
+  }
+}
+
+void DynamicTree::finishRebuild()
+{
+  job.running = false;
+  rebuilds++;
+
+  nodes.swap(job.nodes);
+  root = job.root;
+  free_nodes.clear();
+  leaves = job.leaves.size();
+
+  // Replay whatever happened to the proxies while the worker was busy
+  for(int p=0; p<(int)proxies.size(); p++) proxies[p].leaf = -1;
+  for(int n=0; n<(int)nodes.size(); n++)
+    if (nodes[n].left == -1) proxies[nodes[n].proxy].leaf = n;
+
+  for(int p=0; p<(int)proxies.size(); p++) {
+    proxy_t &proxy = proxies[p];
+    if (!proxy.alive && proxy.leaf != -1) {
+      removeLeaf(proxy.leaf);
+      free_nodes.push_back(proxy.leaf);
+      proxy.leaf = -1;
+    } else if (proxy.alive && proxy.leaf == -1) {
+      int leaf = allocNode();
+      nodes[leaf].box = proxy.box;
+      nodes[leaf].left = nodes[leaf].right = -1;
+      nodes[leaf].proxy = p;
+      insertLeaf(leaf);
+      proxy.leaf = leaf;
+    } else if (proxy.alive) {
+      const AABB &b = nodes[proxy.leaf].box;
+      if (!b.contains(proxy.box) || !proxy.box.contains(b)) {
+        nodes[proxy.leaf].box = proxy.box;
+        refitUp(nodes[proxy.leaf].parent);
+      }
+    }
+  }
+}
+
+// Call once per frame
+void DynamicTree::update()
+{
+  if (job.running && job.done) finishRebuild();
+  if (!job.running && leaves > min_rebuild_leaves && refits > leaves) startRebuild();
+}
+
+template <typename F>
+void DynamicTree::query(const Frustum &frustum, F visit) const
+{
+  if (root == -1) return;
+  // Negative entries mark subtrees already known to be fully inside
+  stack.clear();
+  stack.push_back(root + 1);
+  while (!stack.empty()) {
+    int entry = stack.back();
+    stack.pop_back();
+    bool inside = entry < 0;
+    const node_t &n = nodes[abs(entry) - 1];
+
+    if (!inside) {
+      int c = frustum.classify(n.box);
+      if (c == Frustum::OUTSIDE) continue;
+      inside = c == Frustum::INSIDE;
+    }
+
+    if (n.left == -1) { visit(proxies[n.proxy].item); continue; }
+    stack.push_back(inside ? -(n.left + 1) : n.left + 1);
+    stack.push_back(inside ? -(n.right + 1) : n.right + 1);
+  }
+}
+
+template <typename F>
+void DynamicTree::query(const Vector3 &center, float radius, F visit) const
+{
+  if (root == -1) return;
+  stack.clear();
+  stack.push_back(root);
+  while (!stack.empty()) {
+    const node_t &n = nodes[stack.back()];
+    stack.pop_back();
+    if (!n.box.overlaps(center, radius)) continue;
+    if (n.left == -1) { visit(proxies[n.proxy].item); continue; }
+    stack.push_back(n.left);
+    stack.push_back(n.right);
+  }
+}
+
+// visit gets the item and the distance at which the ray enters its box
+template <typename F>
+void DynamicTree::query(const Ray &ray, F visit) const
+{
+  if (root == -1) return;
+  stack.clear();
+  stack.push_back(root);
+  while (!stack.empty()) {
+    const node_t &n = nodes[stack.back()];
+    stack.pop_back();
+    float t;
+    if (!n.box.intersects(ray, &t)) continue;
+    if (n.left == -1) { visit(proxies[n.proxy].item, t); continue; }
+    stack.push_back(n.left);
+    stack.push_back(n.right);
+  }
+}
+
+// visit gets every item whose box the plane cuts through
+template <typename F>
+void DynamicTree::query(const Plane &plane, F visit) const
+{
+  if (root == -1) return;
+  const Vector3 &n = plane.normal;
+  stack.clear();
+  stack.push_back(root);
+  while (!stack.empty()) {
+    const node_t &node = nodes[stack.back()];
+    stack.pop_back();
+    const AABB &b = node.box;
+    // Corners furthest along and against the normal
+    Vector3 p = Vector3(n.x >= 0 ? b.max.x : b.min.x, n.y >= 0 ? b.max.y : b.min.y, n.z >= 0 ? b.max.z : b.min.z);
+    Vector3 q = Vector3(n.x >= 0 ? b.min.x : b.max.x, n.y >= 0 ? b.min.y : b.max.y, n.z >= 0 ? b.min.z : b.max.z);
+    if (plane.distance(p) < 0 || plane.distance(q) > 0) continue;
+    if (node.left == -1) { visit(proxies[node.proxy].item); continue; }
+    stack.push_back(node.left);
+    stack.push_back(node.right);
+  }
+}
+
+// Inserts, moves and queries count random boxes, every query checked
+// against a linear scan of the same boxes
+void benchmark(int count)
+{
+  srand(1);
+  auto random = [](float range) { return (rand() / (float)RAND_MAX - 0.5f) * range; };
+  const float world = 20 * cbrt((float)count);
+  std::vector<AABB> boxes(count);
+  for(AABB &b : boxes) b = AABB::FromSphere(Vector3(random(world), random(world), random(world)), 0.5f + random(1));
+
+  auto ms_since = [](std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+  };
+
+  DynamicTree tree;
+  std::vector<int> proxies(count);
+  auto start = std::chrono::high_resolution_clock::now();
+  for(int i=0; i<count; i++) proxies[i] = tree.insert(boxes[i], { ITEM_MESH, i });
+  double insert_ms = ms_since(start);
+
+  // A tenth of the boxes move far enough to leave their fattened box
+  start = std::chrono::high_resolution_clock::now();
+  for(int i=0; i<count; i+=10) {
+    boxes[i] = AABB::FromSphere(boxes[i].center() + Vector3(random(8), random(8), random(8)), 0.5f);
+    tree.move(proxies[i], boxes[i]);
+  }
+  double move_ms = ms_since(start);
+
+  // Forces a rebuild of everything and waits for it
+  start = std::chrono::high_resolution_clock::now();
+  tree.refits = tree.leaves + 1;
+  int rebuilds = tree.rebuilds;
+  tree.min_rebuild_leaves = 0;
+  tree.update();
+  while(tree.rebuilds == rebuilds) {
+    std::this_thread::yield();
+    tree.update();
+  }
+  double rebuild_ms = ms_since(start);
+
+  // Scans the fattened boxes the tree holds
+  auto check = [&](const char* what, int found, std::function<bool(const AABB&)> hit) {
+    int expected = 0;
+    auto scan = std::chrono::high_resolution_clock::now();
+    for(int p : proxies) expected += hit(tree.proxies[p].box);
+    double scan_ms = ms_since(scan);
+    if (found != expected) {
+      logError("BVH %s query found %i of %i boxes", what, found, expected);
+      exit(14);
+    }
+    return scan_ms;
+  };
+
+  Matrix4 camera = Matrix4::FromPerspective(1.25, 4.0 / 3, 1, world)
+    * Matrix4::FromLookAt(Vector3(0), Vector3(1, 0, 1), Vector3(0, 1, 0));
+  Frustum frustum(camera);
+  Vector3 center = Vector3(world / 8, 0, 0);
+  float radius = world / 8;
+  Ray ray(Vector3(-world, 0.1f, 0.2f), Vector3(1, 0, 0), 2 * world);
+  Plane plane(Vector3(1, 1, 0), 0);
+
+  int found = 0;
+  start = std::chrono::high_resolution_clock::now();
+  tree.query(frustum, [&](item_t) { found++; });
+  double frustum_ms = ms_since(start);
+  double frustum_scan = check("frustum", found, [&](const AABB &b) { return frustum.classify(b) != Frustum::OUTSIDE; });
+
+  found = 0;
+  start = std::chrono::high_resolution_clock::now();
+  tree.query(center, radius, [&](item_t) { found++; });
+  double sphere_ms = ms_since(start);
+  double sphere_scan = check("sphere", found, [&](const AABB &b) { return b.overlaps(center, radius); });
+
+  found = 0;
+  start = std::chrono::high_resolution_clock::now();
+  tree.query(ray, [&](item_t, float) { found++; });
+  double ray_ms = ms_since(start);
+  double ray_scan = check("ray", found, [&](const AABB &b) { float t; return b.intersects(ray, &t); });
+
+  found = 0;
+  start = std::chrono::high_resolution_clock::now();
+  tree.query(plane, [&](item_t) { found++; });
+  double plane_ms = ms_since(start);
+  double plane_scan = check("plane", found, [&](const AABB &b) {
+    const Vector3 &n = plane.normal;
+    Vector3 p = Vector3(n.x >= 0 ? b.max.x : b.min.x, n.y >= 0 ? b.max.y : b.min.y, n.z >= 0 ? b.max.z : b.min.z);
+    Vector3 q = Vector3(n.x >= 0 ? b.min.x : b.max.x, n.y >= 0 ? b.min.y : b.max.y, n.z >= 0 ? b.min.z : b.max.z);
+    return plane.distance(p) >= 0 && plane.distance(q) <= 0;
+  });
+
+  logInfo("BVH %i boxes: insert %.2fms, move %i %.2fms, rebuild %.2fms", count, insert_ms, count / 10, move_ms, rebuild_ms);
+  logInfo("  queries (tree / scan): frustum %.3f / %.3fms, sphere %.3f / %.3fms, ray %.3f / %.3fms, plane %.3f / %.3fms",
+      frustum_ms, frustum_scan, sphere_ms, sphere_scan, ray_ms, ray_scan, plane_ms, plane_scan);
+}
+
+}
@@ -14,9 +14,11 @@ private:
 
 public:
    Camera(float fov);
-   void update(float ratio, Keyboard* keyboard);
+   float eye_height;
+   void update(float ratio, Keyboard* keyboard, float ground);
    Matrix4 getMatrix() const { return matrix; }
    Vector3 getPosition() const { return pos; }
+   float getFov() const { return fov; }
    void setPosition(Vector3 v) { pos = v; }
 };
 
@@ -26,11 +28,13 @@ Camera::Camera(float fov)
   viewDir = Vector3(0, 0, -1); 
   this->fov = fov;
   gravity = 0.05f;
+  eye_height = 17;
 }
 
-void Camera::update(float ratio, Keyboard* keyboard)
+// ground is the height of the terrain below the camera
+void Camera::update(float ratio, Keyboard* keyboard, float ground)
 {
-  if (pos.y + velocity.y > 17) {
+  if (pos.y + velocity.y > ground + eye_height) {
     pos += velocity;
     velocity.y -= gravity;
   } else {
@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace Commands {
+
+// Worker threads shared by every parallelFor, started the first time a
+// job needs them and parked between jobs. Jobs come from the main thread
+// only, one at a time.
+class Pool {
+  public:
+    ~Pool() {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+      }
+      wake.notify_all();
+      for(std::thread &t : threads) t.join();
+    }
+
+    // Runs job(t) for every t in [1, n) on the workers and job(0) on the
+    // caller, returns once all of them are done
+    void run(int n, const std::function<void(int)> &job) {
+      while ((int)threads.size() < n - 1) {
+        int t = threads.size() + 1;
+        unsigned seen = generation;
+        threads.push_back(std::thread([this, t, seen]() { work(t, seen); }));
+      }
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        current = &job;
+        active = n;
+        pending = n - 1;
+        generation++;
+      }
+      wake.notify_all();
+      job(0);
+      std::unique_lock<std::mutex> guard(lock);
+      finished.wait(guard, [this]() { return pending == 0; });
+      current = NULL;
+    }
+
+  private:
+    void work(int t, unsigned seen) {
+      while(true) {
+        const std::function<void(int)>* job;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          wake.wait(guard, [&]() { return quit || generation != seen; });
+          if (quit) return;
+          seen = generation;
+          if (t >= active) continue;
+          job = current;
+        }
+        (*job)(t);
+        std::lock_guard<std::mutex> guard(lock);
+        if (--pending == 0) finished.notify_one();
+      }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake, finished;
+    // guarded by lock
+    const std::function<void(int)>* current = NULL;
+    unsigned generation = 0;
+    int active = 0, pending = 0;
+    bool quit = false;
+};
+
+static Pool pool;
+
+// Runs fn(worker, begin, end) over disjoint slices of [0, count), on
+// more threads only when every one gets at least min_per_worker
+template <typename F>
+void parallelFor(int count, int min_per_worker, int workers, F fn)
+{
+  int n = std::max(1, std::min(workers, count / std::max(min_per_worker, 1)));
+  if (n == 1) {
+    fn(0, 0, count);
+    return;
+  }
+  int range = (count + n - 1) / n;
+  pool.run(n, [&](int t) { fn(t, std::min(t * range, count), std::min((t + 1) * range, count)); });
+}
+
+enum op {
+  OP_PROGRAM,
+  OP_VAO,
+  OP_TEXTURE,
+  OP_ENABLE,
+  OP_DISABLE,
+  OP_BLEND_FUNC,
+  OP_DEPTH,
+  OP_UNIFORM_1F,
+  OP_UNIFORM_MAT4,
+  OP_BIND_RANGE,
+  OP_DRAW_ARRAYS,
+  OP_DRAW_ELEMENTS,
+  OP_BEGIN_CONDITIONAL,
+  OP_END_CONDITIONAL,
+  OP_CALL,
+};
+
+struct texture_t { GLuint unit, texture; };
+struct blend_t { GLenum src, dst; };
+struct depth_t { GLenum func; GLboolean write; };
+struct uniform_1f_t { GLint location; float value; };
+struct uniform_mat4_t { GLint location; float value[16]; };
+struct range_t { GLenum target; GLuint index, buffer; GLintptr offset; GLsizeiptr size; };
+struct draw_t { GLenum mode; GLint first; GLsizei count, instances; GLint base_vertex; };
+
+// Linear list of commands, recorded without touching GL so any thread
+// can fill one, and replayed on the GL thread. Every command is a 32 bit
+// op followed by its fixed size payload.
+class CommandBuffer {
+  public:
+    void clear() { data.clear(); }
+    size_t size() const { return data.size(); }
+
+    void bindProgram(GLuint program) { push(OP_PROGRAM, program); }
+    void bindVertexArray(GLuint vao) { push(OP_VAO, vao); }
+    void bindTexture(GLuint unit, GLuint texture) { push(OP_TEXTURE, texture_t{ unit, texture }); }
+    void enable(GLenum cap) { push(OP_ENABLE, cap); }
+    void disable(GLenum cap) { push(OP_DISABLE, cap); }
+    void blendFunc(GLenum src, GLenum dst) { push(OP_BLEND_FUNC, blend_t{ src, dst }); }
+    void depth(GLenum func, GLboolean write) { push(OP_DEPTH, depth_t{ func, write }); }
+    void uniform(GLint location, float value) { push(OP_UNIFORM_1F, uniform_1f_t{ location, value }); }
+    void uniform(GLint location, const mat4x4 value) {
+      uniform_mat4_t u;
+      u.location = location;
+      memcpy(u.value, value, sizeof(u.value));
+      push(OP_UNIFORM_MAT4, u);
+    }
+    void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+      push(OP_BIND_RANGE, range_t{ target, index, buffer, offset, size });
+    }
+    void drawArrays(GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+      push(OP_DRAW_ARRAYS, draw_t{ mode, first, count, instances, 0 });
+    }
+    // Unsigned int indices from first in the element buffer, offset by
+    // base_vertex
+    void drawElements(GLenum mode, GLint first, GLsizei count, GLsizei instances, GLint base_vertex) {
+      push(OP_DRAW_ELEMENTS, draw_t{ mode, first, count, instances, base_vertex });
+    }
+    // Draws in between only happen if the query saw a sample, or has no
+    // result yet
+    void beginConditional(GLuint query) { push(OP_BEGIN_CONDITIONAL, query); }
+    void endConditional() { push(OP_END_CONDITIONAL, 0); }
+    // Anything that needs GL of its own, the function has to outlive
+    // the replay
+    void call(const std::function<void()>* fn) { push(OP_CALL, fn); }
+
+    void replay() const;
+
+  private:
+    std::vector<uint8_t> data;
+
+    template <typename T>
+    void push(uint32_t op, const T &payload) {
+      size_t at = data.size();
+      data.resize(at + sizeof(op) + sizeof(T));
+      memcpy(&data[at], &op, sizeof(op));
+      memcpy(&data[at + sizeof(op)], &payload, sizeof(T));
+    }
+};
+
+template <typename T>
+static inline const uint8_t* read(const uint8_t* p, T &out)
+{
+  memcpy(&out, p, sizeof(T));
+  return p + sizeof(T);
+}
+
+void CommandBuffer::replay() const
+{
+  const uint8_t* p = data.data();
+  const uint8_t* end = p + data.size();
+  while(p < end) {
+    uint32_t op;
+    p = read(p, op);
+    switch(op) {
+      case OP_PROGRAM: { GLuint v; p = read(p, v); GLState::useProgram(v); break; }
+      case OP_VAO:     { GLuint v; p = read(p, v); GLState::bindVertexArray(v); break; }
+      case OP_TEXTURE: { texture_t v; p = read(p, v); GLState::bindTexture(v.unit, v.texture); break; }
+      case OP_ENABLE:  { GLenum v; p = read(p, v); GLState::enable(v); break; }
+      case OP_DISABLE: { GLenum v; p = read(p, v); GLState::disable(v); break; }
+      case OP_BLEND_FUNC: { blend_t v; p = read(p, v); GLState::blendFunc(v.src, v.dst); break; }
+      case OP_DEPTH: { depth_t v; p = read(p, v); GLState::depthFunc(v.func); GLState::depthMask(v.write); break; }
+      case OP_UNIFORM_1F: { uniform_1f_t v; p = read(p, v); glUniform1f(v.location, v.value); break; }
+      case OP_UNIFORM_MAT4: {
+        uniform_mat4_t v;
+        p = read(p, v);
+        glUniformMatrix4fv(v.location, 1, GL_FALSE, v.value);
+        break;
+      }
+      case OP_BIND_RANGE: {
+        range_t v;
+        p = read(p, v);
+        glBindBufferRange(v.target, v.index, v.buffer, v.offset, v.size);
+        break;
+      }
+      case OP_DRAW_ARRAYS: {
+        draw_t v;
+        p = read(p, v);
+        glDrawArraysInstanced(v.mode, v.first, v.count, v.instances);
+        break;
+      }
+      case OP_DRAW_ELEMENTS: {
+        draw_t v;
+        p = read(p, v);
+        glDrawElementsInstancedBaseVertex(v.mode, v.count, GL_UNSIGNED_INT,
+            (void*)(sizeof(GLuint) * v.first), v.instances, v.base_vertex);
+        break;
+      }
+      case OP_BEGIN_CONDITIONAL: {
+        GLuint v;
+        p = read(p, v);
+        glBeginConditionalRender(v, GL_QUERY_NO_WAIT);
+        break;
+      }
+      case OP_END_CONDITIONAL: { int v; p = read(p, v); glEndConditionalRender(); break; }
+      case OP_CALL: { const std::function<void()>* fn; p = read(p, fn); (*fn)(); break; }
+      default:
+        logError("Unknown command %u", op);
+        exit(10);
+    }
+  }
+}
+
+// One command buffer per worker, filled for consecutive slices of the
+// work and replayed in slice order
+class Recorder {
+  public:
+    int min_per_worker; // items below which another thread does not pay off
+    int workers;
+
+    Recorder() {
+      min_per_worker = 2048;
+      workers = std::max(1, (int)std::thread::hardware_concurrency());
+      buffers.resize(workers);
+    }
+
+    // fn(buffer, worker, begin, end) records the slice into the buffer
+    template <typename F>
+    void record(int count, F fn) {
+      buffers.resize(workers);
+      for(CommandBuffer &b : buffers) b.clear();
+      parallelFor(count, min_per_worker, workers, [&](int worker, int begin, int end) {
+        fn(buffers[worker], worker, begin, end);
+      });
+    }
+
+    void replay() const {
+      for(const CommandBuffer &b : buffers) b.replay();
+    }
+
+    size_t size() const {
+      size_t total = 0;
+      for(const CommandBuffer &b : buffers) total += b.size();
+      return total;
+    }
+
+  private:
+    std::vector<CommandBuffer> buffers;
+};
+
+}
@@ -0,0 +1,280 @@
+namespace Culling {
+
+using namespace Textures;
+
+// Bounding spheres laid out for the frustum test, one array per
+// component. The count is padded to whole registers with spheres that
+// fail every plane.
+struct sphere_set_t {
+  std::vector<float> x, y, z, r;
+  int count;
+
+  void resize(int n) {
+    count = n;
+    int padded = (n + 7) / 8 * 8;
+    x.assign(padded, 0);
+    y.assign(padded, 0);
+    z.assign(padded, 0);
+    r.assign(padded, -std::numeric_limits<float>::infinity());
+  }
+  void set(int i, const Vector3 &center, float radius) {
+    x[i] = center.x;
+    y[i] = center.y;
+    z[i] = center.z;
+    r[i] = radius;
+  }
+};
+
+// Tests a register of spheres against all six planes at once and
+// appends the indices of the ones at least partially inside
+template <int W>
+static void cullSpheres(const Frustum &frustum, const sphere_set_t &set, int begin, int end, std::vector<int> &out)
+{
+  typedef lanes<W> L;
+  typename L::V nx[6], ny[6], nz[6], nd[6];
+  for(int p=0; p<6; p++) {
+    const Plane &plane = frustum.planes[p];
+    nx[p] = L::set(plane.normal.x);
+    ny[p] = L::set(plane.normal.y);
+    nz[p] = L::set(plane.normal.z);
+    nd[p] = L::set(-Vector3::dot(plane.normal, plane.pos));
+  }
+
+  const typename L::V zero = L::set(0);
+  for(int i=begin; i<end; i+=W) {
+    typename L::V x = L::load(&set.x[i]), y = L::load(&set.y[i]);
+    typename L::V z = L::load(&set.z[i]), r = L::load(&set.r[i]);
+    typename L::V inside = L::cmpgt(L::add(L::add(L::mul(nx[0], x), L::mul(ny[0], y)),
+          L::add(L::mul(nz[0], z), L::add(nd[0], r))), zero);
+    for(int p=1; p<6; p++) {
+      typename L::V d = L::add(L::add(L::mul(nx[p], x), L::mul(ny[p], y)),
+          L::add(L::mul(nz[p], z), L::add(nd[p], r)));
+      inside = L::and_(inside, L::cmpgt(d, zero));
+    }
+    for(int bits = L::mask(inside); bits; bits &= bits - 1)
+      out.push_back(i + __builtin_ctz(bits));
+  }
+}
+
+// Frustum culling of a sphere set, big sets are split in register
+// aligned ranges between worker threads
+class FrustumCuller
+{
+  private:
+    std::vector<std::vector<int>> partial;
+
+  public:
+    int min_per_worker; // spheres below which another thread does not pay off
+    int workers;
+
+    FrustumCuller() {
+      min_per_worker = 16384;
+      workers = std::max(1, (int)std::thread::hardware_concurrency());
+      partial.resize(workers);
+    }
+
+    void cull(const Frustum &frustum, const sphere_set_t &set, std::vector<int> &visible) {
+      visible.clear();
+      // Split in blocks of 8 spheres, the first slice goes straight into
+      // visible so a single thread copies nothing
+      int blocks = (set.count + 7) / 8;
+      partial.resize(workers);
+      for(std::vector<int> &p : partial) p.clear();
+      Commands::parallelFor(blocks, std::max(min_per_worker / 8, 1), workers, [&](int t, int begin, int end) {
+        cullSpheres<wide>(frustum, set, begin * 8, end * 8, t == 0 ? visible : partial[t]);
+      });
+      for(int t=1; t<workers; t++) visible.insert(visible.end(), partial[t].begin(), partial[t].end());
+    }
+};
+
+// Culls random spheres around a camera a few hundred times and reports
+// the cost of a single sphere test, without and with worker threads
+void benchmarkFrustum(int count)
+{
+  sphere_set_t set;
+  set.resize(count);
+  srand(1);
+  for(int i=0; i<count; i++) {
+    Vector3 p = Vector3(rand() % 2000 - 1000, rand() % 200 - 100, rand() % 2000 - 1000);
+    set.set(i, p, 0.5f + (rand() % 100) / 50.0f);
+  }
+  Matrix4 camera = Matrix4::FromPerspective(1.25, 4.0 / 3, 1, 1000)
+    * Matrix4::FromLookAt(Vector3(0, 10, 0), Vector3(1, 10, 1), Vector3(0, 1, 0));
+  Frustum frustum(camera);
+
+  FrustumCuller culler;
+  std::vector<int> visible;
+  for(int threaded=0; threaded<2; threaded++) {
+    if (!threaded) culler.min_per_worker = std::numeric_limits<int>::max();
+    else           culler.min_per_worker = 16384;
+    const int runs = 200;
+    auto start = std::chrono::high_resolution_clock::now();
+    for(int i=0; i<runs; i++) culler.cull(frustum, set, visible);
+    double ns = std::chrono::duration<double, std::nano>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    logInfo("Frustum culling %i spheres, %i lanes, %s: %i visible, %.3fns per test",
+        count, wide, threaded ? "threaded" : "single thread", (int)visible.size(), ns / runs / count);
+  }
+}
+
+// Farthest depth pyramid of the g buffer, level 0 is half resolution
+struct hiz_t {
+  Resources::Object tex;
+  int width[D_HIZ_LEVELS], height[D_HIZ_LEVELS];
+
+  void init() {
+    tex = Resources::createTexture(GL_TEXTURE_2D);
+    glTextureStorage2D(tex, D_HIZ_LEVELS, GL_R32F, D_HIZ_WIDTH, D_HIZ_HEIGHT);
+    glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    for(int i=0, w=D_HIZ_WIDTH, h=D_HIZ_HEIGHT; i<D_HIZ_LEVELS; i++) {
+      width[i] = w;
+      height[i] = h;
+      w = std::max(1, (w + 1) / 2);
+      h = std::max(1, (h + 1) / 2);
+    }
+  }
+
+  void build(Texture depth) {
+    for(int i=0; i<D_HIZ_LEVELS; i++) {
+      if (i == 0) Shaders::sh_hiz_reduce.use(depth, 0);
+      else        Shaders::sh_hiz_reduce.use(tex, i - 1);
+      glBindImageTexture(0, tex, i, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+      glDispatchCompute((width[i] + 7) / 8, (height[i] + 7) / 8, 1);
+      glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+  }
+};
+
+// Culls the batched draws on the gpu and draws what survives. Draws that
+// the previous frame's pyramid hides are retested against a pyramid of
+// what the first phase drew, so anything that comes into view shows up
+// in the same frame instead of one late.
+class GpuCuller
+{
+  private:
+    static const int ring_size = 3;
+
+    hiz_t hiz;
+    Resources::Object commands, status, counters;
+    Resources::Object readback[ring_size];
+    GLsync fences[ring_size];
+    int frame;
+    Matrix4 prev_camera;
+    bool history;
+
+    void cull(const Frustum &frustum, const Matrix4 &occlusion_camera, int phase, int count);
+    void readStats();
+
+  public:
+    // Of the last frame that made it back to the cpu
+    GLuint visible[2], outside, occluded;
+
+    void init(int capacity);
+    void release();
+    void invalidate() { history = false; }
+    void run(Batch::Batcher &batcher, const Matrix4 &camera, Texture albedo, Texture depth);
+};
+
+void GpuCuller::init(int capacity)
+{
+  hiz.init();
+
+  // One region of commands per phase, the unused tail is zero and skipped
+  // Written and cleared on the gpu only
+  commands = Resources::createBuffer();
+  glNamedBufferStorage(commands, 2 * capacity * sizeof(Batch::draw_command_t), NULL, 0);
+  status = Resources::createBuffer();
+  glNamedBufferStorage(status, capacity * sizeof(GLuint), NULL, 0);
+  counters = Resources::createBuffer();
+  glNamedBufferStorage(counters, 4 * sizeof(GLuint), NULL, 0);
+
+  for(int i=0; i<ring_size; i++) {
+    readback[i] = Resources::createBuffer();
+    glNamedBufferStorage(readback[i], 4 * sizeof(GLuint), NULL, GL_CLIENT_STORAGE_BIT);
+    fences[i] = 0;
+  }
+
+  frame = 0;
+  history = false;
+  visible[0] = visible[1] = outside = occluded = 0;
+}
+
+void GpuCuller::release()
+{
+  hiz.tex.reset();
+  commands.reset();
+  status.reset();
+  counters.reset();
+  for(int i=0; i<ring_size; i++) {
+    readback[i].reset();
+    if (fences[i]) glDeleteSync(fences[i]);
+    fences[i] = 0;
+  }
+}
+
+void GpuCuller::cull(const Frustum &frustum, const Matrix4 &occlusion_camera, int phase, int count)
+{
+  Shaders::sh_cull.use(frustum, occlusion_camera, phase, count, phase == 2 || history, hiz.tex);
+  glDispatchCompute((count + 63) / 64, 1, 1);
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// The counters are copied into a ring and read once their fence passed,
+// so the cpu never waits on the frame it just submitted
+void GpuCuller::readStats()
+{
+  int slot = frame % ring_size;
+  glCopyNamedBufferSubData(counters, readback[slot], 0, 0, 4 * sizeof(GLuint));
+  if (fences[slot]) glDeleteSync(fences[slot]);
+  fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  int oldest = (frame + 1) % ring_size;
+  if (fences[oldest] && glClientWaitSync(fences[oldest], 0, 0) != GL_TIMEOUT_EXPIRED) {
+    GLuint result[4];
+    glGetNamedBufferSubData(readback[oldest], 0, sizeof(result), result);
+    visible[0] = result[0];
+    visible[1] = result[1];
+    outside = result[2];
+    occluded = result[3];
+  }
+}
+
+// Expects the g buffer to be bound, leaves the pyramid of this frame
+// behind for the next one
+void GpuCuller::run(Batch::Batcher &batcher, const Matrix4 &camera, Texture albedo, Texture depth)
+{
+  int count = batcher.size();
+  if (count == 0) return;
+  batcher.upload();
+
+  const GLuint zero = 0;
+  glClearNamedBufferData(commands, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+  glClearNamedBufferData(counters, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, D_COMMANDS_BLOCK_BINDING, commands);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, D_CULL_STATUS_BLOCK_BINDING, status);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, D_CULL_COUNTERS_BLOCK_BINDING, counters);
+
+  // There is no indirect count on 4.5, both phases draw the whole region
+  // and the commands nobody wrote have no instances
+  Frustum frustum(camera);
+  cull(frustum, prev_camera, 1, count);
+  Shaders::sh_batch.use(camera, albedo);
+  batcher.draw(commands, 0, count);
+
+  hiz.build(depth);
+  cull(frustum, camera, 2, count);
+  Shaders::sh_batch.use(camera, albedo);
+  batcher.draw(commands, count * sizeof(Batch::draw_command_t), count);
+
+  readStats();
+  prev_camera = camera;
+  history = true;
+  frame++;
+}
+
+GpuCuller culler;
+
+}
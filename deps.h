@@ -19,32 +19,102 @@
 #define D_UV_BUFFER_INDEX        2
 #define D_TANGENT_BUFFER_INDEX   3
 #define D_BITANGENT_BUFFER_INDEX 4
+#define D_INSTANCE_MODEL_INDEX   5 // mat4, takes 5 to 8
+#define D_INSTANCE_COLOR_INDEX   9
+#define D_INSTANCE_CONE_INDEX    10
+#define D_DRAW_INDEX             11 // per instance, the batched draw
 
 // Uniforms
 #define D_CAMERA_UNIFORM_INDEX        0
-#define D_MVP_UNIFORM_INDEX           1
 #define D_CAMERAPOS_UNIFORM_INDEX     2
 #define D_TEXTURE_SCALE_UNIFORM_INDEX 3
 #define D_TIME_UNIFORM_INDEX          4
+#define D_NODE_UNIFORM_INDEX          9
+#define D_MORPH_UNIFORM_INDEX         10
+#define D_HEIGHT_MAP_UNIFORM_INDEX    11
+#define D_TESSELLATION_UNIFORM_INDEX  13
+#define D_EXTENT_UNIFORM_INDEX        14
+#define D_SCALE_UNIFORM_INDEX         3
+#define D_THRESHOLD_UNIFORM_INDEX     3
+#define D_BOX_UNIFORM_INDEX           5 // min, max at 6
 
 // Textures
 #define D_TEXTURE_MATERIAL_INDEX        5
 #define D_TEXTURE_NORMALMAP_INDEX       6
 #define D_TEXTURE_MATERIAL2_INDEX       7
 #define D_TEXTURE_MATERIAL3_INDEX       8
+#define D_TEXTURE_HEIGHTS_INDEX         12
 #define D_NORMAL_GTEXTURE_INDEX         15
 #define D_MATERIAL_GTEXTURE_INDEX       16
 #define D_DEPTH_GTEXTURE_INDEX          17
 #define D_CONE_GTEXTURE_INDEX           18
 #define D_CONE_DEPTH_GTEXTURE_INDEX     19
+#define D_SHADOW_ATLAS_GTEXTURE_INDEX   20
+#define D_FOG_GTEXTURE_INDEX            22
+#define D_BLOOM_GTEXTURE_INDEX          23
+
+// Uniform blocks
+#define D_LIGHTS_BLOCK_BINDING 0
+#define D_SHADOW_BLOCK_BINDING 1
+#define D_DRAWS_BLOCK_BINDING     2 // storage blocks
+#define D_MATERIALS_BLOCK_BINDING 3
+#define D_COMMANDS_BLOCK_BINDING  4
+#define D_CULL_STATUS_BLOCK_BINDING   5
+#define D_CULL_COUNTERS_BLOCK_BINDING 6
+#define D_TRANSFORM_BLOCK_BINDING     7 // per draw, from the frame ring
 
 // FRAMEBUFFERS
 #define D_FRAMEBUFFER_WIDTH  640
 #define D_FRAMEBUFFER_HEIGHT 480
 
+// CONES
+#define D_CONE_SCALE    2 // the cone buffer is this many times smaller on each axis
+#define D_CONE_WIDTH    (D_FRAMEBUFFER_WIDTH / D_CONE_SCALE)
+#define D_CONE_HEIGHT   (D_FRAMEBUFFER_HEIGHT / D_CONE_SCALE)
+#define D_CONE_SEGMENTS 20
+#define D_MAX_CONES     32
+
+// BLOOM
+#define D_BLOOM_LEVELS  5 // the last level is 1/32 of the framebuffer
+
+// VOLUMETRICS
+#define D_FROXEL_X      80
+#define D_FROXEL_Y      60
+#define D_FROXEL_Z      64
+#define D_FROXEL_NEAR   1.0
+#define D_FROXEL_FAR    300.0
+#define D_FOG_DENSITY   0.02
+
+// TERRAIN
+#define D_TERRAIN_GRID   16    // quads per chunk side
+#define D_TERRAIN_LEVELS 8     // the root chunk is 2^7 leaves across
+#define D_TERRAIN_LEAF   80.0  // world size of the finest chunks
+#define D_TERRAIN_RANGE  400.0 // distance the finest lod reaches, doubles per level
+#define D_TERRAIN_BUDGET 256   // chunk heightfields kept on the gpu
+#define D_TERRAIN_TESS_EXTENT  2560.0 // side of the tessellated terrain
+#define D_TERRAIN_TESS_SPACING 5.0    // between height texture samples
+#define D_TERRAIN_PATCH        80.0   // side of one coarse patch
+
+// CULLING
+#define D_HIZ_WIDTH  (D_FRAMEBUFFER_WIDTH / 2) // level 0 of the depth pyramid
+#define D_HIZ_HEIGHT (D_FRAMEBUFFER_HEIGHT / 2)
+#define D_HIZ_LEVELS 10 // down to 1x1
+#define D_OCCLUSION_WIDTH  (D_FRAMEBUFFER_WIDTH / 2) // software occlusion buffer
+#define D_OCCLUSION_HEIGHT (D_FRAMEBUFFER_HEIGHT / 2)
+#define D_PREPASS_MIN_TRIANGLES 1024 // meshes this dense get a depth pre-pass
+
+// SHADOWS
+#define D_SHADOW_ATLAS_SIZE 4096
+#define D_SHADOW_CELL_SIZE  128
+
 #include "utils/gl_debug.h"
 #include "utils/logger.h"
+#include "utils/gl_state.h"
+#include "utils/gpu_timer.h"
+#include "utils/ring_buffer.h"
+#include "utils/resources.h"
 #include "utils/vec.h"
+#include "utils/simd.h"
 #include "utils/obj_loader.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "utils/stb_image.h"
@@ -54,7 +124,21 @@
 #include "camera.h"
 #include "framebuffer.h"
 #include "texture.h"
+#include "geometry.h"
 #include "mesh.h"
+#include "streaming.h"
+#include "terrain.h"
+#include "batch.h"
 #include "shader.h"
+#include "terrain_chunks.h"
+#include "bvh.h"
+#include "commands.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "queue.h"
+#include "shadow.h"
+#include "volumetrics.h"
+#include "bloom.h"
+#include "postfx.h"
 
 #endif
@@ -1,100 +1,151 @@
 namespace FBO {
+  // Single level render target, created without binding anything
+  Resources::Object createTarget(GLenum format, int width, int height, GLenum filter, bool clamp) {
+    Resources::Object tex = Resources::createTexture(GL_TEXTURE_2D);
+    glTextureStorage2D(tex, 1, format, width, height);
+    glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, filter);
+    glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, filter);
+    if (clamp) {
+      glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    return tex;
+  }
+
   struct g_buffer_t {
-    GLuint id, normalTex, materialTex, depthTex;
-    void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, id); }
+    Resources::Object id, normalTex, materialTex, depthTex;
+    void bind() const { GLState::bindFramebuffer(id); }
     void init() {
       printf("Initializing GBuffer\n");
-      glGenFramebuffers(1, &id);
-      glBindFramebuffer(GL_FRAMEBUFFER, id);
+      id = Resources::createFramebuffer();
 
       // Add depth buffering
-      glGenTextures(1, &depthTex);
-      glBindTexture(GL_TEXTURE_2D, depthTex);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, 0,GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, 0);
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,GL_TEXTURE_2D, depthTex,0);
+      depthTex = createTarget(GL_DEPTH_COMPONENT24, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, GL_NEAREST, false);
+      glNamedFramebufferTexture(id, GL_DEPTH_ATTACHMENT, depthTex, 0);
 
       // Generate and bind 3 textures
-      glGenTextures(1, &normalTex);
-      glBindTexture(GL_TEXTURE_2D, normalTex);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, normalTex, 0);
-
-      glGenTextures(1, &materialTex);
-      glBindTexture(GL_TEXTURE_2D, materialTex);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, materialTex, 0);
+      normalTex = createTarget(GL_RGB8, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, GL_NEAREST, false);
+      glNamedFramebufferTexture(id, GL_COLOR_ATTACHMENT0, normalTex, 0);
+
+      materialTex = createTarget(GL_RGB8, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, GL_NEAREST, false);
+      glNamedFramebufferTexture(id, GL_COLOR_ATTACHMENT1, materialTex, 0);
 
       // Enable rendering for 3 binding points
       GLenum DrawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
-      glDrawBuffers(2, DrawBuffers);
+      glNamedFramebufferDrawBuffers(id, 2, DrawBuffers);
 
       // Always check that our framebuffer is ok
-      auto fboStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      auto fboStatus = glCheckNamedFramebufferStatus(id, GL_FRAMEBUFFER);
       if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
           std::cout << "Framebuffer not complete: " << fboStatus <<  " /  " << GL_FRAMEBUFFER_UNSUPPORTED << std::endl;
-      if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+      if(fboStatus != GL_FRAMEBUFFER_COMPLETE)
         exit(7);
     }
   } g_buffer;
 
   struct cone_buffer_t {
-    GLuint id, tex, depthTex;
-    void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, id); }
+    // Rendered at a fraction of the framebuffer, the post shader
+    // upsamples it guided by depth_range
+    Resources::Object id, tex;
+    void bind() const { GLState::bindFramebuffer(id); }
     void init() {
-      glGenFramebuffers(1, &id);
-      glBindFramebuffer(GL_FRAMEBUFFER, id);
+      id = Resources::createFramebuffer();
+      tex = createTarget(GL_RGB8, D_CONE_WIDTH, D_CONE_HEIGHT, GL_LINEAR, true);
+      glNamedFramebufferTexture(id, GL_COLOR_ATTACHMENT0, tex, 0);
 
-      glGenTextures(1, &tex);
-      glBindTexture(GL_TEXTURE_2D, tex);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
-
-      // Add depth buffering
-      glGenTextures(1, &depthTex);
-      glBindTexture(GL_TEXTURE_2D, depthTex);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, 0,GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, 0);
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,GL_TEXTURE_2D, depthTex,0);
-
-      GLenum DrawBuffers [1] = {GL_COLOR_ATTACHMENT0};
-      glDrawBuffers(1, DrawBuffers);
-      auto fboStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      glNamedFramebufferDrawBuffer(id, GL_COLOR_ATTACHMENT0);
+      auto fboStatus = glCheckNamedFramebufferStatus(id, GL_FRAMEBUFFER);
       if (fboStatus != GL_FRAMEBUFFER_COMPLETE)
           std::cout << "Framebuffer not complete: " << fboStatus <<  " /  " << GL_FRAMEBUFFER_UNSUPPORTED << std::endl;
-      if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+      if(fboStatus != GL_FRAMEBUFFER_COMPLETE)
         exit(7);
     }
   } cone_buffer;
 
+  struct depth_range_t {
+    // Min and max of the g buffer depth over every cone buffer texel
+    Resources::Object id, tex;
+    void bind() const { GLState::bindFramebuffer(id); }
+    void init() {
+      id = Resources::createFramebuffer();
+      tex = createTarget(GL_RG32F, D_CONE_WIDTH, D_CONE_HEIGHT, GL_NEAREST, false);
+      glNamedFramebufferTexture(id, GL_COLOR_ATTACHMENT0, tex, 0);
+
+      glNamedFramebufferDrawBuffer(id, GL_COLOR_ATTACHMENT0);
+      if(glCheckNamedFramebufferStatus(id, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        exit(7);
+    }
+  } depth_range;
+
   struct post_buffer_t {
-    GLuint id, tex;
-    void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, id); }
+    Resources::Object id, tex;
+    void bind() const { GLState::bindFramebuffer(id); }
     void init() {
-      glGenFramebuffers(1, &id);
-      glBindFramebuffer(GL_FRAMEBUFFER, id);
+      id = Resources::createFramebuffer();
 
       // Generate the only texture
-      glGenTextures(1, &tex);
-      glBindTexture(GL_TEXTURE_2D, tex);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
-
-      GLenum DrawBuffers[1] = {GL_COLOR_ATTACHMENT0};
-      glDrawBuffers(1, DrawBuffers);
+      tex = createTarget(GL_RGB8, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, GL_NEAREST, false);
+      glNamedFramebufferTexture(id, GL_COLOR_ATTACHMENT0, tex, 0);
+
+      glNamedFramebufferDrawBuffer(id, GL_COLOR_ATTACHMENT0);
       // Always check that our framebuffer is ok
-      if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+      if(glCheckNamedFramebufferStatus(id, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         exit(7);
     }
   } post_buffer;
+
+  struct bloom_chain_t {
+    // Every level is half the size of the one before it, level 0 being
+    // half the framebuffer
+    Resources::Object id[D_BLOOM_LEVELS], tex[D_BLOOM_LEVELS];
+    int width[D_BLOOM_LEVELS], height[D_BLOOM_LEVELS];
+    void bind(int level) const {
+      GLState::bindFramebuffer(id[level]);
+      glViewport(0, 0, width[level], height[level]);
+    }
+    void init() {
+      for(int i=0; i<D_BLOOM_LEVELS; i++) {
+        id[i] = Resources::createFramebuffer();
+        width[i] = std::max(D_FRAMEBUFFER_WIDTH >> (i + 1), 1);
+        height[i] = std::max(D_FRAMEBUFFER_HEIGHT >> (i + 1), 1);
+        tex[i] = createTarget(GL_R11F_G11F_B10F, width[i], height[i], GL_LINEAR, true);
+        glNamedFramebufferTexture(id[i], GL_COLOR_ATTACHMENT0, tex[i], 0);
+
+        glNamedFramebufferDrawBuffer(id[i], GL_COLOR_ATTACHMENT0);
+        if(glCheckNamedFramebufferStatus(id[i], GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+          exit(7);
+      }
+    }
+  } bloom_chain;
+
+  struct shadow_atlas_t {
+    Resources::Object id, depthTex;
+    void bind() const { GLState::bindFramebuffer(id); }
+    void init() {
+      id = Resources::createFramebuffer();
+
+      // Depth only, compared in hardware so the lookups in the
+      // combinator already come back filtered
+      depthTex = createTarget(GL_DEPTH_COMPONENT24, D_SHADOW_ATLAS_SIZE, D_SHADOW_ATLAS_SIZE, GL_LINEAR, true);
+      glTextureParameteri(depthTex, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+      glTextureParameteri(depthTex, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+      glNamedFramebufferTexture(id, GL_DEPTH_ATTACHMENT, depthTex, 0);
+
+      glNamedFramebufferDrawBuffer(id, GL_NONE);
+      glNamedFramebufferReadBuffer(id, GL_NONE);
+      if(glCheckNamedFramebufferStatus(id, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        exit(7);
+    }
+  } shadow_atlas;
+
+  // The targets are owned by the structs above, given back before the
+  // leak report at shutdown
+  void shutdown() {
+    g_buffer = g_buffer_t();
+    cone_buffer = cone_buffer_t();
+    depth_range = depth_range_t();
+    post_buffer = post_buffer_t();
+    bloom_chain = bloom_chain_t();
+    shadow_atlas = shadow_atlas_t();
+  }
 }
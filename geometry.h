@@ -0,0 +1,327 @@
+#include <map>
+
+namespace Geometry {
+
+// First fit allocator over [0, capacity) elements, neighbouring free
+// blocks are merged on release
+class FreeList {
+  private:
+    std::map<uint32_t, uint32_t> blocks; // offset -> size
+    uint32_t capacity, used;
+
+  public:
+    void init(uint32_t capacity) {
+      this->capacity = capacity;
+      used = 0;
+      blocks.clear();
+      if (capacity) blocks[0] = capacity;
+    }
+
+    bool allocate(uint32_t count, uint32_t &offset) {
+      if (count == 0) { offset = 0; return true; }
+      for(auto it = blocks.begin(); it != blocks.end(); ++it) {
+        if (it->second < count) continue;
+        offset = it->first;
+        uint32_t rest = it->second - count;
+        blocks.erase(it);
+        if (rest) blocks[offset + count] = rest;
+        used += count;
+        return true;
+      }
+      return false;
+    }
+
+    void release(uint32_t offset, uint32_t count) {
+      if (count == 0) return;
+      used -= count;
+      auto next = blocks.lower_bound(offset);
+      if (next != blocks.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+          offset = prev->first;
+          count += prev->second;
+          blocks.erase(prev);
+        }
+      }
+      if (next != blocks.end() && offset + count == next->first) {
+        count += next->second;
+        blocks.erase(next);
+      }
+      blocks[offset] = count;
+    }
+
+    uint32_t getCapacity() const { return capacity; }
+    uint32_t getUsed() const { return used; }
+    uint32_t largest() const {
+      uint32_t l = 0;
+      for(auto &b : blocks) l = std::max(l, b.second);
+      return l;
+    }
+    int fragments() const { return blocks.size(); }
+};
+
+struct attribute_t {
+  GLuint index;
+  GLint size;   // floats
+  GLuint offset; // floats
+};
+
+// Interleaved float vertex layouts, one arena and one vao each
+enum format {
+  FORMAT_STANDARD,    // position, normal, uv, tangent, bitangent
+  FORMAT_POSITION3,
+  FORMAT_POSITION2,
+  FORMAT_HEIGHTFIELD, // position, normal, height at the uv slot
+  FORMAT_COUNT,
+};
+
+struct format_t {
+  const char* name;
+  int floats;
+  int attribute_count;
+  attribute_t attributes[5];
+};
+
+static const format_t formats[FORMAT_COUNT] = {
+  { "standard", 14, 5, { { D_POS_BUFFER_INDEX, 3, 0 }, { D_NORMAL_BUFFER_INDEX, 3, 3 }, { D_UV_BUFFER_INDEX, 2, 6 },
+      { D_TANGENT_BUFFER_INDEX, 3, 8 }, { D_BITANGENT_BUFFER_INDEX, 3, 11 } } },
+  { "position3", 3, 1, { { D_POS_BUFFER_INDEX, 3, 0 } } },
+  { "position2", 2, 1, { { D_POS_BUFFER_INDEX, 2, 0 } } },
+  { "heightfield", 7, 3, { { D_POS_BUFFER_INDEX, 3, 0 }, { D_NORMAL_BUFFER_INDEX, 3, 3 }, { D_UV_BUFFER_INDEX, 1, 6 } } },
+};
+
+// Where a mesh lives in its arena. Indices are relative to first_vertex,
+// meshes without indices are drawn as arrays.
+struct allocation_t {
+  uint32_t first_vertex, vertex_count;
+  uint32_t first_index, index_count;
+  bool live;
+};
+
+// One immutable vertex buffer and one index buffer shared by every mesh
+// of a format, behind a single vao. Meshes hold a handle, the offsets
+// behind it change when the arena is compacted or grown.
+class Arena {
+  public:
+    Resources::Object vao;
+    Resources::Object depth_vao; // same buffers, fetches the position only
+
+    void init(format f, uint32_t max_vertices, uint32_t max_indices);
+    int allocate(const float* vertices, uint32_t vertex_count, const GLuint* indices, uint32_t index_count);
+    // Same, copied on the GPU from buffers that already hold the data
+    int copy(GLuint vertices, uint32_t vertex_count, GLuint indices, uint32_t index_count);
+    void release(int handle);
+    const allocation_t &get(int handle) const { return allocations[handle]; }
+
+    // Moves every live allocation to the front of new buffers of the
+    // given size, the free space ends up in one block
+    void rebuild(uint32_t max_vertices, uint32_t max_indices);
+    void defragment() { rebuild(vertex_space.getCapacity(), index_space.getCapacity()); }
+    void report() const;
+    // Gives the vaos and buffers back, every mesh has to be released
+    void shutdown();
+
+  private:
+    format fmt;
+    Resources::Object vbo, ibo;
+    FreeList vertex_space, index_space;
+    std::vector<allocation_t> allocations;
+    std::vector<int> free_handles;
+
+    Resources::Object createBuffer(size_t size);
+    void bindBuffers();
+    allocation_t reserve(uint32_t vertex_count, uint32_t index_count);
+    int store(const allocation_t &a);
+};
+
+Resources::Object Arena::createBuffer(size_t size)
+{
+  Resources::Object buffer = Resources::createBuffer();
+  glNamedBufferStorage(buffer, std::max(size, (size_t)4), NULL, GL_DYNAMIC_STORAGE_BIT);
+  return buffer;
+}
+
+void Arena::bindBuffers()
+{
+  const format_t &f = formats[fmt];
+  for(int a=0; a<f.attribute_count; a++)
+    glVertexArrayVertexBuffer(vao, f.attributes[a].index, vbo, 0, f.floats * sizeof(float));
+  glVertexArrayElementBuffer(vao, ibo);
+  glVertexArrayVertexBuffer(depth_vao, D_POS_BUFFER_INDEX, vbo, 0, f.floats * sizeof(float));
+  glVertexArrayElementBuffer(depth_vao, ibo);
+}
+
+void Arena::init(format f, uint32_t max_vertices, uint32_t max_indices)
+{
+  fmt = f;
+  const format_t &desc = formats[fmt];
+  vao = Resources::createVertexArray();
+  for(int a=0; a<desc.attribute_count; a++) {
+    const attribute_t &at = desc.attributes[a];
+    glVertexArrayAttribFormat(vao, at.index, at.size, GL_FLOAT, GL_FALSE, at.offset * sizeof(float));
+    glVertexArrayAttribBinding(vao, at.index, at.index);
+    glEnableVertexArrayAttrib(vao, at.index);
+  }
+  // Position is always the first attribute
+  depth_vao = Resources::createVertexArray();
+  glVertexArrayAttribFormat(depth_vao, D_POS_BUFFER_INDEX, desc.attributes[0].size, GL_FLOAT, GL_FALSE, 0);
+  glVertexArrayAttribBinding(depth_vao, D_POS_BUFFER_INDEX, D_POS_BUFFER_INDEX);
+  glEnableVertexArrayAttrib(depth_vao, D_POS_BUFFER_INDEX);
+  vbo = createBuffer((size_t)max_vertices * desc.floats * sizeof(float));
+  ibo = createBuffer((size_t)max_indices * sizeof(GLuint));
+  vertex_space.init(max_vertices);
+  index_space.init(max_indices);
+  bindBuffers();
+}
+
+allocation_t Arena::reserve(uint32_t vertex_count, uint32_t index_count)
+{
+  allocation_t a = { 0, vertex_count, 0, index_count, true };
+  bool fits = vertex_space.allocate(vertex_count, a.first_vertex);
+  if (fits && !index_space.allocate(index_count, a.first_index)) {
+    vertex_space.release(a.first_vertex, vertex_count);
+    fits = false;
+  }
+  if (!fits) {
+    // Compacting is enough if the free space is only scattered,
+    // otherwise the arena doubles until it fits
+    uint32_t vcap = vertex_space.getCapacity(), icap = index_space.getCapacity();
+    while(vertex_space.getUsed() + vertex_count > vcap) vcap = std::max(vcap * 2, 1024u);
+    while(index_space.getUsed() + index_count > icap) icap = std::max(icap * 2, 1024u);
+    rebuild(vcap, icap);
+    vertex_space.allocate(vertex_count, a.first_vertex);
+    index_space.allocate(index_count, a.first_index);
+  }
+  return a;
+}
+
+int Arena::store(const allocation_t &a)
+{
+  int handle;
+  if (!free_handles.empty()) {
+    handle = free_handles.back();
+    free_handles.pop_back();
+    allocations[handle] = a;
+  } else {
+    handle = allocations.size();
+    allocations.push_back(a);
+  }
+  return handle;
+}
+
+int Arena::allocate(const float* vertices, uint32_t vertex_count, const GLuint* indices, uint32_t index_count)
+{
+  allocation_t a = reserve(vertex_count, index_count);
+  const size_t stride = formats[fmt].floats * sizeof(float);
+  glNamedBufferSubData(vbo, a.first_vertex * stride, vertex_count * stride, vertices);
+  if (index_count)
+    glNamedBufferSubData(ibo, a.first_index * sizeof(GLuint), index_count * sizeof(GLuint), indices);
+  return store(a);
+}
+
+int Arena::copy(GLuint vertices, uint32_t vertex_count, GLuint indices, uint32_t index_count)
+{
+  allocation_t a = reserve(vertex_count, index_count);
+  const size_t stride = formats[fmt].floats * sizeof(float);
+  glCopyNamedBufferSubData(vertices, vbo, 0, a.first_vertex * stride, vertex_count * stride);
+  if (index_count)
+    glCopyNamedBufferSubData(indices, ibo, 0, a.first_index * sizeof(GLuint), index_count * sizeof(GLuint));
+  return store(a);
+}
+
+void Arena::release(int handle)
+{
+  allocation_t &a = allocations[handle];
+  if (!a.live) return;
+  vertex_space.release(a.first_vertex, a.vertex_count);
+  index_space.release(a.first_index, a.index_count);
+  a.live = false;
+  free_handles.push_back(handle);
+}
+
+void Arena::rebuild(uint32_t max_vertices, uint32_t max_indices)
+{
+  const size_t stride = formats[fmt].floats * sizeof(float);
+  Resources::Object new_vbo = createBuffer((size_t)max_vertices * stride);
+  Resources::Object new_ibo = createBuffer((size_t)max_indices * sizeof(GLuint));
+
+  // In the order they sit in the old buffer so the layout stays stable
+  std::vector<int> order;
+  for(int i=0; i<(int)allocations.size(); i++)
+    if (allocations[i].live) order.push_back(i);
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    return allocations[a].first_vertex < allocations[b].first_vertex;
+  });
+
+  uint32_t vertex_head = 0, index_head = 0;
+  for(int i : order) {
+    allocation_t &a = allocations[i];
+    if (a.vertex_count)
+      glCopyNamedBufferSubData(vbo, new_vbo, a.first_vertex * stride, vertex_head * stride, a.vertex_count * stride);
+    if (a.index_count)
+      glCopyNamedBufferSubData(ibo, new_ibo, a.first_index * sizeof(GLuint), index_head * sizeof(GLuint), a.index_count * sizeof(GLuint));
+    a.first_vertex = vertex_head;
+    a.first_index = index_head;
+    vertex_head += a.vertex_count;
+    index_head += a.index_count;
+  }
+
+  // The old buffers are retired, frames in flight may still draw from them
+  vbo = std::move(new_vbo);
+  ibo = std::move(new_ibo);
+  bindBuffers();
+
+  vertex_space.init(max_vertices);
+  index_space.init(max_indices);
+  uint32_t unused;
+  vertex_space.allocate(vertex_head, unused);
+  index_space.allocate(index_head, unused);
+  logInfo("Rebuilt %s arena: %u vertices and %u indices of %u and %u",
+      formats[fmt].name, vertex_head, index_head, max_vertices, max_indices);
+}
+
+void Arena::report() const
+{
+  const size_t stride = formats[fmt].floats * sizeof(float);
+  int live = allocations.size() - free_handles.size();
+  logDebug("%s arena: %i meshes, vertices %u/%u (%i KB, %i free blocks, largest %u), indices %u/%u (%i KB)",
+      formats[fmt].name, live,
+      vertex_space.getUsed(), vertex_space.getCapacity(), (int)(vertex_space.getCapacity() * stride / 1024),
+      vertex_space.fragments(), vertex_space.largest(),
+      index_space.getUsed(), index_space.getCapacity(), (int)(index_space.getCapacity() * sizeof(GLuint) / 1024));
+}
+
+void Arena::shutdown()
+{
+  vao.reset();
+  depth_vao.reset();
+  vbo.reset();
+  ibo.reset();
+}
+
+Arena arenas[FORMAT_COUNT];
+
+void init()
+{
+  arenas[FORMAT_STANDARD].init(FORMAT_STANDARD, 1 << 16, 1 << 18);
+  arenas[FORMAT_POSITION3].init(FORMAT_POSITION3, 1 << 12, 0);
+  arenas[FORMAT_POSITION2].init(FORMAT_POSITION2, 1 << 12, 1 << 14);
+  arenas[FORMAT_HEIGHTFIELD].init(FORMAT_HEIGHTFIELD, 1 << 12, 1 << 14);
+}
+
+void defragment()
+{
+  for(Arena &a : arenas) a.defragment();
+}
+
+void report()
+{
+  for(const Arena &a : arenas) a.report();
+}
+
+void shutdown()
+{
+  for(Arena &a : arenas) a.shutdown();
+}
+
+}
@@ -17,6 +17,17 @@ enum action {
   LOOK_RIGHT,
 
   JUMP,
+
+  TOGGLE_VOLUMETRICS,
+  TOGGLE_TERRAIN,
+  TOGGLE_BATCHING,
+  TOGGLE_CULLING,
+  TOGGLE_OCCLUSION,
+  TOGGLE_INSTANCING,
+  STREAM_ASSETS,
+  TOGGLE_STREAMING,
+  TOGGLE_QUERIES,
+  TOGGLE_PREPASS,
 };
 
 class Keyboard
@@ -100,6 +111,17 @@ void Keyboard::generateActionMap()
   action_map[LOOK_RIGHT]    = GLFW_KEY_RIGHT;
   
   action_map[JUMP]          = GLFW_KEY_SPACE;
+
+  action_map[TOGGLE_VOLUMETRICS] = GLFW_KEY_V;
+  action_map[TOGGLE_TERRAIN]     = GLFW_KEY_T;
+  action_map[TOGGLE_BATCHING]    = GLFW_KEY_B;
+  action_map[TOGGLE_CULLING]     = GLFW_KEY_C;
+  action_map[TOGGLE_OCCLUSION]   = GLFW_KEY_O;
+  action_map[TOGGLE_INSTANCING]  = GLFW_KEY_I;
+  action_map[STREAM_ASSETS]      = GLFW_KEY_L;
+  action_map[TOGGLE_STREAMING]   = GLFW_KEY_K;
+  action_map[TOGGLE_QUERIES]     = GLFW_KEY_J;
+  action_map[TOGGLE_PREPASS]     = GLFW_KEY_P;
 }
 
 }
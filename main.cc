@@ -7,6 +7,23 @@ void glfw_error_callback(int error, const char* description)
 }
 
 int main(int argc, char** argv) {
+  if (argc > 1 && std::string(argv[1]) == "cullbench") {
+    Culling::benchmarkFrustum(100000);
+    return 0;
+  }
+  if (argc > 1 && std::string(argv[1]) == "sortbench") {
+    Render::benchmark(100000);
+    return 0;
+  }
+  if (argc > 1 && std::string(argv[1]) == "bvhbench") {
+    for(int count : { 1000, 10000, 100000, 1000000 }) Spatial::benchmark(count);
+    return 0;
+  }
+  if (argc > 1 && std::string(argv[1]) == "occlbench") {
+    Occlusion::benchmark(100);
+    return 0;
+  }
+
   if (!glfwInit()) return 2;
   glfwSetErrorCallback(glfw_error_callback);
   glEnable(GL_DEBUG_OUTPUT);
@@ -21,7 +38,8 @@ int main(int argc, char** argv) {
   GLFWwindow* window = glfwCreateWindow(D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, "Yeah", NULL, NULL);
   if (!window) return 3;
   glfwMakeContextCurrent(window);
-  glEnable(GL_DEPTH_TEST);
+  GLState::init();
+  GLState::enable(GL_DEPTH_TEST);
 
   // Print info
   const GLubyte* vendor = glGetString(GL_VENDOR);
@@ -33,7 +51,10 @@ int main(int argc, char** argv) {
 
   FBO::g_buffer.init();
   FBO::cone_buffer.init();
+  FBO::depth_range.init();
   FBO::post_buffer.init();
+  FBO::shadow_atlas.init();
+  FBO::bloom_chain.init();
 
   Camera::Camera camera = Camera::Camera(1.25);
   camera.setPosition(Vector3(0, 10, 20));
@@ -44,15 +65,20 @@ int main(int argc, char** argv) {
   Shaders::lights_t lights;
 
   Textures::init();
-
-  auto quad = Meshes::loadMesh("quad.obj");
-  auto mesh = Meshes::loadMesh("player.obj");
-  auto cube = Meshes::loadMesh("cube.obj");
-  auto floor = Meshes::loadMesh("floor.obj");
-  float cone_data[] = {
-    0, 0, 0,
-  };
-  auto cone = Meshes::loadMeshPoints(3, cone_data);
+  Shadows::atlas.init();
+  Volumetrics::froxels.init();
+  Bloom::pyramid.init();
+  PostFX::init();
+  Geometry::init();
+
+  Meshes::Handle h_quad = Meshes::loadMesh("quad.obj");
+  Meshes::Handle h_mesh = Meshes::loadMesh("player.obj");
+  Meshes::Handle h_cube = Meshes::loadMesh("cube.obj");
+  Meshes::Handle h_floor = Meshes::loadMesh("floor.obj");
+  Meshes::Handle h_cone = Meshes::loadMeshCone(D_CONE_SEGMENTS);
+  Meshes::enableInstancing(Meshes::get(h_cube));
+  Shaders::sh_cone.attach(Meshes::get(h_cone));
+  Shaders::cone_instance_t cones[D_MAX_CONES];
 
   float* plane_data = (float*)malloc(25 * 25 * 3 * sizeof(float));
   for(int y=0, q=0; y<25; y++) {
@@ -62,15 +88,185 @@ int main(int argc, char** argv) {
       plane_data[q++] = ((float)y);
     }
   }
-  auto plane = Meshes::loadMeshPoints(25*25*3, plane_data);
+  Meshes::Handle h_plane = Meshes::loadMeshPoints(25*25*3, plane_data);
   delete plane_data;
 
-  auto tx_white = Textures::createTextureColor(1, 1, 1);
-  auto tx_brick = Textures::loadTexture("textures/wall.jpg");
-  auto tx_brick_norm = Textures::loadTexture("textures/wall_norm.jpg");
-  auto tx_water = Textures::loadTexture("textures/water.jpg");
-  auto tx_grass = Textures::loadTexture("textures/grass.jpg");
-  auto tx_stone = Textures::loadTexture("textures/stone.jpg");
+  // Looked up again at the start of every frame, the pool moves meshes
+  // around when one is created or destroyed
+  Meshes::Mesh *quad, *mesh, *cube, *floor, *cone, *plane;
+  auto resolve_meshes = [&]() {
+    quad = Meshes::get(h_quad);
+    mesh = Meshes::get(h_mesh);
+    cube = Meshes::get(h_cube);
+    floor = Meshes::get(h_floor);
+    cone = Meshes::get(h_cone);
+    plane = Meshes::get(h_plane);
+  };
+  resolve_meshes();
+
+  Textures::Handle h_white = Textures::createTextureColor(1, 1, 1);
+  Textures::Handle h_water = Textures::loadTexture("textures/water.jpg");
+  Textures::Handle h_grass = Textures::loadTexture("textures/grass.jpg");
+  Textures::Handle h_stone = Textures::loadTexture("textures/stone.jpg");
+  auto tx_white = Textures::get(h_white);
+  auto tx_water = Textures::get(h_water);
+  auto tx_grass = Textures::get(h_grass);
+  auto tx_stone = Textures::get(h_stone);
+
+  Terrain::heightfield.init();
+  Terrain::chunks.init();
+  Terrain::patches.init();
+  GLState::useProgram(Shaders::sh_terrain_tess.program_id);
+  Shaders::sh_terrain_tess.setExtent(Terrain::patches.origin, D_TERRAIN_TESS_EXTENT, Terrain::patches.samples);
+  Shaders::sh_terrain_tess.setHeightMap(
+      Terrain::heightfield.amplitude * Terrain::heightfield.scale,
+      Terrain::heightfield.offset.y * Terrain::heightfield.scale);
+  Matrix4 plane_mvp = Terrain::heightfield.model();
+  std::vector<Shadows::caster_t> casters;
+
+  // Everything drawable or lighting goes into the BVH, meshes are
+  // indexed by light cube with the player and then the props after them
+  const int player_item = 32;
+  Spatial::DynamicTree scene;
+  std::vector<int> visible;
+  int cube_proxies[32], light_proxies[32];
+  scene.insert(mesh->bounds, { Spatial::ITEM_MESH, player_item });
+  for(int i=0; i<32; i++) {
+    cube_proxies[i] = scene.insert(AABB::FromSphere(cube->center, cube->radius), { Spatial::ITEM_MESH, i });
+    light_proxies[i] = scene.insert(AABB::FromSphere(Vector3(0), 0), { Spatial::ITEM_LIGHT, i });
+  }
+
+  // "10k" scatters that many static cubes over the terrain to stress submission
+  std::vector<Vector3> props;
+  if (argc > 1 && std::string(argv[1]) == "10k") {
+    for(int z=0; z<100; z++) {
+      for(int x=0; x<100; x++) {
+        float wx = -123.75f + x * 2.5f, wz = -123.75f + z * 2.5f;
+        props.push_back(Vector3(wx, Terrain::heightfield.height(wx, wz) + 0.5f, wz));
+      }
+    }
+  }
+  for(int i=0; i<(int)props.size(); i++)
+    scene.insert(AABB::FromSphere(props[i] + cube->center, cube->radius), { Spatial::ITEM_MESH, player_item + 1 + i });
+
+  // The same items as flat spheres for the simd culler
+  Culling::sphere_set_t spheres;
+  Culling::FrustumCuller frustum_culler;
+  spheres.resize(player_item + 1 + props.size());
+  spheres.set(player_item, mesh->center, mesh->radius);
+  for(int i=0; i<(int)props.size(); i++)
+    spheres.set(player_item + 1 + i, props[i] + cube->center, cube->radius);
+  auto item_model = [&](int i) {
+    if (i < player_item) return Matrix4::FromTranslation(lights.pos[i].xyz());
+    if (i == player_item) return Matrix4::Identity();
+    return Matrix4::FromTranslation(props[i - player_item - 1]);
+  };
+
+  // B switches between one draw per object and a single indirect draw,
+  // C between culling the batch on the cpu and on the gpu
+  bool batching = true;
+  bool gpu_culling = true;
+  const int batch_player = Batch::batcher.addMesh(h_mesh);
+  const int batch_cube = Batch::batcher.addMesh(h_cube);
+  const int batch_white = Batch::batcher.addMaterial(Vector3(1), 1);
+  const int batch_prop = Batch::batcher.addMaterial(Vector3(0.6), 1);
+  // O rejects what the player and the terrain hide on the cpu paths
+  bool occlusion_culling = true;
+  Occlusion::MaskedRasterizer occlusion(D_OCCLUSION_WIDTH, D_OCCLUSION_HEIGHT);
+  std::vector<Occlusion::occluder_t> occluders(2);
+  {
+    std::vector<float> v, n, uv;
+    cObj("player.obj").renderBuffers(v, n, uv);
+    occluders[0] = Occlusion::cluster(v, 24);
+    Terrain::heightfield.surface(occluders[1].vertices, occluders[1].indices);
+  }
+  // I draws every cube of the per object path with a single instanced call
+  bool instancing = true;
+  std::vector<Meshes::instance_t> cube_instances;
+  auto cube_instance = [&](int i, Meshes::instance_t &out) {
+    item_model(i).unpack(out.model);
+    float c = i > player_item ? 0.6 : 1;
+    out.color[0] = out.color[1] = out.color[2] = c;
+    out.color[3] = 1;
+  };
+  auto item_bounds = [&](int i) {
+    if (i == player_item) return mesh->bounds;
+    Vector3 p = i < player_item ? lights.pos[i].xyz() : props[i - player_item - 1];
+    return AABB::FromSphere(p + cube->center, cube->radius);
+  };
+
+  // J gates the light cubes and cones on occlusion queries against the
+  // previous frame's depth. Keys are the cubes, then the cones from 32.
+  bool hw_queries = true;
+  Occlusion::queries.init(32 + 17);
+  std::vector<AABB> query_boxes(32 + 17);
+  GLuint cube_gates[32];
+
+  // P lays the depth of the dense meshes down first and shades them with
+  // an equal depth test. Fragment shader invocations of the g buffer pass
+  // are summed per setting to see what it saves.
+  bool depth_prepass = true;
+  GpuCounter gbuffer_fragments, prepass_fragments;
+  gbuffer_fragments.init(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+  prepass_fragments.init(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+  double fragments[2] = { 0, 0 }, prepass_total = 0;
+  int fragment_frames[2] = { 0, 0 }, prepass_frames = 0;
+
+  Batch::batcher.finalize(player_item + 1 + props.size());
+  Culling::culler.init(player_item + 1 + props.size());
+  double cpu_ms = 0, worst_ms = 0;
+  const int workers = std::max(1, (int)std::thread::hardware_concurrency());
+  long gl_issued = 0, gl_elided = 0;
+
+  // Froxel fog by default, V switches back to the light cones
+  bool froxel_fog = true;
+
+  // L loads every asset again and drops it, through the loader thread or,
+  // after K, right here to compare the frame time spikes
+  Streaming::loader.init(window);
+  bool async_loading = true;
+  const char* stream_meshes[] = { "player.obj", "cube.obj", "floor.obj" };
+  const char* stream_textures[] = { "textures/wall.jpg", "textures/wall_norm.jpg",
+    "textures/water.jpg", "textures/grass.jpg", "textures/stone.jpg" };
+  // T cycles through the terrain implementations
+  Terrain::mode terrain_mode = Terrain::MODE_CHUNKED;
+  GpuTimer terrain_timers[Terrain::MODE_COUNT];
+  for(GpuTimer &t : terrain_timers) t.init();
+  auto draw_terrain = [&](const Matrix4 &matrix, bool shadow) {
+    if (terrain_mode == Terrain::MODE_CHUNKED && !shadow) {
+      Terrain::chunks.draw(matrix, tx_water, tx_grass, tx_stone);
+    } else if (terrain_mode == Terrain::MODE_TESSELLATED && !shadow) {
+      // Segments of about 8 pixels on screen
+      Shaders::sh_terrain_tess.use(matrix, camera.getPosition(), tx_water, tx_grass, tx_stone, Terrain::patches.heights);
+      Shaders::sh_terrain_tess.setTextureScale(0.005);
+      Shaders::sh_terrain_tess.setTessellation(D_FRAMEBUFFER_HEIGHT / 2 / tan(camera.getFov() / 2), 8);
+      glPatchParameteri(GL_PATCH_VERTICES, 4);
+      GLState::bindVertexArray(Terrain::patches.vao);
+      glDrawElements(GL_PATCHES, Terrain::patches.index_count, GL_UNSIGNED_INT, 0);
+    } else if (terrain_mode == Terrain::MODE_CAPTURED) {
+      if (!Shaders::plane_bake.valid) {
+        Shaders::plane_bake.capture([&]() {
+          Shaders::sh_plane.setMvp(plane_mvp);
+          Meshes::draw(plane, GL_POINTS);
+        });
+      }
+      Shaders::sh_plane_baked.use(matrix, camera.getPosition(), tx_water, tx_grass, tx_stone);
+      Shaders::sh_plane_baked.setTextureScale(0.05);
+      Shaders::plane_bake.draw();
+    } else if (terrain_mode != Terrain::MODE_GEOMETRY_SHADER) {
+      // The chunk selection belongs to the camera, shadows use the baked
+      // heightfield which covers everything the spot lights reach
+      Shaders::sh_terrain.use(matrix, camera.getPosition(), tx_water, tx_grass, tx_stone);
+      Shaders::sh_terrain.setTextureScale(0.05);
+      Shaders::sh_terrain.setMvp(plane_mvp);
+      Meshes::draw(Meshes::get(Terrain::heightfield.mesh));
+    } else {
+      Shaders::sh_plane.use(matrix, camera.getPosition(), tx_water, tx_grass, tx_stone);
+      Shaders::sh_plane.setTextureScale(0.05);
+      Shaders::sh_plane.setMvp(plane_mvp);
+      Meshes::draw(plane, GL_POINTS);
+    }
+  };
 
   int int_Time = 0;
   float time = 0;
@@ -79,6 +275,11 @@ int main(int argc, char** argv) {
   {
     int_Time += 1;
     time = glfwGetTime() / 2;
+    auto frame_start = std::chrono::high_resolution_clock::now();
+    Shaders::frame_ring.beginFrame();
+    Resources::beginFrame();
+    Streaming::loader.adopt();
+    resolve_meshes();
 
     for(int i=0; i<16; i+=1) {
       float v = (float)i / 16.0f * 6.28;
@@ -105,59 +306,252 @@ int main(int argc, char** argv) {
     }
 
 
+    Shaders::uploadLights(lights);
+    if (keyboard.isPressed(Keyboards::TOGGLE_VOLUMETRICS)) froxel_fog = !froxel_fog;
+    if (keyboard.isPressed(Keyboards::TOGGLE_TERRAIN))
+      terrain_mode = (Terrain::mode)((terrain_mode + 1) % Terrain::MODE_COUNT);
+    if (keyboard.isPressed(Keyboards::TOGGLE_BATCHING)) batching = !batching;
+    if (keyboard.isPressed(Keyboards::TOGGLE_OCCLUSION)) occlusion_culling = !occlusion_culling;
+    if (keyboard.isPressed(Keyboards::TOGGLE_INSTANCING)) instancing = !instancing;
+    if (keyboard.isPressed(Keyboards::TOGGLE_STREAMING)) async_loading = !async_loading;
+    if (keyboard.isPressed(Keyboards::TOGGLE_QUERIES)) hw_queries = !hw_queries;
+    if (keyboard.isPressed(Keyboards::TOGGLE_PREPASS)) depth_prepass = !depth_prepass;
+    if (keyboard.isPressed(Keyboards::STREAM_ASSETS)) {
+      for(const char* f : stream_textures) {
+        if (async_loading) Streaming::loader.loadTexture(f, [](Textures::Handle h) { Textures::destroy(h); });
+        else Textures::destroy(Textures::loadTexture(f));
+      }
+      for(const char* f : stream_meshes) {
+        if (async_loading) Streaming::loader.loadMesh(f, [](Meshes::Handle h) { Meshes::destroy(h); });
+        else Meshes::destroy(Meshes::loadMesh(f));
+      }
+      resolve_meshes();
+    }
+    if (keyboard.isPressed(Keyboards::TOGGLE_CULLING)) {
+      gpu_culling = !gpu_culling;
+      Culling::culler.invalidate();
+    }
+
+    for(int i=0; i<32; i++) {
+      scene.move(cube_proxies[i], AABB::FromSphere(lights.pos[i].xyz() + cube->center, cube->radius));
+      spheres.set(i, lights.pos[i].xyz() + cube->center, cube->radius);
+      scene.move(light_proxies[i], AABB::FromSphere(lights.pos[i].xyz(), lights.reach(i)));
+    }
+    scene.update();
+
     int w, h;
     Matrix4 mvp;
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLState::bindFramebuffer(0);
     glfwGetFramebufferSize(window, &w, &h);
 
-    camera.update(w/h, &keyboard);
+    Vector3 cam_pos = camera.getPosition();
+    camera.update(w/h, &keyboard, Terrain::heightfield.height(cam_pos.x, cam_pos.z));
+    if (terrain_mode == Terrain::MODE_CHUNKED)
+      Terrain::chunks.update(camera.getMatrix(), camera.getPosition());
+
+    // <--- Refresh the shadow atlas regions that went stale ---->
+    casters.clear();
+    casters.push_back({ mesh->center, mesh->radius });
+    for(int i=0; i<32; i++)
+      casters.push_back({ lights.pos[i].xyz() + cube->center, cube->radius });
+    casters.push_back({ Vector3(0, -50, 0), 180 });
+    Shadows::atlas.update(lights, camera.getPosition(), casters);
+    cube_instances.resize(32);
+    for(int i=0; i<32; i++) cube_instance(i, cube_instances[i]);
+    GLintptr light_cubes = Shaders::frame_ring.push(cube_instances.data(), 32 * sizeof(Meshes::instance_t));
+    Shadows::atlas.render([&](const Matrix4 &light_matrix) {
+      Shaders::sh_depth.use(light_matrix);
+      Shaders::sh_depth.setMvp(Matrix4::Identity());
+      Meshes::draw(mesh);
+
+      Shaders::sh_depth_instanced.use(light_matrix);
+      Meshes::setInstances(cube, Shaders::frame_ring.buffer, light_cubes, 32);
+      Meshes::drawInstanced(cube);
+
+      draw_terrain(light_matrix, true);
+    });
 
 
     FBO::g_buffer.bind();
+    glViewport(0, 0, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT);
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); 
+    Occlusion::queries.beginFrame();
+
+    visible.clear();
+    if (batching && gpu_culling) {
+      for(int i=0; i<=player_item + (int)props.size(); i++) visible.push_back(i);
+    } else if (batching) {
+      frustum_culler.cull(Frustum(camera.getMatrix()), spheres, visible);
+    } else {
+      scene.query(Frustum(camera.getMatrix()), [&](Spatial::item_t item) {
+        if (item.kind == Spatial::ITEM_MESH) visible.push_back(item.index);
+      });
+      std::sort(visible.begin(), visible.end());
+    }
 
-    Shaders::sh_main.use(camera.getMatrix());
-    Textures::disableNormalMap();
-    Textures::setTexture(tx_white);
-    mvp = Matrix4::Identity();
-    glBindVertexArray(mesh->vao);
-    Shaders::sh_main.setMvp(mvp);
-    glDrawArrays(GL_TRIANGLES, 0, mesh->vertex_count);
-
-
-    glBindVertexArray(cube->vao);
-    for(int i=0; i<32; i++) {
-      Matrix4 cube_mvp = Matrix4::FromTranslation(lights.pos[i].xyz());
-      Shaders::sh_main.setMvp(cube_mvp);
-      glDrawArrays(GL_TRIANGLES, 0, cube->vertex_count);
+    if (occlusion_culling && !(batching && gpu_culling)) {
+      occlusion.begin(camera.getMatrix());
+      occlusion.add(occluders[0], Matrix4::Identity());
+      // The baked grid is only the drawn surface where the mode draws
+      // it, the chunked and tessellated terrain can lie below it
+      if (terrain_mode == Terrain::MODE_BAKED || terrain_mode == Terrain::MODE_GEOMETRY_SHADER ||
+          terrain_mode == Terrain::MODE_CAPTURED)
+        occlusion.add(occluders[1], plane_mvp);
+      occlusion.flush();
+      visible.erase(std::remove_if(visible.begin(), visible.end(),
+            [&](int i) { return !occlusion.visible(item_bounds(i)); }), visible.end());
+      if (int_Time % 600 == 0)
+        logDebug("Masked occlusion: %i occluder triangles in %.1fus, %i of %i culled",
+            occlusion.occluder_triangles, occlusion.raster_us, occlusion.culled, occlusion.tested);
     }
 
-    Textures::setTexture(tx_brick);
-    Shaders::sh_main.setTextureScale(5);
+    // Neither the terrain behind the dense meshes nor their own hidden
+    // layers get shaded. The batched paths draw every mesh in the same
+    // call with the same depth test, so they go without.
+    bool prepassed = depth_prepass && !batching;
+    if (prepassed) {
+      prepass_fragments.begin(1);
+      GLState::colorMask(false, false, false, false);
+      Shaders::sh_depth.use(camera.getMatrix());
+      for(int i : visible) {
+        const Meshes::Mesh* m = i == player_item ? mesh : cube;
+        if (!m->prepass) continue;
+        Shaders::sh_depth.setMvp(item_model(i));
+        Meshes::drawDepth(m);
+      }
+      GLState::colorMask(true, true, true, true);
+      if (prepass_fragments.end()) {
+        prepass_total += prepass_fragments.value;
+        prepass_frames++;
+      }
+    }
 
-    /*
-    Textures::setNormalMap(tx_brick_norm);
-    Matrix4 floor_mvp = Matrix4::FromScale(150, 150, 150);
-    Shaders::sh_main.setMvp(floor_mvp);
-    glBindVertexArray(floor->vao);
-    glDrawArrays(GL_TRIANGLES, 0, floor->vertex_count);
-    Textures::disableNormalMap();
-    */
+    // The batched paths shade their Hi-Z pyramid in here as well, only
+    // the per object ones compare. Results come back frames later, the
+    // tag says which setting they were counted under.
+    gbuffer_fragments.begin(batching ? -1 : prepassed);
+    // Drawn first so it occludes the batch
+    terrain_timers[terrain_mode].begin();
+    draw_terrain(camera.getMatrix(), false);
+    terrain_timers[terrain_mode].end();
+    if (int_Time % 600 == 0)
+      logDebug("Terrain mode %i: %.3fms", terrain_mode, terrain_timers[terrain_mode].ms);
+
+    if (batching && gpu_culling) {
+      Batch::batcher.begin();
+      for(int i : visible)
+        Batch::batcher.add(i == player_item ? batch_player : batch_cube, item_model(i),
+            i > player_item ? batch_prop : batch_white);
+      Culling::culler.run(Batch::batcher, camera.getMatrix(), tx_white, FBO::g_buffer.depthTex);
+      if (int_Time % 600 == 0)
+        logDebug("Gpu culling: %u + %u visible, %u outside, %u occluded",
+            Culling::culler.visible[0], Culling::culler.visible[1],
+            Culling::culler.outside, Culling::culler.occluded);
+    } else if (batching) {
+      Batch::batcher.begin();
+      for(int i : visible)
+        Batch::batcher.add(i == player_item ? batch_player : batch_cube, item_model(i),
+            i > player_item ? batch_prop : batch_white);
+      Shaders::sh_batch.use(camera.getMatrix(), tx_white);
+      Batch::batcher.submit();
+    } else if (instancing) {
+      // One buffer update and one call for all the cubes. A single call
+      // cannot be made conditional per cube, so the cubes whose last query
+      // result came back empty are left out instead.
+      cube_instances.clear();
+      bool player = false;
+      for(int i : visible) {
+        if (i == player_item) { player = true; continue; }
+        if (hw_queries && i < 32 && Occlusion::queries.occluded(i)) continue;
+        cube_instances.emplace_back();
+        cube_instance(i, cube_instances.back());
+      }
+      if (!cube_instances.empty()) {
+        GLintptr at = Shaders::frame_ring.push(cube_instances.data(), cube_instances.size() * sizeof(Meshes::instance_t));
+        Meshes::setInstances(cube, Shaders::frame_ring.buffer, at, cube_instances.size());
+        Shaders::sh_instanced.use(camera.getMatrix(), tx_white, 1);
+        Meshes::drawInstanced(cube);
+      }
+      if (player) {
+        bool equal = prepassed && mesh->prepass;
+        Shaders::sh_main.use(camera.getMatrix());
+        Shaders::sh_main.setTextureScale(1);
+        Shaders::sh_main.setMvp(item_model(player_item));
+        Textures::setTexture(tx_white);
+        Textures::disableNormalMap();
+        if (equal) {
+          GLState::depthFunc(GL_EQUAL);
+          GLState::depthMask(false);
+        }
+        Meshes::draw(mesh);
+        if (equal) {
+          GLState::depthFunc(GL_LESS);
+          GLState::depthMask(true);
+        }
+      }
+    } else {
+      // Whatever order the items come in, the queue draws them grouped
+      // by vao and front to back inside each group
+      Render::queue.begin(camera.getPosition());
+      Render::queue.setProgram(Shaders::sh_main.program_id, [&]() {
+        Shaders::sh_main.use(camera.getMatrix());
+      });
+      for(int i=0; i<32; i++) cube_gates[i] = hw_queries ? Occlusion::queries.gate(i) : 0;
+      // The matrices are built and packed on the worker threads
+      int first = Render::queue.reserve(visible.size());
+      Commands::parallelFor(visible.size(), 2048, workers, [&](int, int begin, int end) {
+        for(int v=begin; v<end; v++) {
+          int i = visible[v];
+          const Meshes::Mesh* m = i == player_item ? mesh : cube;
+          Render::item_t item = {};
+          item.program = Shaders::sh_main.program_id;
+          item.mesh = m;
+          item.texture = tx_white;
+          item.mode = GL_TRIANGLES;
+          item.instances = 1;
+          item.has_model = true;
+          item.texture_scale = 1;
+          if (i < 32) item.query = cube_gates[i];
+          Matrix4 model = item_model(i);
+          model.unpack(item.model);
+          int pass = prepassed && m->prepass ? Render::PASS_EQUAL : Render::PASS_OPAQUE;
+          Render::queue.set(first + v, pass, item, (model * Vector4(m->center, 1)).xyz());
+        }
+      });
+      Render::queue.execute();
+    }
+    if (gbuffer_fragments.end() && gbuffer_fragments.tag >= 0) {
+      fragments[gbuffer_fragments.tag] += gbuffer_fragments.value;
+      fragment_frames[gbuffer_fragments.tag]++;
+    }
+    if (int_Time % 600 == 0) {
+      if (!gbuffer_fragments.supported)
+        logDebug("Depth pre-pass: no pipeline statistics queries");
+      else
+        logDebug("Depth pre-pass: %.0f g buffer fragments per frame with it (%.0f in the pre-pass), %.0f without, %i results late",
+            fragments[1] / std::max(fragment_frames[1], 1), prepass_total / std::max(prepass_frames, 1),
+            fragments[0] / std::max(fragment_frames[0], 1), gbuffer_fragments.dropped);
+      fragments[0] = fragments[1] = prepass_total = 0;
+      gbuffer_fragments.dropped = 0;
+      fragment_frames[0] = fragment_frames[1] = prepass_frames = 0;
+    }
 
+    // Against the finished depth, the next frame draws on the results
+    if (hw_queries) {
+      for(int i=0; i<32; i++)
+        query_boxes[i] = AABB::FromSphere(lights.pos[i].xyz() + cube->center, cube->radius);
+      for(int i=0; i<17; i++) {
+        // The apex and the rim sphere
+        Vector3 dir = lights.dir[i].xyz();
+        float rim = 300 * sqrt(std::max(1 - lights.dir[i].w * lights.dir[i].w, 0.0f));
+        query_boxes[32 + i] = AABB::FromSphere(lights.pos[i].xyz(), 1);
+        query_boxes[32 + i] = AABB::Merge(query_boxes[32 + i], AABB::FromSphere(lights.pos[i].xyz() + dir * 300, rim));
+      }
+      Occlusion::queries.issue(camera.getMatrix(), camera.getPosition(), query_boxes);
+    }
 
-    // test
-    Shaders::sh_plane.use(
-        camera.getMatrix(),
-        camera.getPosition(),
-        tx_water,
-        tx_grass,
-        tx_stone);
-    Shaders::sh_plane.setTextureScale(0.05);
-    Shaders::sh_plane.setMvp(
-        Matrix4::FromScale(10) * 
-        Matrix4::FromTranslation(-12.5, -10, -12.5));
-    glBindVertexArray(plane->vao);
-    glDrawArrays(GL_POINTS, 0, plane->vertex_count);
+    if (froxel_fog)
+      Volumetrics::froxels.update(camera.getMatrix(), camera.getPosition(), FBO::shadow_atlas.depthTex);
 
     // <--- Draw combined to post buffer ---->
     FBO::post_buffer.bind();
@@ -165,57 +559,133 @@ int main(int argc, char** argv) {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     Shaders::sh_combinator.use(
-        lights,
         camera.getMatrix(),
         camera.getPosition(),
         FBO::g_buffer.normalTex,
         FBO::g_buffer.materialTex,
-        FBO::g_buffer.depthTex);
-    glBindVertexArray(quad->vao);
-    glDrawArrays(GL_TRIANGLES, 0, quad->vertex_count);
-    glBindVertexArray(0);
+        FBO::g_buffer.depthTex,
+        FBO::shadow_atlas.depthTex,
+        froxel_fog ? Volumetrics::froxels.integrated : Volumetrics::froxels.empty);
+    Meshes::draw(quad);
+    GLState::bindVertexArray(0);
 
 
-    // Blend the cones over the over the scenes
+    // Blend the cones over the over the scenes at reduced resolution,
+    // the froxel fog already contains them when it is on
     FBO::cone_buffer.bind();
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    mvp = Matrix4::FromAxisRotations(0, 0, 0);
-    Shaders::sh_cone.use(camera.getMatrix(), camera.getPosition(), FBO::g_buffer.depthTex);
-    glEnable(GL_BLEND);
-    glDisable(GL_DEPTH_TEST);
-    glBlendFunc(GL_ONE, GL_ONE);
-    glBindVertexArray(cone->vao);
-    for(int i=0; i<17; i++) {
-      mvp = Matrix4::FromTranslation(lights.pos[i].xyz()) * 
-        Matrix4::FromNormal(lights.dir[i].xyz()) * 
-        Matrix4::FromScale(300);
-      Shaders::sh_cone.setMvp(mvp);
-      Shaders::sh_cone.setCone(lights.dir[i], lights.col[i]);
-      glDrawArrays(GL_POINTS, 0, cone->vertex_count);
-    }
-    glDisable(GL_BLEND);
-    glEnable(GL_DEPTH_TEST);
-
-
-    // <--- Draw result with post shader --->
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, D_CONE_WIDTH, D_CONE_HEIGHT);
+    glClear(GL_COLOR_BUFFER_BIT);
+    if (!froxel_fog) {
+      FBO::depth_range.bind();
+      Shaders::sh_depth_range.use(FBO::g_buffer.depthTex);
+      Meshes::draw(quad);
+
+      FBO::cone_buffer.bind();
+      // Like the cubes, cones whose last query came back empty are left
+      // out of the single instanced draw
+      int cone_count = 0;
+      for(int i=0; i<17; i++) {
+        if (hw_queries && Occlusion::queries.occluded(32 + i)) continue;
+        Shaders::cone_instance_t &c = cones[cone_count++];
+        mvp = Matrix4::FromTranslation(lights.pos[i].xyz()) * 
+          Matrix4::FromNormal(lights.dir[i].xyz()) * 
+          Matrix4::FromScale(300);
+        mvp.unpack(c.model);
+
+        // Rim radius in pixels, measured halfway down the cone
+        Vector3 mid = lights.pos[i].xyz() + lights.dir[i].xyz() * 150;
+        float dist = std::max((mid - camera.getPosition()).length(), 1.0f);
+        float radius_px = 150 * sqrt(std::max(1 - lights.dir[i].w * lights.dir[i].w, 0.0f)) / dist
+          * (D_CONE_HEIGHT / 2) / tan(camera.getFov() / 2);
+        c.color = Vector4(lights.col[i].xyz(), Shaders::coneLodStep(radius_px));
+        c.cone = lights.dir[i];
+      }
+      if (cone_count) {
+        Shaders::sh_cone.setInstances(cones, cone_count);
+        Render::queue.begin(camera.getPosition());
+        Render::queue.setProgram(Shaders::sh_cone.program_id, [&]() {
+          Shaders::sh_cone.use(camera.getMatrix(), camera.getPosition(), FBO::depth_range.tex);
+        });
+        Render::item_t item = {};
+        item.program = Shaders::sh_cone.program_id;
+        item.mesh = cone;
+        item.mode = GL_TRIANGLES;
+        item.instances = cone_count;
+        Render::queue.submit(Render::PASS_ADDITIVE, item, Vector3(0));
+        Render::queue.execute();
+      }
+    }
+
+
+    Bloom::pyramid.render(FBO::post_buffer.tex, FBO::cone_buffer.tex, quad);
+
+    // <--- Draw result with the post chain --->
+    GLState::bindFramebuffer(0);
     glfwGetFramebufferSize(window, &w, &h);
-    glViewport(0, 0, w, h);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    Shaders::sh_post.use(
-        FBO::post_buffer.tex,
-        FBO::cone_buffer.tex,
-        time);
-    glBindVertexArray(quad->vao);
-    glDrawArrays(GL_TRIANGLES, 0, quad->vertex_count);
-
+    PostFX::chain.setInput("cone_tex", FBO::cone_buffer.tex);
+    PostFX::chain.setInput("cone_depth", FBO::depth_range.tex);
+    PostFX::chain.setInput("depth", FBO::g_buffer.depthTex);
+    PostFX::chain.setInput("bloom_tex", FBO::bloom_chain.tex[0]);
+    PostFX::chain.run(FBO::post_buffer.tex, 0, w, h, time, quad);
+
+
+    double frame_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - frame_start).count();
+    cpu_ms += frame_ms;
+    worst_ms = std::max(worst_ms, frame_ms);
+    if (int_Time % 600 == 0) {
+      logDebug("%s: %i objects, %.3fms cpu per frame, worst %.3fms",
+          batching ? "Batched" : "Per object", (int)visible.size(), cpu_ms / 600, worst_ms);
+      cpu_ms = worst_ms = 0;
+    }
 
     keyboard.swapBuffers();
-    glfwSwapInterval(1);
+    Shaders::frame_ring.endFrame();
+    if (int_Time % 600 == 0) {
+      Shaders::frame_ring.report();
+      Geometry::report();
+      Streaming::loader.report();
+      Occlusion::queries.report();
+    }
+    GLState::swapInterval(1);
+    int issued, elided;
+    GLState::endFrame(issued, elided);
+    gl_issued += issued;
+    gl_elided += elided;
+    Render::Queue::stats_t queued;
+    Render::queue.endFrame(queued);
+    if (int_Time % 600 == 0) {
+      logDebug("GL state: %.1f calls issued, %.1f elided per frame", gl_issued / 600.0, gl_elided / 600.0);
+      logDebug("Render queue: %i items, %i program, %i texture and %i vao changes",
+          queued.items, queued.programs, queued.textures, queued.vaos);
+      gl_issued = gl_elided = 0;
+    }
     glfwSwapBuffers(window);
     glfwPollEvents();
 //    std::this_thread::sleep_for(std::chrono::milliseconds(1000/80));
   }
+
+  // Everything still alive after this is reported as leaked
+  Streaming::loader.stop();
+  Occlusion::queries.shutdown();
+  for(Meshes::Handle h : { h_quad, h_mesh, h_cube, h_floor, h_cone, h_plane })
+    Meshes::destroy(h);
+  Meshes::destroy(Terrain::heightfield.mesh);
+  Terrain::chunks.release();
+  Terrain::patches.release();
+  Volumetrics::froxels.release();
+  Shadows::atlas.release();
+  Culling::culler.release();
+  Batch::batcher.release();
+  for(Textures::Handle h : { h_white, h_water, h_grass, h_stone })
+    Textures::destroy(h);
+  Meshes::shutdown();
+  Textures::shutdown();
+  Shaders::shutdown();
+  PostFX::shutdown();
+  FBO::shutdown();
+  Resources::shutdown();
 }
 
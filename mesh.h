@@ -1,79 +1,264 @@
 #include "deps.h"
+#include <unordered_map>
 
 namespace Meshes {
 
+// Geometry lives in the arena of its format, vao is the arena's and
+// vertex_count is what a full draw covers (indices when indexed)
 struct Mesh {
   GLuint vao;
   unsigned int vertex_count;
+  unsigned int instance_count; // set by setInstances
+  Geometry::format format;
+  int geometry;
+  // Laid into the depth buffer by drawDepth before the g buffer pass,
+  // which then shades it with an equal depth test
+  bool prepass;
+  // Local space, empty for meshes whose vertex shader places them
+  AABB bounds;
+  Vector3 center;
+  float radius;
 };
 
-Mesh* loadMesh(const char* filename) {
-  std::vector<float> vertices, normals, uvs, tangents, bitangents;
+// Box and sphere around every stride-th triple of positions
+void computeBounds(Mesh* mesh, const float* positions, size_t count, size_t stride) {
+  for(size_t i=0; i<count; i++)
+    mesh->bounds.grow(Vector3(positions[i*stride], positions[i*stride+1], positions[i*stride+2]));
+  mesh->center = mesh->bounds.center();
+  mesh->radius = 0;
+  for(size_t i=0; i<count; i++) {
+    Vector3 p = Vector3(positions[i*stride], positions[i*stride+1], positions[i*stride+2]);
+    mesh->radius = std::max(mesh->radius, (p - mesh->center).length());
+  }
+}
+
+// Static buffer, filled without binding
+GLuint createBuffer(size_t size, const void* data) {
+  GLuint buffer;
+  glCreateBuffers(1, &buffer);
+  glNamedBufferData(buffer, size, data, GL_STATIC_DRAW);
+  return buffer;
+}
+
+// Float attribute read from its own binding point of the vao
+void attribute(GLuint vao, GLuint index, GLuint buffer, GLint size, GLboolean normalized, GLsizei stride, GLuint offset) {
+  glVertexArrayVertexBuffer(vao, index, buffer, offset, stride);
+  glVertexArrayAttribFormat(vao, index, size, GL_FLOAT, normalized, 0);
+  glVertexArrayAttribBinding(vao, index, index);
+  glEnableVertexArrayAttrib(vao, index);
+}
+
+typedef Resources::handle_t Handle;
+
+// Every mesh, packed. Pointers from get() only hold until the next mesh
+// is created or destroyed, keep the handle instead.
+Resources::Pool<Mesh> pool;
+
+Mesh* get(Handle handle) {
+  return pool.get(handle);
+}
+
+// Copies the geometry into the arena of the format. Meshes without a
+// position in their first three floats clear the bounds afterwards.
+Handle createMesh(Geometry::format format, const std::vector<float> &vertices, const std::vector<GLuint> &indices,
+    const char* label) {
+  Mesh mesh = {};
+  const int floats = Geometry::formats[format].floats;
+  Geometry::Arena &arena = Geometry::arenas[format];
+  mesh.format = format;
+  mesh.geometry = arena.allocate(vertices.data(), vertices.size() / floats, indices.data(), indices.size());
+  mesh.vao = arena.vao;
+  mesh.vertex_count = indices.empty() ? vertices.size() / floats : indices.size();
+  mesh.instance_count = 0;
+  mesh.prepass = format == Geometry::FORMAT_STANDARD && mesh.vertex_count / 3 >= D_PREPASS_MIN_TRIANGLES;
+  if (floats >= 3) computeBounds(&mesh, vertices.data(), vertices.size() / floats, floats);
+  return pool.create(std::move(mesh), label);
+}
+
+// Hands the geometry back to the arena
+void destroy(Handle handle) {
+  const Mesh* mesh = pool.get(handle);
+  if (!mesh) return;
+  Geometry::arenas[mesh->format].release(mesh->geometry);
+  pool.destroy(handle);
+}
+
+// Anything the callers did not destroy is reported as a leak
+void shutdown() {
+  pool.report("meshes");
+  for(const Mesh &m : pool.items()) Geometry::arenas[m.format].release(m.geometry);
+  pool.clear();
+  Geometry::shutdown();
+}
+
+// Same as above for geometry that already sits in GL buffers, filled by
+// the loader thread. The bounds come from the caller, who had the
+// vertices.
+Handle createMesh(Geometry::format format, GLuint vertices, uint32_t vertex_count, GLuint indices, uint32_t index_count,
+    const Mesh &bounds, const char* label) {
+  Mesh mesh = bounds;
+  Geometry::Arena &arena = Geometry::arenas[format];
+  mesh.format = format;
+  mesh.geometry = arena.copy(vertices, vertex_count, indices, index_count);
+  mesh.vao = arena.vao;
+  mesh.vertex_count = index_count ? index_count : vertex_count;
+  mesh.instance_count = 0;
+  mesh.prepass = format == Geometry::FORMAT_STANDARD && mesh.vertex_count / 3 >= D_PREPASS_MIN_TRIANGLES;
+  return pool.create(std::move(mesh), label);
+}
+
+// The loader hands out triangle soup, identical vertices are merged into
+// the standard format. Touches no GL, so any thread can read.
+void readObj(const char* filename, std::vector<float> &vertices, std::vector<GLuint> &indices) {
+  std::vector<float> v, n, uv, t, bt;
   cObj model = cObj(filename);
-  model.renderBuffersTangents(vertices, normals, uvs, tangents, bitangents);
-
-  Mesh* mesh = new Mesh();
-  mesh->vertex_count = vertices.size();
-  
-  glGenVertexArrays(1, &mesh->vao);
-  glBindVertexArray(mesh->vao);
-
-  GLuint vbo, nbo, uvbo, tbo, btbo;
-  glGenBuffers(1, &vbo);
-  glGenBuffers(1, &nbo);
-  glGenBuffers(1, &uvbo);
-  glGenBuffers(1, &tbo);
-  glGenBuffers(1, &btbo);
-
-  // Fill vertices
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
-  glEnableVertexAttribArray(D_POS_BUFFER_INDEX);
-  glVertexAttribPointer(D_POS_BUFFER_INDEX, 3, GL_FLOAT, GL_FALSE, 0, (void*)(sizeof(float) * 0));
-
-  // Fill normals
-  glBindBuffer(GL_ARRAY_BUFFER, nbo);
-  glBufferData(GL_ARRAY_BUFFER, normals.size()*sizeof(float), normals.data(), GL_STATIC_DRAW);
-  glEnableVertexAttribArray(D_NORMAL_BUFFER_INDEX);
-  glVertexAttribPointer(D_NORMAL_BUFFER_INDEX, 3, GL_FLOAT, GL_TRUE, 0, (void*)(sizeof(float) * 0)); 
-
-  // Fill uvs
-  glBindBuffer(GL_ARRAY_BUFFER, uvbo);
-  glBufferData(GL_ARRAY_BUFFER, uvs.size()*sizeof(float), uvs.data(), GL_STATIC_DRAW);
-  glEnableVertexAttribArray(D_UV_BUFFER_INDEX);
-  glVertexAttribPointer(D_UV_BUFFER_INDEX, 2, GL_FLOAT, GL_FALSE, 0, (void*)(sizeof(float) * 0)); 
-
-  // Fill tangents
-  glBindBuffer(GL_ARRAY_BUFFER, tbo);
-  glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(float), tangents.data(), GL_STATIC_DRAW);
-  glEnableVertexAttribArray(D_TANGENT_BUFFER_INDEX);
-  glVertexAttribPointer(D_TANGENT_BUFFER_INDEX, 3, GL_FLOAT, GL_TRUE, 0, (void*)(sizeof(float) * 0));
-
-  // Fill bitangents
-  glBindBuffer(GL_ARRAY_BUFFER, btbo);
-  glBufferData(GL_ARRAY_BUFFER, bitangents.size() * sizeof(float), bitangents.data(), GL_STATIC_DRAW);
-  glEnableVertexAttribArray(D_BITANGENT_BUFFER_INDEX);
-  glVertexAttribPointer(D_BITANGENT_BUFFER_INDEX, 3, GL_FLOAT, GL_TRUE, 0, (void*)(sizeof(float) * 0));
-
-  glBindVertexArray(0);
-  return mesh;
+  model.renderBuffersTangents(v, n, uv, t, bt);
+
+  const int floats = Geometry::formats[Geometry::FORMAT_STANDARD].floats;
+  std::unordered_map<std::string, GLuint> seen;
+  for(size_t i=0; i<v.size()/3; i++) {
+    float vertex[] = {
+      v[i*3], v[i*3+1], v[i*3+2],
+      n[i*3], n[i*3+1], n[i*3+2],
+      uv[i*2], uv[i*2+1],
+      t[i*3], t[i*3+1], t[i*3+2],
+      bt[i*3], bt[i*3+1], bt[i*3+2] };
+    std::string key((const char*)vertex, sizeof(vertex));
+    auto it = seen.find(key);
+    if (it == seen.end()) {
+      it = seen.insert({ key, (GLuint)(vertices.size() / floats) }).first;
+      vertices.insert(vertices.end(), vertex, vertex + floats);
+    }
+    indices.push_back(it->second);
+  }
+}
+
+Handle loadMesh(const char* filename) {
+  std::vector<float> vertices;
+  std::vector<GLuint> indices;
+  readObj(filename, vertices, indices);
+  return createMesh(Geometry::FORMAT_STANDARD, vertices, indices, filename);
 }
  
-Mesh* loadMeshPoints(unsigned int length, const float* points) {
-  Mesh* mesh = new Mesh();
-  mesh->vertex_count = length / 3;
-  glGenVertexArrays(1, &mesh->vao);
-  glBindVertexArray(mesh->vao);
-
-  GLuint vbo;
-  glGenBuffers(1, &vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferData(GL_ARRAY_BUFFER, length * sizeof(float), points, GL_STATIC_DRAW);
-  glEnableVertexAttribArray(D_POS_BUFFER_INDEX);
-  glVertexAttribPointer(D_POS_BUFFER_INDEX, 3, GL_FLOAT, GL_FALSE, 0, (void*)(sizeof(float) * 0));
-
-  glBindVertexArray(0);
-  return mesh;
+Handle loadMeshPoints(unsigned int length, const float* points) {
+  return createMesh(Geometry::FORMAT_POSITION3, std::vector<float>(points, points + length), {}, "points");
+}
+
+// Interleaved position, normal and height (at the uv slot) drawn with
+// indices
+Handle loadMeshHeightfield(const std::vector<float> &vertices, const std::vector<unsigned int> &indices) {
+  return createMesh(Geometry::FORMAT_HEIGHTFIELD, vertices, indices, "heightfield");
+}
+
+// Flat grid of size x size quads, the vertices only carry their grid
+// coordinate. The indices are ordered by quadrant so a quarter of the
+// grid is a quarter of the index range.
+Handle loadMeshGrid(unsigned int size) {
+  std::vector<float> data;
+  for(unsigned int z=0; z<=size; z++)
+    for(unsigned int x=0; x<=size; x++) {
+      data.push_back(x);
+      data.push_back(z);
+    }
+
+  std::vector<unsigned int> indices;
+  unsigned int half = size / 2;
+  for(unsigned int q=0; q<4; q++)
+    for(unsigned int z=(q >> 1) * half; z<((q >> 1) + 1) * half; z++)
+      for(unsigned int x=(q & 1) * half; x<((q & 1) + 1) * half; x++) {
+        unsigned int p0 = z * (size + 1) + x, p1 = p0 + 1;
+        unsigned int p2 = p0 + size + 1, p3 = p2 + 1;
+        unsigned int quad[] = { p0, p1, p2, p1, p2, p3 };
+        indices.insert(indices.end(), quad, quad + 6);
+      }
+
+  return createMesh(Geometry::FORMAT_POSITION2, data, indices, "grid");
+}
+
+// Unit cone as a fan of triangles around the apex. Vertices only carry
+// their rim segment (x) and whether they lie on the rim (y), the vertex
+// shader places them so it can drop segments for distant cones.
+Handle loadMeshCone(unsigned int segments) {
+  std::vector<float> data;
+  for(unsigned int p=0; p<segments; p++) {
+    float tri[] = { 0, 0, (float)p, 1, (float)(p+1), 1 };
+    data.insert(data.end(), tri, tri + 6);
+  }
+
+  return createMesh(Geometry::FORMAT_POSITION2, data, {}, "cone");
+}
+
+// Where a draw of the mesh starts, for callers that issue it themselves
+struct draw_range_t {
+  bool indexed;
+  GLint first;       // vertex, or index when indexed
+  GLint base_vertex;
+  GLsizei count;
+};
+
+draw_range_t range(const Mesh* mesh) {
+  const Geometry::allocation_t &a = Geometry::arenas[mesh->format].get(mesh->geometry);
+  if (a.index_count) return { true, (GLint)a.first_index, (GLint)a.first_vertex, (GLsizei)a.index_count };
+  return { false, (GLint)a.first_vertex, 0, (GLsizei)a.vertex_count };
+}
+
+// count elements from first, counted in indices for indexed meshes.
+// Instances start at base_instance in the per instance attributes.
+void drawRange(const Mesh* mesh, GLenum mode, GLint first, GLsizei count, GLsizei instances = 1, GLuint base_instance = 0,
+    GLuint vao = 0) {
+  draw_range_t r = range(mesh);
+  GLState::bindVertexArray(vao ? vao : mesh->vao);
+  if (r.indexed)
+    glDrawElementsInstancedBaseVertexBaseInstance(mode, count, GL_UNSIGNED_INT,
+        (void*)(sizeof(GLuint) * (r.first + first)), instances, r.base_vertex, base_instance);
+  else
+    glDrawArraysInstancedBaseInstance(mode, r.first + first, count, instances, base_instance);
+}
+
+void draw(const Mesh* mesh, GLenum mode = GL_TRIANGLES) {
+  drawRange(mesh, mode, 0, mesh->vertex_count);
+}
+
+// Positions only, for depth passes
+void drawDepth(const Mesh* mesh) {
+  drawRange(mesh, GL_TRIANGLES, 0, mesh->vertex_count, 1, 0, Geometry::arenas[mesh->format].depth_vao);
+}
+
+// What the instanced shaders read per instance, at D_INSTANCE_MODEL_INDEX
+// and D_INSTANCE_COLOR_INDEX
+struct instance_t {
+  mat4x4 model;
+  float color[4];
+};
+
+// Adds the instance attributes to the vao of the mesh, all sourced from
+// one binding stepped once per instance. The vao is the arena's, so every
+// mesh of the format gets them, shaders that do not read them are not
+// affected.
+void enableInstancing(Mesh* mesh) {
+  const GLuint binding = D_INSTANCE_MODEL_INDEX;
+  for(int c=0; c<4; c++) {
+    glVertexArrayAttribFormat(mesh->vao, D_INSTANCE_MODEL_INDEX + c, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 4 * c);
+    glVertexArrayAttribBinding(mesh->vao, D_INSTANCE_MODEL_INDEX + c, binding);
+    glEnableVertexArrayAttrib(mesh->vao, D_INSTANCE_MODEL_INDEX + c);
+  }
+  glVertexArrayAttribFormat(mesh->vao, D_INSTANCE_COLOR_INDEX, 4, GL_FLOAT, GL_FALSE, offsetof(instance_t, color));
+  glVertexArrayAttribBinding(mesh->vao, D_INSTANCE_COLOR_INDEX, binding);
+  glEnableVertexArrayAttrib(mesh->vao, D_INSTANCE_COLOR_INDEX);
+  glVertexArrayBindingDivisor(mesh->vao, binding, 1);
+  mesh->instance_count = 0;
+}
+
+// Points the instances at count instance_t in buffer, wherever they were
+// written (a ring region, a static buffer)
+void setInstances(Mesh* mesh, GLuint buffer, GLintptr offset, unsigned int count) {
+  glVertexArrayVertexBuffer(mesh->vao, D_INSTANCE_MODEL_INDEX, buffer, offset, sizeof(instance_t));
+  mesh->instance_count = count;
+}
+
+// Every instance, or the first count of them, in one call
+void drawInstanced(const Mesh* mesh, int count = -1) {
+  drawRange(mesh, GL_TRIANGLES, 0, mesh->vertex_count, count < 0 ? mesh->instance_count : count);
 }
 
 }
@@ -0,0 +1,577 @@
+#include <stdint.h>
+#include <unordered_map>
+
+namespace Occlusion {
+
+// Triangles in their own space, drawn with a model matrix
+struct occluder_t {
+  std::vector<Vector3> vertices;
+  std::vector<unsigned int> indices;
+};
+
+// Low detail stand in for a triangle soup by vertex clustering: vertices
+// in the same grid cell collapse to their average and the triangles that
+// collapse with them are dropped. Thin parts can vanish and silhouettes
+// move by up to a cell, good enough for an occluder.
+occluder_t cluster(const std::vector<float> &positions, int cells)
+{
+  AABB box;
+  for(size_t i=0; i<positions.size(); i+=3) box.grow(Vector3(positions[i], positions[i+1], positions[i+2]));
+  Vector3 e = box.extent();
+  float cell = std::max(std::max(e.x, e.y), e.z) / cells;
+  int nx = (int)(e.x / cell) + 1, ny = (int)(e.y / cell) + 1;
+
+  std::unordered_map<int, unsigned int> slots;
+  std::vector<Vector3> sums;
+  std::vector<int> counts;
+  std::vector<unsigned int> remap;
+  for(size_t i=0; i<positions.size(); i+=3) {
+    Vector3 p = Vector3(positions[i], positions[i+1], positions[i+2]);
+    Vector3 c = (p - box.min) * (1 / cell);
+    int key = ((int)c.z * ny + (int)c.y) * nx + (int)c.x;
+    auto it = slots.find(key);
+    if (it == slots.end()) {
+      it = slots.insert({ key, (unsigned int)sums.size() }).first;
+      sums.push_back(Vector3(0));
+      counts.push_back(0);
+    }
+    sums[it->second] = sums[it->second] + p;
+    counts[it->second]++;
+    remap.push_back(it->second);
+  }
+
+  occluder_t out;
+  for(size_t i=0; i<sums.size(); i++) out.vertices.push_back(sums[i] * (1.0f / counts[i]));
+  for(size_t t=0; t+2<remap.size(); t+=3) {
+    unsigned int a = remap[t], b = remap[t+1], c = remap[t+2];
+    if (a == b || b == c || a == c) continue;
+    unsigned int tri[] = { a, b, c };
+    out.indices.insert(out.indices.end(), tri, tri + 3);
+  }
+  return out;
+}
+
+// Coarse depth buffer in the style of masked occlusion culling. Tiles of
+// 32x8 pixels keep a coverage mask and two depths instead of a depth per
+// pixel: zmax0 bounds everything behind the tile once it was covered
+// completely, zmax1 the occluders that only cover the masked part so
+// far. Depths are the 0 to 1 window depths of the camera, 1 is far.
+// Nothing here touches the GPU.
+class MaskedRasterizer
+{
+  public:
+    static const int tile_width = 32, tile_height = 8;
+
+  private:
+    struct tile_t {
+      uint32_t mask[tile_height]; // one bit per pixel, a word per row
+      float zmax1;
+    };
+
+    // Screen space setup of one triangle, edges are positive inside
+    struct triangle_t {
+      float ea[3], eb[3], ec[3];  // e(x, y) = a * x + b * y + c
+      float za, zb, zc;           // depth plane
+      float zmin, zmax;
+      int tx0, ty0, tx1, ty1;     // tiles touched, inclusive
+    };
+
+    int width, height, tiles_x, tiles_y;
+    std::vector<tile_t> tiles;
+    std::vector<float> zmax0;     // per tile, apart for the simd test
+    std::vector<triangle_t> triangles;
+    Matrix4 camera;
+
+    void setup(const Vector4 clip[3]);
+    void rasterizeRow(int ty);
+    void updateTile(int tx, int ty, const uint32_t mask[tile_height], float z);
+
+  public:
+    int workers;
+
+    // Of the last frame
+    int occluder_triangles, tested, culled;
+    double raster_us;
+
+    MaskedRasterizer(int width, int height);
+
+    void begin(const Matrix4 &camera);
+    void add(const occluder_t &occluder, const Matrix4 &model);
+    void flush();
+    bool visible(const AABB &box);
+
+    float depth(int tx, int ty) const { return zmax0[ty * tiles_x + tx]; }
+    int tilesX() const { return tiles_x; }
+    int tilesY() const { return tiles_y; }
+};
+
+MaskedRasterizer::MaskedRasterizer(int width, int height)
+{
+  tiles_x = (width + tile_width - 1) / tile_width;
+  tiles_y = (height + tile_height - 1) / tile_height;
+  this->width = tiles_x * tile_width;
+  this->height = tiles_y * tile_height;
+  tiles.resize(tiles_x * tiles_y);
+  zmax0.resize(tiles_x * tiles_y);
+  workers = std::max(1, std::min((int)std::thread::hardware_concurrency(), tiles_y));
+  occluder_triangles = tested = culled = 0;
+  raster_us = 0;
+}
+
+void MaskedRasterizer::begin(const Matrix4 &camera)
+{
+  this->camera = camera;
+  for(tile_t &t : tiles) {
+    memset(t.mask, 0, sizeof(t.mask));
+    t.zmax1 = 0;
+  }
+  std::fill(zmax0.begin(), zmax0.end(), 1.0f);
+  triangles.clear();
+  tested = culled = 0;
+}
+
+void MaskedRasterizer::setup(const Vector4 clip[3])
+{
+  // Anything crossing the near plane is dropped, fewer occluders only
+  // ever means more visible objects
+  for(int i=0; i<3; i++)
+    if (clip[i].w <= 1e-5f || clip[i].z < -clip[i].w) return;
+  for(int axis=0; axis<2; axis++) {
+    float v[3];
+    for(int i=0; i<3; i++) v[i] = axis == 0 ? clip[i].x : clip[i].y;
+    if (v[0] > clip[0].w && v[1] > clip[1].w && v[2] > clip[2].w) return;
+    if (v[0] < -clip[0].w && v[1] < -clip[1].w && v[2] < -clip[2].w) return;
+  }
+
+  float x[3], y[3], z[3];
+  for(int i=0; i<3; i++) {
+    x[i] = (clip[i].x / clip[i].w * 0.5f + 0.5f) * width;
+    y[i] = (clip[i].y / clip[i].w * 0.5f + 0.5f) * height;
+    z[i] = clip[i].z / clip[i].w * 0.5f + 0.5f;
+  }
+
+  float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  if (fabsf(area) < 1e-6f) return;
+  if (area < 0) {
+    std::swap(x[1], x[2]);
+    std::swap(y[1], y[2]);
+    std::swap(z[1], z[2]);
+    area = -area;
+  }
+
+  triangle_t t;
+  for(int i=0; i<3; i++) {
+    int j = (i + 1) % 3;
+    t.ea[i] = y[i] - y[j];
+    t.eb[i] = x[j] - x[i];
+    t.ec[i] = x[i] * y[j] - x[j] * y[i];
+  }
+  t.za = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+  t.zb = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+  t.zc = z[0] - t.za * x[0] - t.zb * y[0];
+  t.zmin = std::min(std::min(z[0], z[1]), z[2]);
+  t.zmax = std::max(std::max(z[0], z[1]), z[2]);
+
+  float minx = std::min(std::min(x[0], x[1]), x[2]), maxx = std::max(std::max(x[0], x[1]), x[2]);
+  float miny = std::min(std::min(y[0], y[1]), y[2]), maxy = std::max(std::max(y[0], y[1]), y[2]);
+  t.tx0 = std::max((int)floorf(minx) / tile_width, 0);
+  t.ty0 = std::max((int)floorf(miny) / tile_height, 0);
+  t.tx1 = std::min((int)floorf(maxx) / tile_width, tiles_x - 1);
+  t.ty1 = std::min((int)floorf(maxy) / tile_height, tiles_y - 1);
+  if (t.tx0 > t.tx1 || t.ty0 > t.ty1) return;
+  triangles.push_back(t);
+}
+
+void MaskedRasterizer::add(const occluder_t &occluder, const Matrix4 &model)
+{
+  Matrix4 m = camera * model;
+  std::vector<Vector4> clip(occluder.vertices.size());
+  for(size_t i=0; i<clip.size(); i++) clip[i] = m * Vector4(occluder.vertices[i], 1);
+  for(size_t i=0; i+2<occluder.indices.size(); i+=3) {
+    Vector4 tri[3] = { clip[occluder.indices[i]], clip[occluder.indices[i+1]], clip[occluder.indices[i+2]] };
+    setup(tri);
+  }
+}
+
+void MaskedRasterizer::updateTile(int tx, int ty, const uint32_t mask[tile_height], float z)
+{
+  float &z0 = zmax0[ty * tiles_x + tx];
+  if (z >= z0) return;
+  tile_t &tile = tiles[ty * tiles_x + tx];
+
+  // A triangle well in front of the working layer starts a new one
+  if (tile.zmax1 - z > z0 - tile.zmax1) {
+    memset(tile.mask, 0, sizeof(tile.mask));
+    tile.zmax1 = 0;
+  }
+  tile.zmax1 = std::max(tile.zmax1, z);
+  uint32_t full = ~0u;
+  for(int r=0; r<tile_height; r++) {
+    tile.mask[r] |= mask[r];
+    full &= tile.mask[r];
+  }
+
+  // Covered completely, the working layer becomes the tile depth
+  if (full == ~0u) {
+    z0 = std::min(z0, tile.zmax1);
+    memset(tile.mask, 0, sizeof(tile.mask));
+    tile.zmax1 = 0;
+  }
+}
+
+// Every triangle touching this row of tiles, in submission order
+void MaskedRasterizer::rasterizeRow(int ty)
+{
+  typedef lanes<wide> L;
+  float offsets[tile_width];
+  for(int i=0; i<tile_width; i++) offsets[i] = i + 0.5f;
+
+  for(const triangle_t &t : triangles) {
+    if (ty < t.ty0 || ty > t.ty1) continue;
+    for(int tx=t.tx0; tx<=t.tx1; tx++) {
+      float x0 = tx * tile_width, y0 = ty * tile_height;
+
+      // Coverage of the pixel centers, a register of a row at a time.
+      // Centers on an edge count for both triangles sharing it.
+      uint32_t mask[tile_height];
+      uint32_t any = 0;
+      for(int r=0; r<tile_height; r++) {
+        float y = y0 + r + 0.5f;
+        uint32_t bits = 0;
+        for(int i=0; i<tile_width; i+=wide) {
+          L::V x = L::add(L::set(x0), L::load(&offsets[i]));
+          L::V inside = L::cmpge(L::add(L::mul(L::set(t.ea[0]), x), L::set(t.eb[0] * y + t.ec[0])), L::set(0));
+          for(int e=1; e<3; e++)
+            inside = L::and_(inside, L::cmpge(L::add(L::mul(L::set(t.ea[e]), x), L::set(t.eb[e] * y + t.ec[e])), L::set(0)));
+          bits |= (uint32_t)L::mask(inside) << i;
+        }
+        mask[r] = bits;
+        any |= bits;
+      }
+      if (!any) continue;
+
+      // Farthest the plane gets over the tile, within the triangle's range
+      float z = t.zmin;
+      for(int c=0; c<4; c++) {
+        float cx = x0 + (c & 1) * tile_width, cy = y0 + (c >> 1) * tile_height;
+        z = std::max(z, t.za * cx + t.zb * cy + t.zc);
+      }
+      updateTile(tx, ty, mask, std::min(z, t.zmax));
+    }
+  }
+}
+
+// Rows of tiles are split between the workers, no two of them ever
+// touch the same tile
+void MaskedRasterizer::flush()
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  occluder_triangles = triangles.size();
+  int n = std::max(1, std::min(workers, (int)triangles.size() / 64));
+  Commands::parallelFor(tiles_y, 1, n, [this](int, int begin, int end) {
+    for(int ty=begin; ty<end; ty++) rasterizeRow(ty);
+  });
+  raster_us = std::chrono::duration<double, std::micro>(
+      std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Conservative, false only when every tile under the box is covered by
+// something nearer than the nearest corner of the box
+bool MaskedRasterizer::visible(const AABB &box)
+{
+  tested++;
+
+  float minx = width, miny = height, maxx = 0, maxy = 0, zmin = 1;
+  bool crosses_near = false;
+  for(int c=0; c<8; c++) {
+    Vector3 p = Vector3(c & 1 ? box.max.x : box.min.x, c & 2 ? box.max.y : box.min.y, c & 4 ? box.max.z : box.min.z);
+    Vector4 clip = camera * Vector4(p, 1);
+    if (clip.w <= 1e-5f || clip.z < -clip.w) { crosses_near = true; break; }
+    float x = (clip.x / clip.w * 0.5f + 0.5f) * width;
+    float y = (clip.y / clip.w * 0.5f + 0.5f) * height;
+    minx = std::min(minx, x);
+    maxx = std::max(maxx, x);
+    miny = std::min(miny, y);
+    maxy = std::max(maxy, y);
+    zmin = std::min(zmin, clip.z / clip.w * 0.5f + 0.5f);
+  }
+
+  bool result = true;
+  if (!crosses_near) {
+    int tx0 = std::max((int)floorf(minx) / tile_width, 0);
+    int ty0 = std::max((int)floorf(miny) / tile_height, 0);
+    int tx1 = std::min((int)floorf(maxx) / tile_width, tiles_x - 1);
+    int ty1 = std::min((int)floorf(maxy) / tile_height, tiles_y - 1);
+
+    typedef lanes<wide> L;
+    L::V z = L::set(zmin);
+    result = false;
+    for(int ty=ty0; ty<=ty1 && !result; ty++) {
+      const float* row = &zmax0[ty * tiles_x];
+      int tx = tx0;
+      for(; tx + wide <= tx1 + 1 && !result; tx += wide)
+        result = L::mask(L::cmpgt(L::load(row + tx), z)) != 0;
+      for(; tx <= tx1 && !result; tx++)
+        result = row[tx] > zmin;
+    }
+    if (tx0 > tx1 || ty0 > ty1) result = false; // off screen
+  }
+
+  if (!result) culled++;
+  return result;
+}
+
+// Query objects are recycled instead of made and deleted every frame
+class QueryPool {
+  public:
+    int created = 0;
+
+    GLuint acquire() {
+      if (free.empty()) {
+        GLuint q;
+        glGenQueries(1, &q);
+        created++;
+        return q;
+      }
+      GLuint q = free.back();
+      free.pop_back();
+      return q;
+    }
+    void release(GLuint query) { free.push_back(query); }
+
+    // Every query has to have been released
+    void clear() {
+      if (!free.empty()) glDeleteQueries(free.size(), free.data());
+      free.clear();
+      created = 0;
+    }
+
+  private:
+    std::vector<GLuint> free;
+};
+
+// Bounding box queries on the GPU, one per key. The boxes are drawn
+// depth tested without writing anything against the finished depth of a
+// frame, the next frame makes the real draws of each key conditional on
+// its query and reads the results once they arrive, without waiting.
+class QueryCuller {
+  public:
+    // Counters, reset by report()
+    int issued, gated, skipped;
+
+    void init(int keys);
+    // Last frame's queries become the ones that gate, results that have
+    // arrived are read
+    void beginFrame();
+    // With the depth to test against bound. Keys whose box contains the
+    // eye get no query and are always drawn.
+    void issue(const Matrix4 &camera, const Vector3 &eye, const std::vector<AABB> &boxes);
+    // Query to make the draw of key conditional on, 0 for none
+    GLuint gate(int key);
+    // What the last result that came back said
+    bool occluded(int key) const { return results[key] != 0; }
+    void report();
+    void shutdown();
+
+  private:
+    struct pending_t {
+      GLuint query;
+      int key;
+      bool gated;
+    };
+
+    QueryPool pool;
+    Resources::Object vao; // the boxes need no attributes
+    std::vector<GLuint> current, previous;
+    std::vector<uint8_t> used, results;
+    std::vector<pending_t> pending;
+};
+
+void QueryCuller::init(int keys)
+{
+  vao = Resources::createVertexArray();
+  current.assign(keys, 0);
+  previous.assign(keys, 0);
+  used.assign(keys, 0);
+  results.assign(keys, 0);
+  issued = gated = skipped = 0;
+}
+
+void QueryCuller::beginFrame()
+{
+  for(size_t k=0; k<previous.size(); k++) {
+    if (previous[k]) pending.push_back({ previous[k], (int)k, used[k] != 0 });
+    previous[k] = current[k];
+    current[k] = 0;
+    used[k] = 0;
+  }
+
+  // Oldest first, so a key's latest result is the one that stays
+  size_t kept = 0;
+  for(const pending_t &p : pending) {
+    GLuint available = 0;
+    glGetQueryObjectuiv(p.query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      pending[kept++] = p;
+      continue;
+    }
+    GLuint samples = 0;
+    glGetQueryObjectuiv(p.query, GL_QUERY_RESULT, &samples);
+    results[p.key] = samples == 0;
+    if (p.gated && samples == 0) skipped++;
+    pool.release(p.query);
+  }
+  pending.resize(kept);
+}
+
+void QueryCuller::issue(const Matrix4 &camera, const Vector3 &eye, const std::vector<AABB> &boxes)
+{
+  Shaders::sh_box.use(camera);
+  GLState::bindVertexArray(vao);
+  GLState::enable(GL_DEPTH_TEST);
+  GLState::colorMask(false, false, false, false);
+  GLState::depthMask(false);
+  for(size_t k=0; k<boxes.size() && k<current.size(); k++) {
+    // Past the near plane the box would be clipped away
+    AABB box = boxes[k].fattened(0.5f);
+    if (eye.x >= box.min.x && eye.y >= box.min.y && eye.z >= box.min.z &&
+        eye.x <= box.max.x && eye.y <= box.max.y && eye.z <= box.max.z) {
+      results[k] = 0;
+      continue;
+    }
+    GLuint q = pool.acquire();
+    Shaders::sh_box.setBox(box);
+    glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, q);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 14);
+    glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+    current[k] = q;
+    issued++;
+  }
+  GLState::depthMask(true);
+  GLState::colorMask(true, true, true, true);
+}
+
+GLuint QueryCuller::gate(int key)
+{
+  GLuint q = previous[key];
+  if (q && !used[key]) {
+    used[key] = 1;
+    gated++;
+  }
+  return q;
+}
+
+void QueryCuller::report()
+{
+  logDebug("Occlusion queries: %i issued, %i draws gated, %i skipped, %i query objects",
+      issued, gated, skipped, pool.created);
+  issued = gated = skipped = 0;
+}
+
+void QueryCuller::shutdown()
+{
+  for(GLuint q : current) if (q) pool.release(q);
+  for(GLuint q : previous) if (q) pool.release(q);
+  for(const pending_t &p : pending) pool.release(p.query);
+  current.clear();
+  previous.clear();
+  pending.clear();
+  pool.clear();
+  vao.reset();
+}
+
+QueryCuller queries;
+
+// Known coverage on a 2x2 tile buffer with an identity camera, so clip
+// space is world space and window depth is z / 2 + 1 / 2. Exits on the
+// first case that fails.
+void check()
+{
+  auto quad = [](float x0, float y0, float x1, float y1, float z) {
+    occluder_t q;
+    q.vertices = { Vector3(x0, y0, z), Vector3(x1, y0, z), Vector3(x0, y1, z), Vector3(x1, y1, z) };
+    q.indices = { 0, 1, 3, 0, 3, 2 };
+    return q;
+  };
+  auto fail = [](const char* what) {
+    logError("Masked rasterizer check failed: %s", what);
+    exit(15);
+  };
+
+  MaskedRasterizer r(2 * MaskedRasterizer::tile_width, 2 * MaskedRasterizer::tile_height);
+  r.workers = 1;
+
+  // Fully covered tiles take the occluder depth
+  r.begin(Matrix4::Identity());
+  r.add(quad(-2, -2, 2, 2, 0), Matrix4::Identity());
+  r.flush();
+  for(int ty=0; ty<r.tilesY(); ty++)
+    for(int tx=0; tx<r.tilesX(); tx++)
+      if (fabsf(r.depth(tx, ty) - 0.5f) > 1e-5f) fail("fully covered tile");
+
+  // Box behind the occluder, then in front of it
+  if (r.visible(AABB(Vector3(-0.2f, -0.2f, 0.2f), Vector3(0.2f, 0.2f, 0.6f)))) fail("box behind an occluder");
+  if (!r.visible(AABB(Vector3(-0.2f, -0.2f, -0.6f), Vector3(0.2f, 0.2f, -0.2f)))) fail("box in front of an occluder");
+
+  // The left half of the bottom left tile stays open until the right
+  // half is drawn too
+  r.begin(Matrix4::Identity());
+  r.add(quad(-1.5f, -1.5f, -0.5f, 0, 0), Matrix4::Identity());
+  r.flush();
+  if (r.depth(0, 0) != 1) fail("partially covered tile");
+  if (!r.visible(AABB(Vector3(-0.9f, -0.9f, 0.2f), Vector3(-0.6f, -0.6f, 0.6f)))) fail("box behind a partial occluder");
+  r.begin(Matrix4::Identity());
+  r.add(quad(-1.5f, -1.5f, -0.5f, 0, 0), Matrix4::Identity());
+  r.add(quad(-0.5f, -1.5f, 0, 0, 0), Matrix4::Identity());
+  r.flush();
+  if (fabsf(r.depth(0, 0) - 0.5f) > 1e-5f) fail("tile covered in two halves");
+  if (r.depth(1, 0) != 1 || r.depth(0, 1) != 1) fail("coverage outside the occluder");
+
+  logInfo("Masked rasterizer checks passed");
+}
+
+// A wall of boxes in front of a field of small ones, reports how many
+// of the small ones inside the frustum get culled and what a frame costs
+void benchmark(int frames)
+{
+  check();
+
+  occluder_t box;
+  for(int c=0; c<8; c++)
+    box.vertices.push_back(Vector3(c & 1 ? 1 : -1, c & 2 ? 1 : -1, c & 4 ? 1 : -1));
+  const unsigned int faces[] = {
+    0, 1, 3, 0, 3, 2,  4, 6, 7, 4, 7, 5,  0, 4, 5, 0, 5, 1,
+    2, 3, 7, 2, 7, 6,  0, 2, 6, 0, 6, 4,  1, 5, 7, 1, 7, 3 };
+  box.indices.assign(faces, faces + 36);
+
+  srand(1);
+  std::vector<Matrix4> walls;
+  for(int i=0; i<64; i++)
+    walls.push_back(Matrix4::FromTranslation(rand() % 200 - 100, rand() % 10, 40 + rand() % 40) * Matrix4::FromScale(8, 6, 1));
+  Matrix4 camera = Matrix4::FromPerspective(1.25, 4.0 / 3, 1, 1000)
+    * Matrix4::FromLookAt(Vector3(0, 5, 0), Vector3(0, 5, 1), Vector3(0, 1, 0));
+  Frustum frustum(camera);
+  std::vector<AABB> objects;
+  while (objects.size() < 10000) {
+    Vector3 p = Vector3(rand() % 400 - 200, rand() % 20 - 10, 100 + rand() % 300);
+    if (frustum.intersects(p, 1.8f)) objects.push_back(AABB::FromSphere(p, 1));
+  }
+
+  MaskedRasterizer rasterizer(D_OCCLUSION_WIDTH, D_OCCLUSION_HEIGHT);
+  double raster_us = 0, test_us = 0;
+  for(int f=0; f<frames; f++) {
+    rasterizer.begin(camera);
+    for(const Matrix4 &m : walls) rasterizer.add(box, m);
+    rasterizer.flush();
+    raster_us += rasterizer.raster_us;
+    auto start = std::chrono::high_resolution_clock::now();
+    for(const AABB &o : objects) rasterizer.visible(o);
+    test_us += std::chrono::duration<double, std::micro>(
+        std::chrono::high_resolution_clock::now() - start).count();
+  }
+  logInfo("Masked occlusion: %i occluder triangles, %i of %i culled (%.1f%%), %.1fus raster and %.1fus test per frame",
+      rasterizer.occluder_triangles, rasterizer.culled, rasterizer.tested,
+      100.0 * rasterizer.culled / rasterizer.tested, raster_us / frames, test_us / frames);
+}
+
+}
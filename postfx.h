@@ -0,0 +1,218 @@
+namespace PostFX {
+
+using namespace Textures;
+
+// A full screen effect. Pointwise effects define `vec3 <name>(vec3 c)`
+// which gets the chain color of this pixel, neighborhood effects define
+// `vec3 <name>(sampler2D chain)` and may sample the chain anywhere, which
+// is what forces a new pass. Both can sample the inputs they list, by
+// name, at `uv`.
+struct effect_t {
+  const char* name;
+  std::vector<const char*> inputs;
+  std::string glsl;
+  bool neighborhood;
+};
+
+// Consecutive effects that only look at their own pixel are fused into
+// one generated shader. A pass, and a full resolution target, is only
+// added in front of an effect that samples its neighborhood.
+class Chain
+{
+  private:
+    struct stage_t {
+      GLuint program_id;
+      std::vector<const char*> inputs; // bound from unit 1 up, the chain is unit 0
+      Resources::Object fbo, tex;      // 0 for the last stage
+    };
+
+    std::vector<effect_t> effects;
+    std::vector<stage_t> stages;
+    std::vector<std::pair<const char*, Texture>> bound;
+
+    static std::string generate(const std::vector<const effect_t*> &fused, const std::vector<const char*> &inputs);
+    static void createTarget(stage_t &stage);
+    Texture find(const char* name) const;
+
+  public:
+    // Intermediate target traffic per frame. The single post shader the
+    // chain replaced had none, so this is what the chain adds.
+    long added_bytes;
+
+    void add(const effect_t &effect) { effects.push_back(effect); }
+    void compile();
+    void release() { stages.clear(); }
+    void setInput(const char* name, Texture tex);
+    void run(Texture source, GLuint framebuffer, int width, int height, float time, const Meshes::Mesh* quad) const;
+};
+
+std::string Chain::generate(const std::vector<const effect_t*> &fused, const std::vector<const char*> &inputs)
+{
+  std::string s =
+    "#version 450\n"
+    "in vec2 uv;\n"
+    "out vec3 color;\n"
+    "layout(location = " D_XSTR(D_TIME_UNIFORM_INDEX) ") uniform float time;\n"
+    "layout(binding = 0) uniform sampler2D chain;\n";
+  for(int i=0; i<(int)inputs.size(); i++)
+    s += "layout(binding = " + std::to_string(i + 1) + ") uniform sampler2D " + inputs[i] + ";\n";
+
+  for(const effect_t* e : fused) s += e->glsl;
+
+  s += "void main() {\n";
+  s += fused[0]->neighborhood ?
+    std::string("  vec3 c = ") + fused[0]->name + "(chain);\n" :
+    std::string("  vec3 c = ") + fused[0]->name + "(texture(chain, uv).xyz);\n";
+  for(int i=1; i<(int)fused.size(); i++)
+    s += std::string("  c = ") + fused[i]->name + "(c);\n";
+  s += "  color = c;\n}\n";
+  return s;
+}
+
+void Chain::createTarget(stage_t &stage)
+{
+  stage.fbo = Resources::createFramebuffer();
+  stage.tex = FBO::createTarget(GL_RGBA16F, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT, GL_LINEAR, true);
+  glNamedFramebufferTexture(stage.fbo, GL_COLOR_ATTACHMENT0, stage.tex, 0);
+
+  glNamedFramebufferDrawBuffer(stage.fbo, GL_COLOR_ATTACHMENT0);
+  if(glCheckNamedFramebufferStatus(stage.fbo, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    exit(7);
+}
+
+void Chain::compile()
+{
+  // Split in front of every neighborhood effect except the first, which
+  // can read the source directly
+  std::vector<std::vector<const effect_t*>> groups;
+  for(const effect_t &e : effects) {
+    if (groups.empty() || e.neighborhood) groups.push_back({});
+    groups.back().push_back(&e);
+  }
+
+  stages.clear();
+  for(int g=0; g<(int)groups.size(); g++) {
+    stage_t stage;
+    for(const effect_t* e : groups[g])
+      for(const char* in : e->inputs)
+        if (std::find_if(stage.inputs.begin(), stage.inputs.end(),
+              [in](const char* x) { return strcmp(x, in) == 0; }) == stage.inputs.end())
+          stage.inputs.push_back(in);
+
+    std::string fs = generate(groups[g], stage.inputs);
+    stage.program_id = Shaders::loadShaderLiteral(Shaders::quad_vs_src, fs.c_str());
+    if (g < (int)groups.size() - 1) createTarget(stage);
+    stages.push_back(std::move(stage));
+  }
+
+  // Every stage but the last writes an RGBA16F target the next one reads
+  long target = (long)D_FRAMEBUFFER_WIDTH * D_FRAMEBUFFER_HEIGHT * 8;
+  added_bytes = ((long)stages.size() - 1) * target * 2;
+  logInfo("Post chain: %i effects in %i passes, %li KB of intermediate target traffic per frame",
+      (int)effects.size(), (int)stages.size(), added_bytes / 1024);
+}
+
+void Chain::setInput(const char* name, Texture tex)
+{
+  for(auto &b : bound)
+    if (strcmp(b.first, name) == 0) { b.second = tex; return; }
+  bound.push_back({ name, tex });
+}
+
+Texture Chain::find(const char* name) const
+{
+  for(const auto &b : bound)
+    if (strcmp(b.first, name) == 0) return b.second;
+  logWarning("Post chain input %s was never set", name);
+  return 0;
+}
+
+void Chain::run(Texture source, GLuint framebuffer, int width, int height, float time, const Meshes::Mesh* quad) const
+{
+  GLState::disable(GL_DEPTH_TEST);
+  Texture chain = source;
+  for(const stage_t &stage : stages) {
+    if (stage.fbo) {
+      GLState::bindFramebuffer(stage.fbo);
+      glViewport(0, 0, D_FRAMEBUFFER_WIDTH, D_FRAMEBUFFER_HEIGHT);
+    } else {
+      GLState::bindFramebuffer(framebuffer);
+      glViewport(0, 0, width, height);
+    }
+
+    GLState::useProgram(stage.program_id);
+    glUniform1f(D_TIME_UNIFORM_INDEX, time);
+    GLState::bindTexture(0, chain);
+    for(int i=0; i<(int)stage.inputs.size(); i++) {
+      GLState::bindTexture(1 + i, find(stage.inputs[i]));
+    }
+    Meshes::draw(quad);
+    chain = stage.tex;
+  }
+  GLState::bindVertexArray(0);
+  GLState::enable(GL_DEPTH_TEST);
+}
+
+// Bilinear upsample of the low resolution cones that leaves out the
+// texels whose depth range does not contain this pixel's depth
+static const char* cones_glsl = R"(
+// Matches the projection set up by the camera
+float linearDepth(float d) {
+  const float n = 0.1, f = 1000.0;
+  return 2 * n * f / (f + n - (d * 2 - 1) * (f - n));
+}
+
+vec3 cones(vec3 c) {
+  ivec2 size = textureSize(cone_tex, 0);
+  vec2 p = uv * vec2(size) - 0.5;
+  ivec2 base = ivec2(floor(p));
+  vec2 f = fract(p);
+  float z = linearDepth(texture(depth, uv).x);
+
+  vec3 sum = vec3(0);
+  float wsum = 0;
+  for(int i=0; i<4; i++) {
+    ivec2 o = ivec2(i & 1, i >> 1);
+    ivec2 t = clamp(base + o, ivec2(0), size - 1);
+    vec2 range = texelFetch(cone_depth, t, 0).xy;
+    float dz = max(max(linearDepth(range.x) - z, z - linearDepth(range.y)), 0);
+    float w = mix(1 - f.x, f.x, o.x) * mix(1 - f.y, f.y, o.y) / (0.001 + 10 * dz / z);
+    sum += texelFetch(cone_tex, t, 0).xyz * w;
+    wsum += w;
+  }
+  return c + 0.2 * (wsum > 0 ? sum / wsum : texture(cone_tex, uv).xyz);
+}
+)";
+
+// Every level of the pyramid adds its own copy of the glow
+static const char* bloom_glsl =
+"const float bloom_weight = 0.8 / " D_XSTR(D_BLOOM_LEVELS) ";\n"
+R"(
+vec3 bloom(vec3 c) {
+  return c + texture(bloom_tex, uv).xyz * bloom_weight;
+}
+)";
+
+// Breaks up the banding the smooth bloom gradients get in 8 bit
+static const char* dither_glsl = R"(
+vec3 dither(vec3 c) {
+  vec2 p = gl_FragCoord.xy + fract(time) * vec2(47, 17);
+  float n = fract(52.9829189 * fract(dot(p, vec2(0.06711056, 0.00583715))));
+  return c + (n - 0.5) / 255.0;
+}
+)";
+
+Chain chain;
+
+void init() {
+  chain.add({ "cones",  { "cone_tex", "cone_depth", "depth" }, cones_glsl,  false });
+  chain.add({ "bloom",  { "bloom_tex" },                        bloom_glsl,  false });
+  chain.add({ "dither", { },                                    dither_glsl, false });
+  chain.compile();
+}
+
+void shutdown() {
+  chain.release();
+}
+
+}
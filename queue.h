@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <unordered_map>
+
+namespace Render {
+
+enum pass {
+  PASS_OPAQUE,   // depth tested, front to back within the same state
+  PASS_EQUAL,    // opaque meshes whose depth a pre-pass already wrote
+  PASS_ADDITIVE, // blended one to one without depth, only grouped by state
+};
+
+// One draw call and what has to be bound for it. A zero texture leaves
+// the unit alone, a zero normal map binds the flat default, a query makes
+// the draw conditional on it.
+struct item_t {
+  GLuint program;
+  const Meshes::Mesh* mesh;
+  GLuint texture, normal_map;
+  GLenum mode;
+  GLsizei instances;
+  bool has_model;
+  float texture_scale; // not set when zero
+  mat4x4 model;
+  GLuint query;
+};
+
+// Most significant first: pass 2 bits, program 10, material 12, vao 12,
+// depth 28. Names beyond the field width only weaken the grouping.
+inline uint64_t makeKey(int pass, GLuint program, GLuint material, GLuint vao, uint32_t depth)
+{
+  return ((uint64_t)(pass & 0x3) << 62)
+    | ((uint64_t)(program & 0x3ff) << 52)
+    | ((uint64_t)(material & 0xfff) << 40)
+    | ((uint64_t)(vao & 0xfff) << 28)
+    | (depth & 0xfffffff);
+}
+
+struct entry_t {
+  uint64_t key;
+  uint32_t index;
+};
+
+// LSD radix sort, a byte per pass. Bytes that are the same in every key
+// are skipped, which is most of them since the state fields repeat.
+void radixSort(std::vector<entry_t> &entries, std::vector<entry_t> &scratch)
+{
+  const size_t n = entries.size();
+  if (n < 2) return;
+  scratch.resize(n);
+
+  static uint32_t counts[8][256];
+  memset(counts, 0, sizeof(counts));
+  for(size_t i=0; i<n; i++)
+    for(int b=0; b<8; b++)
+      counts[b][(entries[i].key >> (b * 8)) & 0xff]++;
+
+  entry_t* src = entries.data();
+  entry_t* dst = scratch.data();
+  for(int b=0; b<8; b++) {
+    uint32_t* c = counts[b];
+    if (c[(src[0].key >> (b * 8)) & 0xff] == n) continue;
+    for(uint32_t i=0, sum=0; i<256; i++) {
+      uint32_t count = c[i];
+      c[i] = sum;
+      sum += count;
+    }
+    for(size_t i=0; i<n; i++)
+      dst[c[(src[i].key >> (b * 8)) & 0xff]++] = src[i];
+    std::swap(src, dst);
+  }
+  if (src != entries.data()) memcpy(entries.data(), src, n * sizeof(entry_t));
+}
+
+// Draws are submitted in any order and executed sorted by their key, so
+// every program, texture and vao is bound once per run of equal state
+class Queue {
+  public:
+    // How many items went through and how often each binding changed
+    struct stats_t {
+      int items, programs, textures, vaos, passes;
+    };
+
+    // use is called whenever the queue switches to the program, it binds
+    // it and sets whatever is shared by every item (camera, samplers)
+    void setProgram(GLuint program, std::function<void()> use);
+
+    void begin(const Vector3 &cam_pos);
+    void submit(int pass, const item_t &item, const Vector3 &center);
+    // Makes room for count items and returns the first slot, the slots
+    // can then be set from any thread
+    int reserve(int count);
+    void set(int slot, int pass, const item_t &item, const Vector3 &center);
+    // Sorts, records the sorted items on worker threads and replays them
+    void execute();
+
+    // Counts since the last call
+    void endFrame(stats_t &out);
+
+    // Depth that maps to the last key value
+    float far = 4096;
+
+  private:
+    Vector3 eye;
+    std::vector<item_t> items;
+    std::vector<entry_t> entries, scratch;
+    std::unordered_map<GLuint, std::function<void()>> programs;
+    Commands::Recorder recorder;
+    std::vector<stats_t> partial;
+    stats_t stats = {};
+
+    void record(Commands::CommandBuffer &out, int begin, int end, stats_t &counts) const;
+};
+
+void Queue::setProgram(GLuint program, std::function<void()> use)
+{
+  programs[program] = use;
+}
+
+void Queue::begin(const Vector3 &cam_pos)
+{
+  eye = cam_pos;
+  items.clear();
+  entries.clear();
+}
+
+void Queue::submit(int pass, const item_t &item, const Vector3 &center)
+{
+  set(reserve(1), pass, item, center);
+}
+
+int Queue::reserve(int count)
+{
+  int first = items.size();
+  items.resize(first + count);
+  entries.resize(first + count);
+  return first;
+}
+
+void Queue::set(int slot, int pass, const item_t &item, const Vector3 &center)
+{
+  uint32_t depth = 0;
+  if (pass == PASS_OPAQUE) {
+    float d = std::min((center - eye).length() / far, 1.0f);
+    depth = (uint32_t)(d * 0xfffffff);
+  }
+  entries[slot] = { makeKey(pass, item.program, item.texture, item.mesh->vao, depth), (uint32_t)slot };
+  items[slot] = item;
+}
+
+// A slice starts from unknown state, so only its first item binds
+// everything. Runs without GL.
+void Queue::record(Commands::CommandBuffer &out, int begin, int end, stats_t &counts) const
+{
+  int pass = -1;
+  GLuint program = 0, vao = 0, texture = 0, normal_map = ~0u;
+  for(int i=begin; i<end; i++) {
+    const entry_t &e = entries[i];
+    const item_t &it = items[e.index];
+    int p = e.key >> 62;
+    if (p != pass) {
+      pass = p;
+      counts.passes++;
+      if (pass == PASS_ADDITIVE) {
+        out.enable(GL_BLEND);
+        out.disable(GL_DEPTH_TEST);
+        out.blendFunc(GL_ONE, GL_ONE);
+      } else {
+        out.disable(GL_BLEND);
+        out.enable(GL_DEPTH_TEST);
+      }
+      // Only the fragments that won the pre-pass are shaded
+      if (pass == PASS_EQUAL) out.depth(GL_EQUAL, GL_FALSE);
+      else out.depth(GL_LESS, GL_TRUE);
+    }
+    if (it.program != program) {
+      program = it.program;
+      counts.programs++;
+      auto use = programs.find(program);
+      if (use != programs.end()) out.call(&use->second);
+      else out.bindProgram(program);
+      // The setup may have bound textures of its own
+      texture = 0;
+      normal_map = ~0u;
+    }
+    if (it.texture && it.texture != texture) {
+      texture = it.texture;
+      counts.textures++;
+      out.bindTexture(0, texture);
+    }
+    if (it.normal_map != normal_map && pass != PASS_ADDITIVE) {
+      normal_map = it.normal_map;
+      out.bindTexture(1, normal_map ? normal_map : Textures::flatNormal());
+    }
+    if (it.mesh->vao != vao) {
+      vao = it.mesh->vao;
+      counts.vaos++;
+      out.bindVertexArray(vao);
+    }
+    if (it.texture_scale > 0) out.uniform(D_TEXTURE_SCALE_UNIFORM_INDEX, it.texture_scale);
+    if (it.has_model) {
+      GLintptr at = Shaders::frame_ring.push(it.model);
+      out.bindBufferRange(GL_UNIFORM_BUFFER, D_TRANSFORM_BLOCK_BINDING, Shaders::frame_ring.buffer, at, sizeof(mat4x4));
+    }
+
+    Meshes::draw_range_t r = Meshes::range(it.mesh);
+    if (it.query) out.beginConditional(it.query);
+    if (r.indexed) out.drawElements(it.mode, r.first, r.count, it.instances, r.base_vertex);
+    else           out.drawArrays(it.mode, r.first, r.count, it.instances);
+    if (it.query) out.endConditional();
+  }
+  if (pass == PASS_ADDITIVE && end == (int)entries.size()) {
+    out.disable(GL_BLEND);
+    out.enable(GL_DEPTH_TEST);
+  }
+  if (pass == PASS_EQUAL && end == (int)entries.size())
+    out.depth(GL_LESS, GL_TRUE);
+}
+
+void Queue::execute()
+{
+  radixSort(entries, scratch);
+
+  partial.assign(recorder.workers, stats_t{});
+  recorder.record(entries.size(), [&](Commands::CommandBuffer &out, int worker, int begin, int end) {
+    record(out, begin, end, partial[worker]);
+  });
+  recorder.replay();
+
+  stats.items += entries.size();
+  for(const stats_t &p : partial) {
+    stats.programs += p.programs;
+    stats.textures += p.textures;
+    stats.vaos += p.vaos;
+    stats.passes += p.passes;
+  }
+  items.clear();
+  entries.clear();
+}
+
+void Queue::endFrame(stats_t &out)
+{
+  out = stats;
+  stats = {};
+}
+
+// Sorts count random keys shaped like a frame's worth of draws, next to
+// std::sort on the same input
+void benchmark(int count)
+{
+  srand(1);
+  std::vector<entry_t> input(count), entries, scratch;
+  for(int i=0; i<count; i++) {
+    uint32_t depth = ((uint32_t)rand() << 8) ^ rand();
+    input[i] = { makeKey(rand() % 2, 1 + rand() % 16, 1 + rand() % 64, 1 + rand() % 256, depth), (uint32_t)i };
+  }
+
+  const int runs = 50;
+  double radix_ms = 0, std_ms = 0;
+  for(int r=0; r<runs; r++) {
+    entries = input;
+    auto start = std::chrono::high_resolution_clock::now();
+    radixSort(entries, scratch);
+    radix_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - start).count();
+  }
+  for(int i=1; i<count; i++)
+    if (entries[i - 1].key > entries[i].key) {
+      logError("Radix sort out of order at %i", i);
+      exit(9);
+    }
+  for(int r=0; r<runs; r++) {
+    entries = input;
+    auto start = std::chrono::high_resolution_clock::now();
+    std::sort(entries.begin(), entries.end(),
+        [](const entry_t &a, const entry_t &b) { return a.key < b.key; });
+    std_ms += std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - start).count();
+  }
+  logInfo("Sorting %i draw keys: radix %.3fms, std::sort %.3fms", count, radix_ms / runs, std_ms / runs);
+}
+
+Queue queue;
+
+}
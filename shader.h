@@ -3,6 +3,9 @@ namespace Shaders {
 
 using namespace Textures;
 
+#define D_STR(x) #x
+#define D_XSTR(x) D_STR(x)
+
 static const char* vs_src = R"(
 #version 450
 layout(location=0) in vec3 vPos;
@@ -20,7 +23,13 @@ out flat mat3 TBN;
 out flat int usenormalmap;
 
 layout(location = 0) uniform mat4 uCamera;
-layout(location = 1) uniform mat4 uMvp;
+layout(std140, binding=)" D_XSTR(D_TRANSFORM_BLOCK_BINDING) R"() uniform Transform {
+  mat4 uMvp;
+};
+
+// The depth pre-pass computes the same position, the equal depth test
+// needs it to the bit
+invariant gl_Position;
 
 void main() {
   vec4 worldPos = uMvp * vec4(vPos, 1); 
@@ -78,6 +87,107 @@ void main() {
 }
 )";
 
+// Same outputs as the main shader for everything in the batcher, the
+// transform and material come from storage buffers indexed by the draw
+static const char* batch_vs_src = R"(
+#version 450
+layout(location=0) in vec3 vPos;
+layout(location=1) in vec3 vNormal;
+layout(location=2) in vec2 vUv;
+layout(location=)" D_XSTR(D_DRAW_INDEX) R"() in uint vDraw;
+
+struct draw_t {
+  mat4 model;
+  vec4 sphere;
+  uint material, index_count, first_index;
+  int base_vertex;
+};
+
+layout(std430, binding=)" D_XSTR(D_DRAWS_BLOCK_BINDING) R"() readonly buffer Draws {
+  draw_t draws[];
+};
+
+out vec3 normal;
+out vec2 uv;
+out flat uint material;
+
+layout(location = 0) uniform mat4 uCamera;
+
+void main() {
+  draw_t d = draws[vDraw];
+  gl_Position = uCamera * d.model * vec4(vPos, 1);
+  normal = normalize(d.model * vec4(vNormal, 0)).xyz;
+  uv = vUv;
+  material = d.material;
+}
+)";
+
+static const char* batch_fs_src = R"(
+#version 450
+
+in vec3 normal;
+in vec2 uv;
+in flat uint material;
+
+out vec3 c_normal;
+out vec3 c_material;
+
+layout(std430, binding=)" D_XSTR(D_MATERIALS_BLOCK_BINDING) R"() readonly buffer Materials {
+  vec4 materials[]; // tint, texture scale
+};
+
+layout(location = 5) uniform sampler2D albedo;
+
+void main() {
+  vec4 m = materials[material];
+  c_material = texture(albedo, uv * m.w).xyz * m.xyz;
+  c_normal = normalize(normal) / 2 + 0.5;
+}
+)";
+
+// Main shader for instanced meshes, the transform and tint are per
+// instance attributes
+static const char* instanced_vs_src = R"(
+#version 450
+layout(location=0) in vec3 vPos;
+layout(location=1) in vec3 vNormal;
+layout(location=2) in vec2 vUv;
+layout(location=5) in mat4 iModel;
+layout(location=9) in vec4 iColor;
+
+out vec3 normal;
+out vec2 uv;
+out flat vec3 tint;
+
+layout(location = 0) uniform mat4 uCamera;
+
+void main() {
+  gl_Position = uCamera * iModel * vec4(vPos, 1);
+  normal = normalize(iModel * vec4(vNormal, 0)).xyz;
+  uv = vUv;
+  tint = iColor.rgb;
+}
+)";
+
+static const char* instanced_fs_src = R"(
+#version 450
+
+in vec3 normal;
+in vec2 uv;
+in flat vec3 tint;
+
+out vec3 c_normal;
+out vec3 c_material;
+
+layout(location = 3) uniform float texture_scale;
+layout(location = 5) uniform sampler2D albedo;
+
+void main() {
+  c_material = texture(albedo, uv * texture_scale).xyz * tint;
+  c_normal = normalize(normal) / 2 + 0.5;
+}
+)";
+
 static const char* quad_vs_src = R"( 
 #version 450
 in vec3 vPos;
@@ -113,7 +223,30 @@ void main() {
 }
 )";
 
-static const char* post_fs_src = R"(
+// Dual filter downsample: the center and the four diagonal corners of
+// the pixel, each a bilinear fetch of four source texels
+static const char* bloom_down_fs_src = R"(
+#version 450
+
+in vec2 uv;
+out vec3 color;
+
+layout(location = 23) uniform sampler2D src;
+
+void main() {
+  vec2 hp = 0.5 / textureSize(src, 0);
+  color = texture(src, uv).xyz * 4;
+  color += texture(src, uv - hp).xyz;
+  color += texture(src, uv + hp).xyz;
+  color += texture(src, uv + vec2(hp.x, -hp.y)).xyz;
+  color += texture(src, uv - vec2(hp.x, -hp.y)).xyz;
+  color /= 8;
+}
+)";
+
+// First step of the pyramid, keeps only what is bright enough to glow
+// out of the scene and adds the cones which always do
+static const char* bloom_prefilter_fs_src = R"(
 #version 450
 
 in vec2 uv;
@@ -121,19 +254,151 @@ out vec3 color;
 
 layout(location = 17) uniform sampler2D scene;
 layout(location = 18) uniform sampler2D cones;
-layout(location = 4) uniform float time;
+layout(location = 3)  uniform float threshold;
+
+void main() {
+  vec2 hp = 0.5 / textureSize(scene, 0);
+  vec3 c = texture(scene, uv).xyz * 4;
+  c += texture(scene, uv - hp).xyz;
+  c += texture(scene, uv + hp).xyz;
+  c += texture(scene, uv + vec2(hp.x, -hp.y)).xyz;
+  c += texture(scene, uv - vec2(hp.x, -hp.y)).xyz;
+  c /= 8;
+
+  // Soft knee so the cut off does not show as an edge
+  float b = max(c.r, max(c.g, c.b));
+  float knee = threshold * 0.5;
+  float soft = clamp(b - threshold + knee, 0, 2 * knee);
+  soft = soft * soft / (4 * knee + 0.0001);
+  c *= max(soft, b - threshold) / max(b, 0.0001);
+
+  color = c + texture(cones, uv).xyz;
+}
+)";
+
+// Tent upsample of the level below, blended additively on top of the
+// level it is drawn into
+static const char* bloom_up_fs_src = R"(
+#version 450
+
+in vec2 uv;
+out vec3 color;
+
+layout(location = 23) uniform sampler2D src;
+
+void main() {
+  vec2 hp = 0.5 / textureSize(src, 0);
+  color = texture(src, uv + vec2(-hp.x * 2, 0)).xyz;
+  color += texture(src, uv + vec2(-hp.x, hp.y)).xyz * 2;
+  color += texture(src, uv + vec2(0, hp.y * 2)).xyz;
+  color += texture(src, uv + vec2(hp.x, hp.y)).xyz * 2;
+  color += texture(src, uv + vec2(hp.x * 2, 0)).xyz;
+  color += texture(src, uv + vec2(hp.x, -hp.y)).xyz * 2;
+  color += texture(src, uv + vec2(0, -hp.y * 2)).xyz;
+  color += texture(src, uv + vec2(-hp.x, -hp.y)).xyz * 2;
+  color /= 12;
+}
+)";
+
+static const char* depth_range_fs_src = R"(
+#version 450
+
+layout(location = 17) uniform sampler2D t_depth;
+layout(location = 3)  uniform int scale;
+
+out vec2 range;
 
 void main() {
- vec3 conemap = texture(cones, uv).xyz;
- float b = length(conemap);
- for(int s=0; s<9; s++) {
-     float f = (s / 9.0f) * 6.2832f;
-     vec2 offset = vec2(sin(f), cos(f)) / (100.0f + 10000 * pow(b, 100));
-     conemap += texture(cones, uv + offset).xyz;
- }
- color = texture(scene, uv).xyz + conemap / 10.0f;
+  ivec2 base = ivec2(gl_FragCoord.xy) * scale;
+  ivec2 last = textureSize(t_depth, 0) - 1;
+  range = vec2(1, 0);
+  for(int y=0; y<scale; y++) {
+    for(int x=0; x<scale; x++) {
+      float d = texelFetch(t_depth, min(base + ivec2(x, y), last), 0).x;
+      range = vec2(min(range.x, d), max(range.y, d));
+    }
+  }
 }
+)";
+
+// Shared by every shader that lights something, spliced in by expand()
+static const char* lighting_glsl = R"(
+layout(location = 20) uniform sampler2DShadow t_shadow;
 
+layout (std140, binding = 0) uniform shader_data
+{
+  vec4 light_pos[32];
+  vec4 light_col[32];
+  vec4 light_dir[32];
+};
+
+layout (std140, binding = 1) uniform shadow_data
+{
+  mat4 shadow_mat[32];
+  vec4 shadow_rect[32]; // xy atlas offset, z atlas scale, w 1 when shadowed
+};
+
+// Position of pos in the atlas and its depth as seen from light i,
+// false when the light has no shadow there
+bool shadowCoord(int i, vec3 pos, out vec3 c) {
+  vec4 rect = shadow_rect[i];
+  if (rect.w == 0) return false;
+
+  vec4 lp = shadow_mat[i] * vec4(pos, 1);
+  if (lp.w <= 0) return false;
+  c = lp.xyz / lp.w * 0.5 + 0.5;
+  if (c.x < 0 || c.x > 1 || c.y < 0 || c.y > 1 || c.z > 1) return false;
+  c.xy = rect.xy + c.xy * rect.z;
+  return true;
+}
+
+// 3x3 PCF over the light's region of the atlas, clamped so the
+// kernel never reads a neighbouring light's depth
+float shadow(int i, vec3 pos, vec3 normal) {
+  vec3 c;
+  if (!shadowCoord(i, pos + normal * 0.1, c)) return 1;
+
+  vec4 rect = shadow_rect[i];
+  vec2 texel = 1.0 / vec2(textureSize(t_shadow, 0));
+  vec2 lo = rect.xy + texel;
+  vec2 hi = rect.xy + rect.zz - texel;
+  float lit = 0;
+  for(int y=-1; y<=1; y++)
+    for(int x=-1; x<=1; x++)
+      lit += texture(t_shadow, vec3(clamp(c.xy + vec2(x, y) * texel, lo, hi), c.z));
+  return lit / 9;
+}
+
+// Single hardware filtered tap, for places that average many samples anyway
+float shadowTap(int i, vec3 pos) {
+  vec3 c;
+  if (!shadowCoord(i, pos, c)) return 1;
+  return texture(t_shadow, c);
+}
+
+// Spot attenuation, fading out over 1/16 past the edge of the cone
+float spot(int i, vec3 lDir) {
+  float cone = light_dir[i].w;
+  float cone_angle = max(dot(lDir, -light_dir[i].xyz), 0);
+  if (cone_angle < cone)
+    return max(1 - 16 * abs(cone_angle-cone), 0);
+  return 1;
+}
+)";
+
+static const char* froxel_glsl =
+"const float froxel_near = " D_XSTR(D_FROXEL_NEAR) ";\n"
+"const float froxel_far  = " D_XSTR(D_FROXEL_FAR) ";\n"
+"const float fog_density = " D_XSTR(D_FOG_DENSITY) ";\n"
+R"(
+// Slices are spaced exponentially in distance from the camera
+float froxelSlice(float dist) {
+  return log(max(dist, froxel_near) / froxel_near) / log(froxel_far / froxel_near);
+}
+
+float froxelDistance(float slice) {
+  return froxel_near * pow(froxel_far / froxel_near, slice);
+}
 )";
 
 static const char* defer_fs_src = R"(
@@ -146,15 +411,12 @@ layout(location = 2)  uniform vec3      uCamPos;
 layout(location = 15) uniform sampler2D t_normal;
 layout(location = 16) uniform sampler2D t_material;
 layout(location = 17) uniform sampler2D t_depth;
+layout(location = 22) uniform sampler3D t_fog;
 
 out vec3 color;
 
-layout (std140) uniform shader_data
-{
-  vec4 light_pos[32];
-  vec4 light_col[32];
-  vec4 light_dir[32];
-};
+#include "lighting"
+#include "froxel"
 
 // this is supposed to get the world position from the depth buffer
 vec3 WorldPosFromDepth(float depth) {
@@ -184,13 +446,10 @@ void main() {
     vec3 lVec = light_pos[i].xyz - pos;
     float dist2 = dot(lVec, lVec);
     vec3 lDir = lVec / sqrt(dist2);
-    vec3 lNormal = light_dir[i].xyz;
-    float cone = light_dir[i].w;
 
-    float corr = 1;
-    float cone_angle = max(dot(lDir, -lNormal), 0);
-    if (cone_angle < cone)
-      corr = max(1 - 16 * abs(cone_angle-cone), 0);
+    float corr = spot(i, lDir);
+    if (corr > 0)
+      corr *= shadow(i, pos, normal);
 
     float falloff = 1 / dist2;
     float diffuse = max(dot(lDir, normal), 0);
@@ -200,87 +459,304 @@ void main() {
     color += (specular + diffuse) * material * light_col[i].xyz * falloff * corr;
   }
 
+  // Scattered light and extinction between the camera and the surface,
+  // a texel holds everything up to the far side of its slice
+  float fog_w = froxelSlice(length(pos - uCamPos)) - 0.5 / textureSize(t_fog, 0).z;
+  vec4 fog = texture(t_fog, vec3(uv, fog_w));
+  color = color * fog.a + fog.rgb;
+
   float mist = pow(depth, 1000);
   color = mist * vec3(0.25) + (1-mist) * color;
 }
 )";
 
-static const char* empty_vs_src = R"(
+static const char* froxel_inject_cs_src = R"(
 #version 450
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
 
-void main() { }
+layout(binding = 0, rgba16f) uniform writeonly image3D scatter;
+
+layout(location = 0)  uniform mat4  uInvCamera;
+layout(location = 1)  uniform mat4  uPrevCamera;
+layout(location = 2)  uniform vec3  uCamPos;
+layout(location = 3)  uniform vec3  uPrevCamPos;
+layout(location = 4)  uniform float jitter;
+layout(location = 5)  uniform float history_weight;
+layout(location = 17) uniform sampler3D history;
+
+#include "lighting"
+#include "froxel"
+
+void main() {
+  ivec3 id = ivec3(gl_GlobalInvocationID);
+  ivec3 size = imageSize(scatter);
+  if (any(greaterThanEqual(id, size))) return;
+
+  // One jittered sample along the view ray through the froxel
+  vec2 uv = (vec2(id.xy) + 0.5) / vec2(size.xy);
+  vec4 far_point = uInvCamera * vec4(uv * 2 - 1, 1, 1);
+  vec3 dir = normalize(far_point.xyz / far_point.w - uCamPos);
+  vec3 pos = uCamPos + dir * froxelDistance((id.z + jitter) / float(size.z));
+
+  vec3 inscatter = vec3(0);
+  for(int i=0; i<32; i++) {
+    vec3 lVec = light_pos[i].xyz - pos;
+    float dist2 = dot(lVec, lVec);
+    float corr = spot(i, lVec / sqrt(dist2));
+    if (corr > 0)
+      corr *= shadowTap(i, pos);
+    inscatter += light_col[i].xyz * corr / dist2;
+  }
+
+  // Isotropic phase function in a uniform medium
+  vec4 current = vec4(inscatter * fog_density / (4 * 3.14159265), fog_density);
+
+  // Reuse what the previous frame saw at the same world position
+  vec4 prev = uPrevCamera * vec4(pos, 1);
+  vec3 prev_uvw = vec3(prev.xy / prev.w * 0.5 + 0.5, froxelSlice(length(pos - uPrevCamPos)));
+  if (prev.w > 0 && all(greaterThanEqual(prev_uvw, vec3(0))) && all(lessThanEqual(prev_uvw, vec3(1))))
+    current = mix(current, texture(history, prev_uvw), history_weight);
+
+  imageStore(scatter, id, current);
+}
 )";
 
-static const char* cone_gs_src = R"(
+static const char* froxel_integrate_cs_src = R"(
 #version 450
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
 
-#define PREC 20
+layout(binding = 0, rgba16f) uniform writeonly image3D integrated;
+layout(location = 17) uniform sampler3D scatter;
 
-layout(points) in;
-layout(triangle_strip, max_vertices=(PREC*3)) out;
+#include "froxel"
 
-layout(location=0) uniform mat4 camera;
-layout(location=1) uniform mat4 mvp;
-layout(location=2) uniform vec3 camPos;
-layout(location=3) uniform vec4 cone_data;
+void main() {
+  ivec2 id = ivec2(gl_GlobalInvocationID.xy);
+  ivec3 size = imageSize(integrated);
+  if (any(greaterThanEqual(id, size.xy))) return;
+
+  // Front to back, energy conserving per slice
+  vec3 accum = vec3(0);
+  float transmittance = 1;
+  for(int z=0; z<size.z; z++) {
+    vec4 s = texelFetch(scatter, ivec3(id, z), 0);
+    float dz = froxelDistance((z + 1) / float(size.z)) - froxelDistance(z / float(size.z));
+    float extinction = max(s.a, 1e-6);
+    float t = exp(-extinction * dz);
+    accum += transmittance * (s.rgb - s.rgb * t) / extinction;
+    transmittance *= t;
+    imageStore(integrated, ivec3(id, z), vec4(accum, transmittance));
+  }
+}
+)";
 
-struct vData {
-  float dist2;
+// One level of the depth pyramid, each texel keeps the farthest depth of
+// the 2x2 texels below it. Sizes round up so texel p of the full depth
+// is always covered by texel p >> (n + 1) of level n.
+static const char* hiz_reduce_cs_src = R"(
+#version 450
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+layout(binding = 0, r32f) uniform writeonly image2D dst;
+layout(location = 0) uniform int src_level;
+layout(location = 1) uniform sampler2D src;
+
+void main() {
+  ivec2 id = ivec2(gl_GlobalInvocationID.xy);
+  if (any(greaterThanEqual(id, imageSize(dst)))) return;
+
+  ivec2 last = textureSize(src, src_level) - 1;
+  ivec2 base = id * 2;
+  float d = 0;
+  for(int y=0; y<2; y++)
+    for(int x=0; x<2; x++)
+      d = max(d, texelFetch(src, min(base + ivec2(x, y), last), src_level).x);
+  imageStore(dst, id, vec4(d));
+}
+)";
+
+// Tests every batched draw against the frustum and the depth pyramid and
+// appends the survivors to the indirect commands. The first phase uses
+// the pyramid of the previous frame and leaves the occluded draws for the
+// second, which retests them once this frame's pyramid exists.
+static const char* cull_cs_src = R"(
+#version 450
+layout(local_size_x = 64) in;
+
+struct draw_t {
+  mat4 model;
+  vec4 sphere;
+  uint material, index_count, first_index;
+  int base_vertex;
 };
 
-out vData vertex;
+struct command_t {
+  uint count, instance_count, first_index;
+  int base_vertex;
+  uint base_instance;
+};
 
-float getAngle(int p) {
-  return (p / float(PREC)) * (2*3.14159265358979323846);
+layout(std430, binding=)" D_XSTR(D_DRAWS_BLOCK_BINDING) R"() readonly buffer Draws {
+  draw_t draws[];
+};
+layout(std430, binding=)" D_XSTR(D_COMMANDS_BLOCK_BINDING) R"() writeonly buffer Commands {
+  command_t commands[];
+};
+layout(std430, binding=)" D_XSTR(D_CULL_STATUS_BLOCK_BINDING) R"() buffer Status {
+  uint retest[];
+};
+// visible in each phase, outside the frustum, occluded
+layout(std430, binding=)" D_XSTR(D_CULL_COUNTERS_BLOCK_BINDING) R"() buffer Counters {
+  uint counters[4];
+};
+
+layout(location = 0)  uniform vec4 planes[6];
+layout(location = 6)  uniform mat4 uOcclusionCamera; // the one the pyramid was built with
+layout(location = 7)  uniform int phase;
+layout(location = 8)  uniform int count;
+layout(location = 9)  uniform int occlusion;
+layout(location = 10) uniform sampler2D hiz;
+
+bool occluded(vec4 sphere) {
+  // Screen rectangle and nearest depth of the box around the sphere
+  vec3 lo = vec3(1), hi = vec3(-1);
+  for(int c=0; c<8; c++) {
+    vec3 corner = sphere.xyz + sphere.w * vec3(c & 1, (c >> 1) & 1, c >> 2) * 2 - sphere.w;
+    vec4 clip = uOcclusionCamera * vec4(corner, 1);
+    if (clip.w <= 0) return false;
+    vec3 ndc = clip.xyz / clip.w;
+    lo = min(lo, ndc);
+    hi = max(hi, ndc);
+  }
+  lo = clamp(lo * 0.5 + 0.5, 0, 1);
+  hi = clamp(hi * 0.5 + 0.5, 0, 1);
+
+  // Pixels of the full resolution depth, level 0 is half of it
+  vec2 full = vec2(textureSize(hiz, 0) * 2);
+  ivec2 p_lo = ivec2(lo.xy * full), p_hi = ivec2(hi.xy * full);
+  int span = max(max(p_hi.x - p_lo.x, p_hi.y - p_lo.y), 1);
+  int level = clamp(int(ceil(log2(float(span)))) - 1, 0, textureQueryLevels(hiz) - 1);
+
+  // The rectangle touches at most 2x2 texels of this level
+  ivec2 last = textureSize(hiz, level) - 1;
+  ivec2 a = min(p_lo >> (level + 1), last), b = min(p_hi >> (level + 1), last);
+  float far = max(
+      max(texelFetch(hiz, a, level).x, texelFetch(hiz, ivec2(b.x, a.y), level).x),
+      max(texelFetch(hiz, ivec2(a.x, b.y), level).x, texelFetch(hiz, b, level).x));
+  return lo.z > far;
 }
 
-mat4 rotationX( in float angle ) {
-	return mat4(	1.0,		0,			0,			0,
-			 		0, 	cos(angle),	-sin(angle),		0,
-					0, 	sin(angle),	 cos(angle),		0,
-					0, 			0,			  0, 		1);
+void emit(uint i, uint region) {
+  uint slot = atomicAdd(counters[region], 1);
+  draw_t d = draws[i];
+  commands[region * count + slot] = command_t(d.index_count, 1u, d.first_index, d.base_vertex, i);
+}
+
+void main() {
+  uint i = gl_GlobalInvocationID.x;
+  if (i >= count) return;
+  vec4 sphere = draws[i].sphere;
+
+  if (phase == 1) {
+    retest[i] = 0;
+    for(int p=0; p<6; p++) {
+      if (dot(planes[p].xyz, sphere.xyz) + planes[p].w < -sphere.w) {
+        atomicAdd(counters[2], 1);
+        return;
+      }
+    }
+    if (occlusion == 1 && occluded(sphere)) retest[i] = 1;
+    else emit(i, 0);
+  } else if (retest[i] == 1) {
+    if (occluded(sphere)) atomicAdd(counters[3], 1);
+    else emit(i, 1);
+  }
 }
+)";
+
+static const char* depth_vs_src = R"(
+#version 450
+layout(location=0) in vec3 vPos;
+
+layout(location = 0) uniform mat4 uCamera;
+layout(std140, binding=)" D_XSTR(D_TRANSFORM_BLOCK_BINDING) R"() uniform Transform {
+  mat4 uMvp;
+};
+
+invariant gl_Position;
 
-mat4 rotationY( in float angle ) {
-	return mat4(	cos(angle),		0,		sin(angle),	0,
-			 				0,		1.0,			 0,	0,
-					-sin(angle),	0,		cos(angle),	0,
-							0, 		0,				0,	1);
+void main() {
+  vec4 worldPos = uMvp * vec4(vPos, 1);
+  gl_Position = uCamera * worldPos;
 }
+)";
+
+static const char* depth_instanced_vs_src = R"(
+#version 450
+layout(location=0) in vec3 vPos;
+layout(location=5) in mat4 iModel;
 
-mat4 rotationZ( in float angle ) {
-	return mat4(	cos(angle),		-sin(angle),	0,	0,
-			 		sin(angle),		cos(angle),		0,	0,
-							0,				0,		1,	0,
-							0,				0,		0,	1);
+layout(location = 0) uniform mat4 uCamera;
+
+void main() {
+  gl_Position = uCamera * iModel * vec4(vPos, 1);
 }
+)";
+
+static const char* depth_fs_src = R"(
+#version 450
+
+void main() { }
+)";
+
+// Box from min to max as one strip of 14 vertices, without a buffer
+static const char* box_vs_src = R"(
+#version 450
+
+layout(location = 0) uniform mat4 uCamera;
+layout(location = )" D_XSTR(D_BOX_UNIFORM_INDEX) R"() uniform vec3 uMin;
+layout(location = )" D_XSTR(D_BOX_UNIFORM_INDEX + 1) R"() uniform vec3 uMax;
 
 void main() {
-  mat4 t = camera * mvp;
-  vec3 origin = vec3(0, 0, 0);
-  vec4 p0 = t * vec4(origin, 1);
-  float angle = acos(cone_data.w);
-  vec3 on_circle = (rotationX(angle) * vec4(0, 0, 1, 1)).xyz; 
-  vec3 L;
+  uint b = 1u << gl_VertexID;
+  vec3 corner = vec3((0x287a & b) != 0, (0x02af & b) != 0, (0x31e3 & b) != 0);
+  gl_Position = uCamera * vec4(mix(uMin, uMax, corner), 1);
+}
+)";
 
-  for(int p=0; p<PREC; p++) {
-    float a1 = getAngle(p);
-    float a2 = getAngle(p+1);
-    vec4 p1 = t * rotationZ(a1) * vec4(on_circle, 1);
-    vec4 p2 = t * rotationZ(a2) * vec4(on_circle, 1);
-    gl_Position = p0; 
-    vertex.dist2 = 0;
-    EmitVertex();
-    gl_Position = p1;
-    L = gl_Position.xyz - p0.xyz;
-    vertex.dist2 = dot(L, L);
-    EmitVertex();
-    gl_Position = p2;
-    L = gl_Position.xyz - p0.xyz;
-    vertex.dist2 = dot(L, L);
-    EmitVertex();
-    EndPrimitive();
-  }
+static const char* cone_vs_src = R"(
+#version 450
+
+#define PREC )" D_XSTR(D_CONE_SEGMENTS) R"(
+
+layout(location=0)  in vec2 vCone;   // x rim segment, y 1 on the rim and 0 at the apex
+layout(location=5)  in mat4 iModel;
+layout(location=9)  in vec4 iColor;  // rgb light color, w segments skipped per step
+layout(location=10) in vec4 iCone;   // xyz direction, w cosine of the cone angle
+
+layout(location=0) uniform mat4 camera;
+
+struct vData {
+  float dist2;
+};
+
+out vData vertex;
+out flat vec3 light_col;
+
+void main() {
+  mat4 t = camera * iModel;
+
+  // Snapping to the lod step collapses the skipped triangles
+  float seg = floor(vCone.x / iColor.w) * iColor.w;
+  float a = (seg / float(PREC)) * (2*3.14159265358979323846);
+  float s = sqrt(max(1 - iCone.w * iCone.w, 0));
+  vec3 on_circle = vec3(s * sin(a), s * cos(a), iCone.w) * vCone.y;
+
+  vec4 p0 = t * vec4(0, 0, 0, 1);
+  gl_Position = t * vec4(on_circle, 1);
+  vec3 L = gl_Position.xyz - p0.xyz;
+  vertex.dist2 = dot(L, L);
+  light_col = iColor.rgb;
 }
 )";
 
@@ -304,7 +780,9 @@ layout(points) in;
 layout(triangle_strip, max_vertices=6) out;
 
 layout(location = 0) uniform mat4 camera;
-layout(location = 1) uniform mat4 mvp;
+layout(std140, binding=)" D_XSTR(D_TRANSFORM_BLOCK_BINDING) R"() uniform Transform {
+  mat4 mvp;
+};
 
 struct vData {
   vec3 normal;
@@ -397,6 +875,239 @@ void main() {
 }
 )";
 
+// Draws the baked heightfield, feeds plane_fs_src the same data the
+// geometry shader does
+static const char* terrain_vs_src = R"(
+#version 450
+
+layout(location = 0) in vec3 vPos;
+layout(location = 1) in vec3 vNormal;
+layout(location = 2) in float vHeight;
+
+layout(location = 0) uniform mat4 camera;
+layout(std140, binding=)" D_XSTR(D_TRANSFORM_BLOCK_BINDING) R"() uniform Transform {
+  mat4 mvp;
+};
+
+struct vData {
+  vec3 normal;
+  vec3 pos;
+  float h;
+};
+
+out vData vertex;
+
+void main() {
+  vertex.pos = vPos;
+  vertex.h = vHeight;
+  vertex.normal = normalize((mvp * vec4(vNormal, 0)).xyz);
+  gl_Position = camera * mvp * vec4(vPos, 1);
+}
+)";
+
+// One chunk of the streamed terrain. Odd grid vertices slide onto their
+// even neighbours as the distance approaches the end of this lod's
+// range, so they meet the next coarser chunk without cracks.
+static const char* terrain_chunk_vs_src =
+"#version 450\n"
+"const float GRID = " D_XSTR(D_TERRAIN_GRID) ";\n"
+R"(
+layout(location = 0) in vec2 vGrid;
+
+layout(location = 0)  uniform mat4 camera;
+layout(location = 2)  uniform vec3 camera_pos;
+layout(location = 9)  uniform vec4 node;       // origin xz, size, layer
+layout(location = 10) uniform vec2 morph;      // start and end distance
+layout(location = 11) uniform vec2 height_map; // world y = h * x + y
+layout(location = 12) uniform sampler2DArray heights;
+
+struct vData {
+  vec3 normal;
+  vec3 pos;
+  float h;
+};
+
+out vData vertex;
+
+void main() {
+  float spacing = node.z / GRID;
+  vec2 g = vGrid;
+  float h = texelFetch(heights, ivec3(g + 1, node.w), 0).x;
+  vec2 xz = node.xy + g * spacing;
+  float d = distance(camera_pos, vec3(xz.x, h * height_map.x + height_map.y, xz.y));
+  float k = clamp((d - morph.x) / (morph.y - morph.x), 0, 1);
+  g -= fract(g * 0.5) * 2 * k;
+
+  // The heightfield has a one sample border for the normals
+  vec2 texel = 1 / vec2(GRID + 3);
+  vec3 at = vec3((g + 1.5) * texel, node.w);
+  h = texture(heights, at).x;
+  float dx = texture(heights, at + vec3(texel.x, 0, 0)).x - texture(heights, at - vec3(texel.x, 0, 0)).x;
+  float dz = texture(heights, at + vec3(0, texel.y, 0)).x - texture(heights, at - vec3(0, texel.y, 0)).x;
+  float slope = height_map.x / (2 * spacing);
+
+  xz = node.xy + g * spacing;
+  vertex.pos = vec3(xz.x, h * height_map.x + height_map.y, xz.y);
+  vertex.h = h;
+  vertex.normal = normalize(vec3(-dx * slope, 1, -dz * slope));
+  gl_Position = camera * vec4(vertex.pos, 1);
+}
+)";
+
+// Tessellated terrain, the control points are patch corners: world x,
+// world z and how rough the terrain around the corner is
+static const char* terrain_tess_vs_src = R"(
+#version 450
+
+layout(location = 0) in vec3 vCorner;
+out vec3 tcCorner;
+
+void main() {
+  tcCorner = vCorner;
+}
+)";
+
+// Shared by the control and evaluation stages
+static const char* terrain_tess_glsl = R"(
+layout(location = 0)  uniform mat4 camera;
+layout(location = 11) uniform vec2 height_map; // world y = h * x + y
+layout(location = 12) uniform sampler2D heights;
+layout(location = 14) uniform vec4 extent;     // origin xz, side, samples per side
+
+vec2 heightUv(vec2 xz) {
+  return ((xz - extent.xy) / extent.z * (extent.w - 1) + 0.5) / extent.w;
+}
+
+float heightAt(vec2 xz) {
+  return textureLod(heights, heightUv(xz), 0).x;
+}
+)";
+
+static const char* terrain_tcs_src =
+"#version 450\n"
+"layout(vertices = 4) out;\n"
+"#include \"terrain_tess\"\n"
+R"(
+layout(location = 13) uniform vec2 tessellation; // pixels per unit at distance 1, pixels per segment
+
+in vec3 tcCorner[];
+out vec2 teCorner[];
+
+// Segments for an edge from its projected length, rough ground gets up
+// to four times as many as flat ground
+float edgeFactor(vec3 a, vec3 b, float rough) {
+  vec4 mid = camera * vec4((a + b) / 2, 1);
+  float px = distance(a, b) * tessellation.x / max(mid.w, 0.1);
+  return clamp(px / tessellation.y * mix(0.25, 1.0, rough), 1, 64);
+}
+
+bool outside(vec2 lo, vec2 hi) {
+  vec4 c[8];
+  for(int i=0; i<8; i++) {
+    vec3 p = vec3((i & 1) != 0 ? hi.x : lo.x,
+        (i & 2) != 0 ? height_map.x + height_map.y : height_map.y,
+        (i & 4) != 0 ? hi.y : lo.y);
+    c[i] = camera * vec4(p, 1);
+  }
+  for(int axis=0; axis<3; axis++) {
+    bool below = true, above = true;
+    for(int i=0; i<8; i++) {
+      below = below && c[i][axis] < -c[i].w;
+      above = above && c[i][axis] > c[i].w;
+    }
+    if (below || above) return true;
+  }
+  return false;
+}
+
+void main() {
+  teCorner[gl_InvocationID] = tcCorner[gl_InvocationID].xy;
+  if (gl_InvocationID != 0) return;
+
+  if (outside(tcCorner[0].xy, tcCorner[2].xy)) {
+    gl_TessLevelOuter[0] = gl_TessLevelOuter[1] = 0;
+    gl_TessLevelOuter[2] = gl_TessLevelOuter[3] = 0;
+    return;
+  }
+
+  vec3 p[4];
+  float r[4];
+  for(int i=0; i<4; i++) {
+    vec2 xz = tcCorner[i].xy;
+    p[i] = vec3(xz.x, heightAt(xz) * height_map.x + height_map.y, xz.y);
+    r[i] = tcCorner[i].z;
+  }
+
+  // Outer levels are the u=0, v=0, u=1 and v=1 edges
+  gl_TessLevelOuter[0] = edgeFactor(p[3], p[0], max(r[3], r[0]));
+  gl_TessLevelOuter[1] = edgeFactor(p[0], p[1], max(r[0], r[1]));
+  gl_TessLevelOuter[2] = edgeFactor(p[1], p[2], max(r[1], r[2]));
+  gl_TessLevelOuter[3] = edgeFactor(p[2], p[3], max(r[2], r[3]));
+  gl_TessLevelInner[0] = max(gl_TessLevelOuter[1], gl_TessLevelOuter[3]);
+  gl_TessLevelInner[1] = max(gl_TessLevelOuter[0], gl_TessLevelOuter[2]);
+}
+)";
+
+static const char* terrain_tes_src =
+"#version 450\n"
+"layout(quads, fractional_odd_spacing, ccw) in;\n"
+"#include \"terrain_tess\"\n"
+R"(
+in vec2 teCorner[];
+
+struct vData {
+  vec3 normal;
+  vec3 pos;
+  float h;
+};
+
+out vData vertex;
+
+void main() {
+  vec2 t = gl_TessCoord.xy;
+  vec2 xz = mix(mix(teCorner[0], teCorner[1], t.x), mix(teCorner[3], teCorner[2], t.x), t.y);
+  vec2 uv = heightUv(xz);
+  vec2 texel = 1 / vec2(extent.w);
+  float h = textureLod(heights, uv, 0).x;
+  float dx = textureLod(heights, uv + vec2(texel.x, 0), 0).x - textureLod(heights, uv - vec2(texel.x, 0), 0).x;
+  float dz = textureLod(heights, uv + vec2(0, texel.y), 0).x - textureLod(heights, uv - vec2(0, texel.y), 0).x;
+  float slope = height_map.x / (2 * extent.z / (extent.w - 1));
+
+  vertex.pos = vec3(xz.x, h * height_map.x + height_map.y, xz.y);
+  vertex.h = h;
+  vertex.normal = normalize(vec3(-dx * slope, 1, -dz * slope));
+  gl_Position = camera * vec4(vertex.pos, 1);
+}
+)";
+
+// Replays the triangles plane_gs_src emitted when they were baked, the
+// position was captured in world space
+static const char* plane_baked_vs_src = R"(
+#version 450
+
+layout(location = 0) in vec4 vPosition;
+layout(location = 1) in vec3 vNormal;
+layout(location = 2) in vec3 vPos;
+layout(location = 3) in float vHeight;
+
+layout(location = 0) uniform mat4 camera;
+
+struct vData {
+  vec3 normal;
+  vec3 pos;
+  float h;
+};
+
+out vData vertex;
+
+void main() {
+  vertex.normal = vNormal;
+  vertex.pos = vPos;
+  vertex.h = vHeight;
+  gl_Position = camera * vPosition;
+}
+)";
+
 static const char* plane_fs_src = R"(
 #version 450
 
@@ -433,8 +1144,7 @@ void main() {
 static const char* cone_fs_src = R"(
 #version 450
 
-layout(location = 17) uniform sampler2D depthBuf;
-layout(location = 4)  uniform vec3 light_col;
+layout(location = 19) uniform sampler2D depthRange;
 layout(location = 0)  out vec3 color;
 
 struct vData {
@@ -442,46 +1152,196 @@ struct vData {
 };
 
 in vData vertex;
+in flat vec3 light_col;
 
 void main() {
-  vec2 uv = vec2(gl_FragCoord.x/640.0f, gl_FragCoord.y/480.0f); 
-  float old_depth = texture(depthBuf, uv).r;
-  float new_depth = gl_FragCoord.z;
-  if (old_depth > new_depth)
-    color = light_col / (pow(vertex.dist2, 0.45) * 300);
-  else
-    color = vec3(0);
+  // Part of the full resolution pixels below this one the cone is in front of
+  vec2 range = texelFetch(depthRange, ivec2(gl_FragCoord.xy), 0).xy;
+  float cover = clamp((range.y - gl_FragCoord.z) / max(range.y - range.x, 1e-6), 0, 1);
+  color = cover * light_col / (pow(vertex.dist2, 0.45) * 300);
 }
 )";
 
+// Splices the shared snippets in at their #include lines
+static std::string expand(const char* src) {
+  static const char* names[] = { "#include \"lighting\"", "#include \"froxel\"", "#include \"terrain_tess\"" };
+  const char* snippets[] = { lighting_glsl, froxel_glsl, terrain_tess_glsl };
+  std::string s = src;
+  for(int i=0; i<3; i++) {
+    size_t at = s.find(names[i]);
+    if (at != std::string::npos) s.replace(at, strlen(names[i]), snippets[i]);
+  }
+  return s;
+}
+
+// Every program linked here, deleted at shutdown
+Resources::Pool<Resources::Object> programs;
+
+// Takes ownership of a linked program. Its shaders are only flagged for
+// deletion, they go away with it.
+static inline GLuint track(GLuint program) {
+  GLuint shaders[8];
+  GLsizei count = 0;
+  glGetAttachedShaders(program, 8, &count, shaders);
+  for(int i=0; i<count; i++) glDeleteShader(shaders[i]);
+  programs.create(Resources::Object(Resources::KIND_PROGRAM, program), "program " + std::to_string(program));
+  return program;
+}
+
+static inline GLuint loadComputeLiteral(const char* cs) {
+    return track(GenerateProgram(CompileShader(GL_COMPUTE_SHADER, expand(cs).c_str())));
+}
+
 static inline GLuint loadShaderLiteral(const char* vs, const char* fs) {
-    return GenerateProgram(
+    return track(GenerateProgram(
         CompileShader(GL_VERTEX_SHADER, vs),
-        CompileShader(GL_FRAGMENT_SHADER, fs));
+        CompileShader(GL_FRAGMENT_SHADER, fs)));
+}
+
+static inline GLuint loadShaderLiteral(const char* vs, const char* tcs, const char* tes, const char* fs) {
+    return track(GenerateProgram(
+        CompileShader(GL_VERTEX_SHADER, vs),
+        CompileShader(GL_TESS_CONTROL_SHADER, expand(tcs).c_str()),
+        CompileShader(GL_TESS_EVALUATION_SHADER, expand(tes).c_str()),
+        CompileShader(GL_FRAGMENT_SHADER, fs)));
 }
 
 static inline GLuint loadShaderLiteral(const char* vs, const char* gs, const char* fs) {
-    return GenerateProgram(
+    return track(GenerateProgram(
         CompileShader(GL_VERTEX_SHADER, vs),
         CompileShader(GL_GEOMETRY_SHADER, gs),
-        CompileShader(GL_FRAGMENT_SHADER, fs));
+        CompileShader(GL_FRAGMENT_SHADER, fs)));
 }
 
-static GLuint lights_buffer;
+// Per draw transforms and the lights, rewritten every frame
+static RingBuffer frame_ring;
+
+// Model matrix of the next draw, for the shaders with a Transform block
+void setTransform(const Matrix4 &mvp) {
+  mat4x4 m;
+  mvp.unpack(m);
+  GLintptr at = frame_ring.push(m);
+  glBindBufferRange(GL_UNIFORM_BUFFER, D_TRANSFORM_BLOCK_BINDING, frame_ring.buffer, at, sizeof(mat4x4));
+}
+static Resources::Object cone_instances_buffer;
 
 struct lights_t {
   Vector4 pos[32];
   Vector4 col[32];
   Vector4 dir[32]; // xyz for direction, w for cone size (0 normal light)
+
+  // Distance at which the light's 1/d^2 falloff drops below one unit
+  float reach(int i) const { return sqrt(col[i].xyz().length()); }
+};
+
+// Per light data the cone pass reads with a divisor of one
+struct cone_instance_t {
+  mat4x4 model;
+  Vector4 color; // rgb light color, w lod step
+  Vector4 cone;  // xyz direction, w cosine of the cone angle
+};
+
+// Largest step through the rim that still keeps each of the remaining
+// segments under 16 pixels, for a cone whose rim spans radius_px
+static float coneLodStep(float radius_px) {
+  static const int steps[] = { 10, 5, 4, 2 };
+  for(int s : steps)
+    if (2 * PI * radius_px * s / D_CONE_SEGMENTS <= 16) return s;
+  return 1;
+}
+
+struct varying_t {
+  const char* name;
+  int components; // floats
 };
 
+// Runs a program with a geometry shader once, captures the triangles it
+// emits with transform feedback and draws those from then on through a
+// pass through vertex shader. The camera uniform is the identity while
+// capturing so gl_Position, which has to be the first varying, stays in
+// world space and the replay applies the real camera. Call capture()
+// again whenever the inputs change.
+struct bake_t {
+  GLuint program_id;
+  Resources::Object buffer, vao;
+  GLuint primitives;
+  int stride;
+  bool valid;
+
+  void init(const char* vs, const char* gs, const std::vector<varying_t> &varyings) {
+    std::vector<const char*> names;
+    for(const varying_t &v : varyings) names.push_back(v.name);
+    program_id = track(GenerateFeedbackProgram(
+        CompileShader(GL_VERTEX_SHADER, vs),
+        CompileShader(GL_GEOMETRY_SHADER, gs),
+        names.data(), names.size()));
+
+    // Varying i is attribute i of the replay
+    stride = 0;
+    for(const varying_t &v : varyings) stride += v.components * sizeof(float);
+    buffer = Resources::createBuffer();
+    vao = Resources::createVertexArray();
+    glVertexArrayVertexBuffer(vao, 0, buffer, 0, stride);
+    int offset = 0;
+    for(int i=0; i<(int)varyings.size(); i++) {
+      glEnableVertexArrayAttrib(vao, i);
+      glVertexArrayAttribFormat(vao, i, varyings[i].components, GL_FLOAT, GL_FALSE, offset);
+      glVertexArrayAttribBinding(vao, i, 0);
+      offset += varyings[i].components * sizeof(float);
+    }
+    primitives = 0;
+    valid = false;
+  }
+
+  // draw sets the uniforms and issues the draw call, the program is bound
+  template <typename F>
+  void capture(F draw) {
+    GLState::useProgram(program_id);
+    mat4x4 identity;
+    Matrix4::Identity().unpack(identity);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)identity);
+    GLState::enable(GL_RASTERIZER_DISCARD);
+
+    // Once to size the buffer, once to fill it
+    GLuint query, generated;
+    glGenQueries(1, &query);
+    glBeginQuery(GL_PRIMITIVES_GENERATED, query);
+    draw();
+    glEndQuery(GL_PRIMITIVES_GENERATED);
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &generated);
+
+    // Resized on every capture, so the store stays mutable
+    glNamedBufferData(buffer, generated * 3 * stride, NULL, GL_STATIC_DRAW);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffer);
+
+    glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, query);
+    glBeginTransformFeedback(GL_TRIANGLES);
+    draw();
+    glEndTransformFeedback();
+    glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+    glGetQueryObjectuiv(query, GL_QUERY_RESULT, &primitives);
+
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDeleteQueries(1, &query);
+    GLState::disable(GL_RASTERIZER_DISCARD);
+    valid = true;
+    logInfo("Baked %u primitives (%i KB)", primitives, (int)(generated * 3 * stride / 1024));
+  }
+
+  void draw() const {
+    GLState::bindVertexArray(vao);
+    glDrawArrays(GL_TRIANGLES, 0, primitives * 3);
+  }
+};
+
+bake_t plane_bake;
+
 struct sh_quad_t {
   // Simple shader that renders a single texture to a quad
   GLuint program_id;
   void use(const Texture &tex) const  {
-    glUseProgram(program_id);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tex);
+    GLState::useProgram(program_id);
+    GLState::bindTexture(0, tex);
   }
 } sh_quad;
 
@@ -493,20 +1353,91 @@ struct sh_main_t {
     camera.unpack(m_camera);
     glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
   }
-  void setMvp(const Matrix4 &mvp) const {
-    mat4x4 m_mvp;
-    mvp.unpack(m_mvp);
-    glUniformMatrix4fv(D_MVP_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_mvp);
-  }
+  void setMvp(const Matrix4 &mvp) const { setTransform(mvp); }
   void setTextureScale(float s) const {
     glUniform1f(D_TEXTURE_SCALE_UNIFORM_INDEX, s);
   }
   void use(const Matrix4 &camera) const {
-    glUseProgram(program_id);
+    GLState::useProgram(program_id);
     setCamera(camera);
   }
 } sh_main;
 
+struct sh_batch_t {
+  // Main shader for the multi draw indirect path
+  GLuint program_id;
+  void use(const Matrix4 &camera, const Texture &albedo) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    GLState::useProgram(program_id);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+    GLState::bindTexture(0, albedo);
+  }
+} sh_batch;
+
+struct sh_instanced_t {
+  // Main shader for Meshes::drawInstanced
+  GLuint program_id;
+  void use(const Matrix4 &camera, const Texture &albedo, float texture_scale) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    GLState::useProgram(program_id);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+    glUniform1f(D_TEXTURE_SCALE_UNIFORM_INDEX, texture_scale);
+    GLState::bindTexture(0, albedo);
+  }
+} sh_instanced;
+
+struct sh_depth_range_t {
+  // Reduces the g buffer depth to the cone buffer resolution
+  GLuint program_id;
+  void use(const Texture &depth) const {
+    GLState::useProgram(program_id);
+    GLState::bindTexture(0, depth);
+  }
+} sh_depth_range;
+
+struct sh_depth_t {
+  // Position only shader for passes that just need the depth buffer
+  GLuint program_id;
+  void setCamera(const Matrix4 &camera) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+  }
+  void setMvp(const Matrix4 &mvp) const { setTransform(mvp); }
+  void use(const Matrix4 &camera) const {
+    GLState::useProgram(program_id);
+    setCamera(camera);
+  }
+} sh_depth;
+
+struct sh_box_t {
+  // Bounding boxes for occlusion queries, drawn with no vertex buffer
+  GLuint program_id;
+  void setBox(const AABB &box) const {
+    glUniform3f(D_BOX_UNIFORM_INDEX, box.min.x, box.min.y, box.min.z);
+    glUniform3f(D_BOX_UNIFORM_INDEX + 1, box.max.x, box.max.y, box.max.z);
+  }
+  void use(const Matrix4 &camera) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    GLState::useProgram(program_id);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+  }
+} sh_box;
+
+struct sh_depth_instanced_t {
+  // Depth only, for Meshes::drawInstanced
+  GLuint program_id;
+  void use(const Matrix4 &camera) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    GLState::useProgram(program_id);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+  }
+} sh_depth_instanced;
+
 struct sh_cone_t {
   GLuint program_id;
   void setCamera(const Matrix4 &camera, const Vector3 &cam_pos) const {
@@ -515,20 +1446,30 @@ struct sh_cone_t {
     glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
     glUniform3f(D_CAMERAPOS_UNIFORM_INDEX, cam_pos.x, cam_pos.y, cam_pos.z);
   }
-  void setMvp(const Matrix4 &mvp) const {
-    mat4x4 m_mvp;
-    mvp.unpack(m_mvp);
-    glUniformMatrix4fv(D_MVP_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_mvp);
+  void setInstances(const cone_instance_t* instances, int count) const {
+    glNamedBufferSubData(cone_instances_buffer, 0, count * sizeof(cone_instance_t), instances);
   }
-  void setCone(const Vector4 &dir, const Vector4 &color) {
-    glUniform4f(3, dir.x, dir.y, dir.z, dir.w);
-    glUniform3f(4, color.x, color.y, color.z);
+  void attach(const Meshes::Mesh* cone) const {
+    // Sources the instance attributes of the cone mesh from our buffer
+    const GLuint binding = D_INSTANCE_MODEL_INDEX;
+    for(int c=0; c<4; c++) {
+      glEnableVertexArrayAttrib(cone->vao, D_INSTANCE_MODEL_INDEX + c);
+      glVertexArrayAttribFormat(cone->vao, D_INSTANCE_MODEL_INDEX + c, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 4 * c);
+      glVertexArrayAttribBinding(cone->vao, D_INSTANCE_MODEL_INDEX + c, binding);
+    }
+    glEnableVertexArrayAttrib(cone->vao, D_INSTANCE_COLOR_INDEX);
+    glVertexArrayAttribFormat(cone->vao, D_INSTANCE_COLOR_INDEX, 4, GL_FLOAT, GL_FALSE, offsetof(cone_instance_t, color));
+    glVertexArrayAttribBinding(cone->vao, D_INSTANCE_COLOR_INDEX, binding);
+    glEnableVertexArrayAttrib(cone->vao, D_INSTANCE_CONE_INDEX);
+    glVertexArrayAttribFormat(cone->vao, D_INSTANCE_CONE_INDEX, 4, GL_FLOAT, GL_FALSE, offsetof(cone_instance_t, cone));
+    glVertexArrayAttribBinding(cone->vao, D_INSTANCE_CONE_INDEX, binding);
+    glVertexArrayBindingDivisor(cone->vao, binding, 1);
+    glVertexArrayVertexBuffer(cone->vao, binding, cone_instances_buffer, 0, sizeof(cone_instance_t));
   }
-  void use(const Matrix4 &camera, const Vector3 &cam_pos, const Texture &depth) const {
-    glUseProgram(program_id);
+  void use(const Matrix4 &camera, const Vector3 &cam_pos, const Texture &depth_range) const {
+    GLState::useProgram(program_id);
     setCamera(camera, cam_pos);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, depth);
+    GLState::bindTexture(0, depth_range);
   }
 } sh_cone;
 
@@ -540,11 +1481,7 @@ struct sh_plane_t {
     glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
     glUniform3f(D_CAMERAPOS_UNIFORM_INDEX, cam_pos.x, cam_pos.y, cam_pos.z);
   }
-  void setMvp(const Matrix4 &mvp) const {
-    mat4x4 m_mvp;
-    mvp.unpack(m_mvp);
-    glUniformMatrix4fv(D_MVP_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_mvp);
-  }
+  void setMvp(const Matrix4 &mvp) const { setTransform(mvp); }
   void setTextureScale(float s) const {
     glUniform1f(D_TEXTURE_SCALE_UNIFORM_INDEX, s);
   }
@@ -553,40 +1490,107 @@ struct sh_plane_t {
       const Texture &water,
       const Texture &grass,
       const Texture &stone) const {
-    glUseProgram(program_id);
+    GLState::useProgram(program_id);
+    setCamera(camera, cam_pos);
+    GLState::bindTexture(0, water);
+    GLState::bindTexture(1, grass);
+    GLState::bindTexture(2, stone);
+  }
+} sh_plane, sh_terrain, sh_plane_baked;
+
+struct sh_terrain_chunk_t {
+  // Streamed terrain, shares plane_fs_src with the other terrain modes
+  GLuint program_id;
+  void setCamera(const Matrix4 &camera, const Vector3 &cam_pos) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+    glUniform3f(D_CAMERAPOS_UNIFORM_INDEX, cam_pos.x, cam_pos.y, cam_pos.z);
+  }
+  void setTextureScale(float s) const {
+    glUniform1f(D_TEXTURE_SCALE_UNIFORM_INDEX, s);
+  }
+  void setNode(float x, float z, float size, int layer) const {
+    glUniform4f(D_NODE_UNIFORM_INDEX, x, z, size, layer);
+  }
+  void setMorph(float start, float end) const {
+    glUniform2f(D_MORPH_UNIFORM_INDEX, start, end);
+  }
+  void setHeightMap(float scale, float bias) const {
+    glUniform2f(D_HEIGHT_MAP_UNIFORM_INDEX, scale, bias);
+  }
+  void use(const Matrix4 &camera,
+      const Vector3 &cam_pos,
+      const Texture &water,
+      const Texture &grass,
+      const Texture &stone,
+      const Texture &heights) const {
+    GLState::useProgram(program_id);
+    setCamera(camera, cam_pos);
+    GLState::bindTexture(0, water);
+    GLState::bindTexture(1, grass);
+    GLState::bindTexture(2, stone);
+    GLState::bindTexture(3, heights);
+  }
+} sh_terrain_chunk;
+
+struct sh_terrain_tess_t {
+  // Tessellated terrain, also drawn with plane_fs_src
+  GLuint program_id;
+  void setCamera(const Matrix4 &camera, const Vector3 &cam_pos) const {
+    mat4x4 m_camera;
+    camera.unpack(m_camera);
+    glUniformMatrix4fv(D_CAMERA_UNIFORM_INDEX, 1, GL_FALSE, (const GLfloat*)m_camera);
+    glUniform3f(D_CAMERAPOS_UNIFORM_INDEX, cam_pos.x, cam_pos.y, cam_pos.z);
+  }
+  void setTextureScale(float s) const {
+    glUniform1f(D_TEXTURE_SCALE_UNIFORM_INDEX, s);
+  }
+  // Pixels one unit covers at distance one, and the length in pixels
+  // the tessellator aims for per segment
+  void setTessellation(float px_scale, float px_per_segment) const {
+    glUniform2f(D_TESSELLATION_UNIFORM_INDEX, px_scale, px_per_segment);
+  }
+  void setExtent(float origin, float side, int samples) const {
+    glUniform4f(D_EXTENT_UNIFORM_INDEX, origin, origin, side, samples);
+  }
+  void setHeightMap(float scale, float bias) const {
+    glUniform2f(D_HEIGHT_MAP_UNIFORM_INDEX, scale, bias);
+  }
+  void use(const Matrix4 &camera,
+      const Vector3 &cam_pos,
+      const Texture &water,
+      const Texture &grass,
+      const Texture &stone,
+      const Texture &heights) const {
+    GLState::useProgram(program_id);
     setCamera(camera, cam_pos);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, water);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, grass);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, stone);
-    glActiveTexture(GL_TEXTURE0);
+    GLState::bindTexture(0, water);
+    GLState::bindTexture(1, grass);
+    GLState::bindTexture(2, stone);
+    GLState::bindTexture(3, heights);
   }
-} sh_plane;
+} sh_terrain_tess;
 
 struct sh_combinator_t {
   // Combination shader that combines to the g buffers to a quad
   GLuint program_id;
-  void use(const lights_t &lights,
-      const Matrix4 &camera,
+  void use(const Matrix4 &camera,
       const Vector3 &cam_pos,
       Texture g_norm,
       Texture g_mat,
-      Texture g_depth) const
+      Texture g_depth,
+      Texture shadow_atlas,
+      Texture fog) const
   {
-    glUseProgram(program_id);
-    // Update te light suite
-    glBindBuffer(GL_UNIFORM_BUFFER, lights_buffer);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(lights), &lights);
+    GLState::useProgram(program_id);
 
     // Populate g buffer slots
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, g_norm);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, g_mat);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, g_depth);
+    GLState::bindTexture(0, g_norm);
+    GLState::bindTexture(1, g_mat);
+    GLState::bindTexture(2, g_depth);
+    GLState::bindTexture(3, shadow_atlas);
+    GLState::bindTexture(4, fog);
 
     // Populate camera transformation for restoring the fragment position from depth buffer
     mat4x4 m_camera;
@@ -598,18 +1602,100 @@ struct sh_combinator_t {
   }
 } sh_combinator;
 
-struct sh_post_t {
+struct sh_froxel_inject_t {
+  // Lights every froxel and blends it with the reprojected history
+  GLuint program_id;
+  void use(const Matrix4 &camera,
+      const Vector3 &cam_pos,
+      const Matrix4 &prev_camera,
+      const Vector3 &prev_cam_pos,
+      float jitter,
+      float history_weight,
+      Texture history,
+      Texture shadow_atlas) const {
+    GLState::useProgram(program_id);
+    mat4x4 m;
+    camera.inverted().unpack(m);
+    glUniformMatrix4fv(0, 1, GL_FALSE, (const GLfloat*)m);
+    prev_camera.unpack(m);
+    glUniformMatrix4fv(1, 1, GL_FALSE, (const GLfloat*)m);
+    glUniform3f(2, cam_pos.x, cam_pos.y, cam_pos.z);
+    glUniform3f(3, prev_cam_pos.x, prev_cam_pos.y, prev_cam_pos.z);
+    glUniform1f(4, jitter);
+    glUniform1f(5, history_weight);
+    GLState::bindTexture(0, history);
+    GLState::bindTexture(3, shadow_atlas);
+  }
+} sh_froxel_inject;
+
+struct sh_froxel_integrate_t {
+  // Accumulates the froxels front to back along every view ray
+  GLuint program_id;
+  void use(Texture scatter) const {
+    GLState::useProgram(program_id);
+    GLState::bindTexture(0, scatter);
+  }
+} sh_froxel_integrate;
+
+struct sh_hiz_reduce_t {
+  // Builds one level of the depth pyramid from the one below
+  GLuint program_id;
+  void use(Texture src, int src_level) const {
+    GLState::useProgram(program_id);
+    glUniform1i(0, src_level);
+    GLState::bindTexture(0, src);
+  }
+} sh_hiz_reduce;
+
+struct sh_cull_t {
+  // Frustum and occlusion test of the batched draws
+  GLuint program_id;
+  void use(const Frustum &frustum, const Matrix4 &occlusion_camera, int phase, int count, bool occlusion, Texture hiz) const {
+    GLState::useProgram(program_id);
+    for(int p=0; p<6; p++) {
+      const Plane &plane = frustum.planes[p];
+      glUniform4f(p, plane.normal.x, plane.normal.y, plane.normal.z, -Vector3::dot(plane.normal, plane.pos));
+    }
+    mat4x4 m;
+    occlusion_camera.unpack(m);
+    glUniformMatrix4fv(6, 1, GL_FALSE, (const GLfloat*)m);
+    glUniform1i(7, phase);
+    glUniform1i(8, count);
+    glUniform1i(9, occlusion);
+    GLState::bindTexture(0, hiz);
+  }
+} sh_cull;
+
+void uploadLights(const lights_t &lights) {
+  GLintptr at = frame_ring.push(lights);
+  glBindBufferRange(GL_UNIFORM_BUFFER, D_LIGHTS_BLOCK_BINDING, frame_ring.buffer, at, sizeof(lights));
+}
+
+struct sh_bloom_prefilter_t {
+  GLuint program_id;
+  void use(const Texture &scene, const Texture &cones, float threshold) const {
+    GLState::useProgram(program_id);
+    glUniform1f(D_THRESHOLD_UNIFORM_INDEX, threshold);
+    GLState::bindTexture(0, scene);
+    GLState::bindTexture(1, cones);
+  }
+} sh_bloom_prefilter;
+
+struct sh_bloom_down_t {
+  GLuint program_id;
+  void use(const Texture &src) const {
+    GLState::useProgram(program_id);
+    GLState::bindTexture(0, src);
+  }
+} sh_bloom_down;
+
+struct sh_bloom_up_t {
   GLuint program_id;
-  void use(const Texture &scene, const Texture &cones, float time) const {
-    glUseProgram(program_id);
-    glUniform1f(D_TIME_UNIFORM_INDEX, time);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, scene);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, cones);
-    glActiveTexture(GL_TEXTURE0);
+  void use(const Texture &src) const {
+    GLState::useProgram(program_id);
+    GLState::bindTexture(0, src);
   }
-} sh_post;
+} sh_bloom_up;
 
 void init() {
   printf("Shaders are being initalized\n");
@@ -619,57 +1705,159 @@ void init() {
   // MAIN SHADER
   logInfo("Compiling main shader");
   sh_main.program_id = loadShaderLiteral(vs_src, fs_src);
-  glUseProgram(sh_main.program_id);
+  GLState::useProgram(sh_main.program_id);
   glUniform1i(D_TEXTURE_MATERIAL_INDEX, 0);
   glUniform1i(D_TEXTURE_NORMALMAP_INDEX, 1);
   sh_main.setTextureScale(1);
   logInfo("Main shader compiled succesfully");
 
+  // BATCH SHADER
+  logInfo("Compiling batch shader");
+  sh_batch.program_id = loadShaderLiteral(batch_vs_src, batch_fs_src);
+  GLState::useProgram(sh_batch.program_id);
+  glUniform1i(D_TEXTURE_MATERIAL_INDEX, 0);
+  logInfo("Batch shader compiled succesfully");
+
+  // INSTANCED SHADER
+  logInfo("Compiling instanced shader");
+  sh_instanced.program_id = loadShaderLiteral(instanced_vs_src, instanced_fs_src);
+  GLState::useProgram(sh_instanced.program_id);
+  glUniform1i(D_TEXTURE_MATERIAL_INDEX, 0);
+  logInfo("Instanced shader compiled succesfully");
+
+  // DEPTH RANGE SHADER
+  logInfo("Compiling depth range shader");
+  sh_depth_range.program_id = loadShaderLiteral(quad_vs_src, depth_range_fs_src);
+  GLState::useProgram(sh_depth_range.program_id);
+  glUniform1i(D_DEPTH_GTEXTURE_INDEX, 0);
+  glUniform1i(D_SCALE_UNIFORM_INDEX, D_CONE_SCALE);
+  logInfo("Depth range shader compiled succesfully");
+
+  // DEPTH SHADER
+  logInfo("Compiling depth shader");
+  sh_depth.program_id = loadShaderLiteral(depth_vs_src, depth_fs_src);
+  sh_depth_instanced.program_id = loadShaderLiteral(depth_instanced_vs_src, depth_fs_src);
+  sh_box.program_id = loadShaderLiteral(box_vs_src, depth_fs_src);
+  logInfo("Depth shader compiled succesfully");
+
   // CONE SHADER
   logInfo("Compiling cone shader");
-  sh_cone.program_id = loadShaderLiteral(empty_vs_src, cone_gs_src, cone_fs_src);
-  glUseProgram(sh_cone.program_id);
-  glUniform1i(D_DEPTH_GTEXTURE_INDEX, 0);
+  sh_cone.program_id = loadShaderLiteral(cone_vs_src, cone_fs_src);
+  GLState::useProgram(sh_cone.program_id);
+  glUniform1i(D_CONE_DEPTH_GTEXTURE_INDEX, 0);
+  cone_instances_buffer = Resources::createBuffer();
+  glNamedBufferStorage(cone_instances_buffer, D_MAX_CONES * sizeof(cone_instance_t), NULL, GL_DYNAMIC_STORAGE_BIT);
   logInfo("Compiling cone shader completed (id: %i)", sh_cone.program_id);
 
   // PLANE SHADER
   logInfo("Compiling plane shader");
   sh_plane.program_id = loadShaderLiteral(plane_vs_src, plane_gs_src, plane_fs_src);
-  glUseProgram(sh_plane.program_id);
+  GLState::useProgram(sh_plane.program_id);
   glUniform1i(D_TEXTURE_MATERIAL_INDEX,  0);
   glUniform1i(D_TEXTURE_MATERIAL2_INDEX, 1);
   glUniform1i(D_TEXTURE_MATERIAL3_INDEX, 2);
   logInfo("Compiling plane shader completed (id: %i)", sh_plane.program_id);
 
+  // Replay of the plane geometry shader
+  plane_bake.init(plane_vs_src, plane_gs_src, {
+      { "gl_Position", 4 }, { "vertex.normal", 3 }, { "vertex.pos", 3 }, { "vertex.h", 1 } });
+  sh_plane_baked.program_id = loadShaderLiteral(plane_baked_vs_src, plane_fs_src);
+  GLState::useProgram(sh_plane_baked.program_id);
+  glUniform1i(D_TEXTURE_MATERIAL_INDEX,  0);
+  glUniform1i(D_TEXTURE_MATERIAL2_INDEX, 1);
+  glUniform1i(D_TEXTURE_MATERIAL3_INDEX, 2);
 
-  // POST SHADER
-  logInfo("Compiling post processing shader");
-  sh_post.program_id = loadShaderLiteral(quad_vs_src, post_fs_src);
-  glUseProgram(sh_post.program_id);
+  // TERRAIN SHADER
+  logInfo("Compiling terrain shader");
+  sh_terrain.program_id = loadShaderLiteral(terrain_vs_src, plane_fs_src);
+  GLState::useProgram(sh_terrain.program_id);
+  glUniform1i(D_TEXTURE_MATERIAL_INDEX,  0);
+  glUniform1i(D_TEXTURE_MATERIAL2_INDEX, 1);
+  glUniform1i(D_TEXTURE_MATERIAL3_INDEX, 2);
+  logInfo("Compiling terrain shader completed (id: %i)", sh_terrain.program_id);
+
+  // TERRAIN CHUNK SHADER
+  logInfo("Compiling terrain chunk shader");
+  sh_terrain_chunk.program_id = loadShaderLiteral(terrain_chunk_vs_src, plane_fs_src);
+  GLState::useProgram(sh_terrain_chunk.program_id);
+  glUniform1i(D_TEXTURE_MATERIAL_INDEX,  0);
+  glUniform1i(D_TEXTURE_MATERIAL2_INDEX, 1);
+  glUniform1i(D_TEXTURE_MATERIAL3_INDEX, 2);
+  glUniform1i(D_TEXTURE_HEIGHTS_INDEX,   3);
+  logInfo("Compiling terrain chunk shader completed (id: %i)", sh_terrain_chunk.program_id);
+
+  // TESSELLATED TERRAIN SHADER
+  logInfo("Compiling tessellated terrain shader");
+  sh_terrain_tess.program_id = loadShaderLiteral(terrain_tess_vs_src, terrain_tcs_src, terrain_tes_src, plane_fs_src);
+  GLState::useProgram(sh_terrain_tess.program_id);
+  glUniform1i(D_TEXTURE_MATERIAL_INDEX,  0);
+  glUniform1i(D_TEXTURE_MATERIAL2_INDEX, 1);
+  glUniform1i(D_TEXTURE_MATERIAL3_INDEX, 2);
+  glUniform1i(D_TEXTURE_HEIGHTS_INDEX,   3);
+  logInfo("Compiling tessellated terrain shader completed (id: %i)", sh_terrain_tess.program_id);
+
+
+  // BLOOM SHADERS
+  logInfo("Compiling bloom shaders");
+  sh_bloom_prefilter.program_id = loadShaderLiteral(quad_vs_src, bloom_prefilter_fs_src);
+  GLState::useProgram(sh_bloom_prefilter.program_id);
   glUniform1i(17, 0);
   glUniform1i(18, 1);
-  logInfo("post processing shader compiled succesfully");
+  sh_bloom_down.program_id = loadShaderLiteral(quad_vs_src, bloom_down_fs_src);
+  GLState::useProgram(sh_bloom_down.program_id);
+  glUniform1i(D_BLOOM_GTEXTURE_INDEX, 0);
+  sh_bloom_up.program_id = loadShaderLiteral(quad_vs_src, bloom_up_fs_src);
+  GLState::useProgram(sh_bloom_up.program_id);
+  glUniform1i(D_BLOOM_GTEXTURE_INDEX, 0);
+  logInfo("Bloom shaders compiled succesfully");
 
 
   // COMBINATOR
   logInfo("Compiling combination shader");
-  sh_combinator.program_id = loadShaderLiteral(quad_vs_src, defer_fs_src); 
-  glUseProgram(sh_combinator.program_id);
+  sh_combinator.program_id = loadShaderLiteral(quad_vs_src, expand(defer_fs_src).c_str());
+  GLState::useProgram(sh_combinator.program_id);
   logInfo("Combination shader compiled succesfully");
 
   // g buffer bindings
   glUniform1i(D_NORMAL_GTEXTURE_INDEX,         0);
   glUniform1i(D_MATERIAL_GTEXTURE_INDEX,       1);
   glUniform1i(D_DEPTH_GTEXTURE_INDEX,          2);
+  glUniform1i(D_SHADOW_ATLAS_GTEXTURE_INDEX,   3);
+  glUniform1i(D_FOG_GTEXTURE_INDEX,            4);
 
-  // lights
-  glGenBuffers(1, &lights_buffer);
-  glBindBuffer(GL_UNIFORM_BUFFER, lights_buffer);
-  glBufferData(GL_UNIFORM_BUFFER, sizeof(lights_t), NULL, GL_DYNAMIC_DRAW);
-
-  GLuint u_shader_data = glGetUniformBlockIndex(sh_combinator.program_id, "shader_data"); 
-  glBindBufferBase(GL_UNIFORM_BUFFER, u_shader_data, lights_buffer);
+  // lights come from the frame ring, bound by uploadLights
+  frame_ring.init(8 << 20);
   // END COMBINATOR
+
+  // FROXELS
+  logInfo("Compiling froxel shaders");
+  sh_froxel_inject.program_id = loadComputeLiteral(froxel_inject_cs_src);
+  GLState::useProgram(sh_froxel_inject.program_id);
+  glUniform1i(D_DEPTH_GTEXTURE_INDEX,        0);
+  glUniform1i(D_SHADOW_ATLAS_GTEXTURE_INDEX, 3);
+  sh_froxel_integrate.program_id = loadComputeLiteral(froxel_integrate_cs_src);
+  GLState::useProgram(sh_froxel_integrate.program_id);
+  glUniform1i(D_DEPTH_GTEXTURE_INDEX,        0);
+  logInfo("Froxel shaders compiled succesfully");
+
+  // CULLING
+  logInfo("Compiling culling shaders");
+  sh_hiz_reduce.program_id = loadComputeLiteral(hiz_reduce_cs_src);
+  GLState::useProgram(sh_hiz_reduce.program_id);
+  glUniform1i(1, 0);
+  sh_cull.program_id = loadComputeLiteral(cull_cs_src);
+  GLState::useProgram(sh_cull.program_id);
+  glUniform1i(10, 0);
+  logInfo("Culling shaders compiled succesfully");
+}
+
+// Programs belong to this module, so none of them count as leaked
+void shutdown() {
+  plane_bake.buffer.reset();
+  plane_bake.vao.reset();
+  cone_instances_buffer.reset();
+  logInfo("Deleting %i programs", programs.size());
+  programs.clear();
 }
 
 }
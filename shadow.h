@@ -0,0 +1,284 @@
+namespace Shadows {
+
+// Bounding sphere of something that casts a shadow. Casters are handed
+// to the atlas in the same order every frame, the index is the identity.
+struct caster_t {
+  Vector3 center;
+  float radius;
+};
+
+struct shadow_data_t {
+  mat4x4 mat[32];
+  Vector4 rect[32]; // xy atlas offset, z atlas scale, w 1 when shadowed
+};
+
+class ShadowAtlas
+{
+  private:
+    static const int cells = D_SHADOW_ATLAS_SIZE / D_SHADOW_CELL_SIZE;
+
+    struct light_state_t {
+      Vector4 pos, dir;     // as they were when the region was rendered
+      int x, y, size;       // region in cells, size 0 when unallocated
+      int wanted;           // what the light's coverage asks for, size is
+                            // smaller when the atlas could not fit that
+      bool dirty;
+    };
+
+    Resources::Object buffer;
+    unsigned char owner[cells * cells]; // light index + 1, 0 when free
+    light_state_t state[32];
+    std::vector<caster_t> old_casters;
+    shadow_data_t data;
+
+    bool allocate(int light, int size);
+    void release(int light);
+    bool grow(int light, int size);
+    Matrix4 lightMatrix(const Vector4 &pos, const Vector4 &dir) const;
+
+  public:
+    int rendered; // regions re-rendered during the last frame
+
+    void init();
+    void release() { buffer.reset(); }
+    void update(const Shaders::lights_t &lights, const Vector3 &cam_pos, const std::vector<caster_t> &casters);
+    template <typename F> void render(F draw_casters);
+};
+
+// Half angle of the lit region of a spot, the combinator fades out
+// over 1/16 past the cone so the frustum has to cover that too.
+static float coneAngle(const Vector4 &dir) {
+  if (dir.w <= 0 || dir.xyz().sq_length() == 0) return 0;
+  return acos(std::max(dir.w - 1.0f / 16.0f, 0.0f));
+}
+
+static bool sphereInCone(const Vector3 &apex, const Vector3 &axis, float angle, const caster_t &c) {
+  Vector3 v = c.center - apex;
+  float proj = Vector3::dot(v, axis);
+  if (proj < -c.radius) return false;
+  float d = (v - axis * proj).length();
+  return (d - proj * tan(angle)) * cos(angle) <= c.radius;
+}
+
+// Maps how large a light's influence is on screen to a region size in cells
+static int sizeForImportance(float importance) {
+  if (importance >= 1.5f)  return 8;
+  if (importance >= 0.75f) return 4;
+  if (importance >= 0.35f) return 2;
+  return 1;
+}
+
+void ShadowAtlas::init()
+{
+  memset(owner, 0, sizeof(owner));
+  for(int i=0; i<32; i++) state[i] = light_state_t();
+  data = shadow_data_t();
+  rendered = 0;
+
+  buffer = Resources::createBuffer();
+  glNamedBufferStorage(buffer, sizeof(shadow_data_t), &data, GL_DYNAMIC_STORAGE_BIT);
+  glBindBufferBase(GL_UNIFORM_BUFFER, D_SHADOW_BLOCK_BINDING, buffer);
+}
+
+bool ShadowAtlas::allocate(int light, int size)
+{
+  for(int y=0; y<cells; y+=size) {
+    for(int x=0; x<cells; x+=size) {
+      bool free = true;
+      for(int j=y; j<y+size && free; j++)
+        for(int i=x; i<x+size && free; i++)
+          free = owner[j * cells + i] == 0;
+      if (!free) continue;
+
+      for(int j=y; j<y+size; j++)
+        for(int i=x; i<x+size; i++)
+          owner[j * cells + i] = light + 1;
+      state[light].x = x;
+      state[light].y = y;
+      state[light].size = size;
+      state[light].dirty = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ShadowAtlas::release(int light)
+{
+  light_state_t &s = state[light];
+  for(int j=s.y; j<s.y+s.size; j++)
+    for(int i=s.x; i<s.x+s.size; i++)
+      owner[j * cells + i] = 0;
+  s.size = 0;
+}
+
+// Moves a light to a larger region while it still holds its old one, so
+// failing leaves it where it was
+bool ShadowAtlas::grow(int light, int size)
+{
+  light_state_t old = state[light];
+  if (!allocate(light, size)) return false;
+  for(int j=old.y; j<old.y+old.size; j++)
+    for(int i=old.x; i<old.x+old.size; i++)
+      owner[j * cells + i] = 0;
+  return true;
+}
+
+Matrix4 ShadowAtlas::lightMatrix(const Vector4 &pos, const Vector4 &dir) const
+{
+  Vector3 eye = pos.xyz();
+  Vector3 fwd = dir.xyz().normalized();
+  Vector3 up = fabs(fwd.y) > 0.99f ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+
+  // The near plane sits just outside the light's own cube
+  Matrix4 p = Matrix4::FromPerspective(2 * coneAngle(dir), 1, 1.0f, 500.0f);
+  return p * Matrix4::FromLookAt(eye, eye + fwd, up);
+}
+
+void ShadowAtlas::update(const Shaders::lights_t &lights, const Vector3 &cam_pos, const std::vector<caster_t> &casters)
+{
+  // Size each light holds this frame
+  int wanted[32];
+  bool freed = false;
+  for(int i=0; i<32; i++) {
+    float angle = coneAngle(lights.dir[i]);
+    if (angle <= 0 || angle > 1.2f) {
+      wanted[i] = state[i].wanted = 0;
+      continue;
+    }
+
+    // Projected radius of the region the light visibly brightens
+    float reach = lights.reach(i);
+    float dist = std::max((lights.pos[i].xyz() - cam_pos).length(), 1.0f);
+    float importance = reach / dist;
+
+    // Hysteresis, so lights near a threshold keep their region
+    int current = state[i].wanted;
+    int desired = sizeForImportance(importance);
+    if (current != 0 &&
+        current >= sizeForImportance(importance / 1.25f) &&
+        current <= sizeForImportance(importance * 1.25f))
+      desired = current;
+
+    // A light that got less than it asked for keeps that until its
+    // coverage changes, or room frees up below
+    if (desired == current && state[i].size != 0) wanted[i] = state[i].size;
+    else wanted[i] = desired;
+    state[i].wanted = desired;
+  }
+
+  // Free every region that changes size before placing the new ones
+  for(int i=0; i<32; i++)
+    if (state[i].size != 0 && state[i].size != wanted[i]) {
+      release(i);
+      freed = true;
+    }
+
+  // Largest first keeps the atlas from fragmenting
+  for(int size=8; size>=1; size/=2) {
+    for(int i=0; i<32; i++) {
+      if (wanted[i] != size || state[i].size == size) continue;
+      int s = size;
+      while (s >= 1 && !allocate(i, s)) s /= 2;
+      if (s < 1) logWarning("Shadow atlas is full, light %i casts no shadow", i);
+    }
+  }
+
+  if (freed) {
+    for(int i=0; i<32; i++) {
+      if (state[i].size == 0 || state[i].size >= state[i].wanted) continue;
+      for(int s=state[i].wanted; s>state[i].size; s/=2)
+        if (grow(i, s)) break;
+    }
+  }
+
+  for(int i=0; i<32; i++) {
+    light_state_t &s = state[i];
+    if (s.size == 0) continue;
+    const Vector4 &p = lights.pos[i], &d = lights.dir[i];
+    if (p.x != s.pos.x || p.y != s.pos.y || p.z != s.pos.z ||
+        d.x != s.dir.x || d.y != s.dir.y || d.z != s.dir.z || d.w != s.dir.w)
+      s.dirty = true;
+  }
+
+  // Anything that moved dirties the lights that can see where it was or is now
+  bool all = casters.size() != old_casters.size();
+  for(int c=0; c<(int)casters.size(); c++) {
+    if (all) break;
+    const caster_t &now = casters[c], &was = old_casters[c];
+    if (now.center.x == was.center.x && now.center.y == was.center.y &&
+        now.center.z == was.center.z && now.radius == was.radius) continue;
+
+    for(int i=0; i<32; i++) {
+      if (state[i].size == 0 || state[i].dirty) continue;
+      Vector3 apex = lights.pos[i].xyz();
+      Vector3 axis = lights.dir[i].xyz().normalized();
+      float angle = coneAngle(lights.dir[i]);
+      if (sphereInCone(apex, axis, angle, now) || sphereInCone(apex, axis, angle, was))
+        state[i].dirty = true;
+    }
+  }
+  if (all)
+    for(int i=0; i<32; i++)
+      state[i].dirty = state[i].size != 0;
+  old_casters = casters;
+
+  for(int i=0; i<32; i++) {
+    if (state[i].dirty) {
+      state[i].pos = lights.pos[i];
+      state[i].dir = lights.dir[i];
+    }
+  }
+}
+
+template <typename F>
+void ShadowAtlas::render(F draw_casters)
+{
+  rendered = 0;
+  bool upload = false;
+
+  FBO::shadow_atlas.bind();
+  GLState::enable(GL_SCISSOR_TEST);
+  GLState::enable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(2, 4);
+
+  for(int i=0; i<32; i++) {
+    light_state_t &s = state[i];
+    if (s.size == 0) {
+      // Lights that lost their region stop sampling the atlas
+      upload |= data.rect[i].w != 0;
+      data.rect[i] = Vector4(0);
+      continue;
+    }
+    if (!s.dirty) continue;
+
+    int px = s.x * D_SHADOW_CELL_SIZE;
+    int py = s.y * D_SHADOW_CELL_SIZE;
+    int pw = s.size * D_SHADOW_CELL_SIZE;
+    glViewport(px, py, pw, pw);
+    glScissor(px, py, pw, pw);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    Matrix4 m = lightMatrix(s.pos, s.dir);
+    draw_casters(m);
+
+    m.unpack(data.mat[i]);
+    data.rect[i] = Vector4(
+        (float)px / D_SHADOW_ATLAS_SIZE,
+        (float)py / D_SHADOW_ATLAS_SIZE,
+        (float)pw / D_SHADOW_ATLAS_SIZE,
+        1);
+    s.dirty = false;
+    upload = true;
+    rendered++;
+  }
+
+  GLState::disable(GL_POLYGON_OFFSET_FILL);
+  GLState::disable(GL_SCISSOR_TEST);
+
+  if (upload) glNamedBufferSubData(buffer, 0, sizeof(shadow_data_t), &data);
+}
+
+ShadowAtlas atlas;
+
+}
@@ -0,0 +1,276 @@
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+namespace Streaming {
+
+enum job_kind {
+  JOB_TEXTURE,
+  JOB_MESH,
+};
+
+// One asset, decoded and uploaded by the loader thread. The GL names it
+// made belong to nobody until the render thread adopts them.
+struct job_t {
+  job_kind kind;
+  std::string filename;
+  std::function<void(Resources::handle_t)> done;
+
+  GLuint texture, vertices, indices;
+  int width, height;
+  uint32_t vertex_count, index_count;
+  Meshes::Mesh bounds;
+  GLsync fence;
+  size_t bytes;
+  double ms;
+  bool failed;
+};
+
+// Owns a hidden window whose context shares objects with the main one.
+// Its thread decodes files, creates and fills textures and staging
+// buffers in that context and fences them. The render thread only adopts
+// what the GPU has finished: textures go into the pool as they are,
+// meshes are copied into their arena on the GPU.
+class Loader {
+  public:
+    int max_adopt; // per frame
+
+    // Counters, reset by report()
+    int adopted;
+    size_t adopted_bytes;
+    double loader_ms; // loader thread busy
+    double adopt_ms;  // spent adopting on the render thread
+
+    Loader() : max_adopt(4), context(NULL), quit(false) {}
+    ~Loader() { stop(); }
+
+    void init(GLFWwindow* main);
+    void stop();
+
+    // done gets the handle on the render thread, an invalid one when the
+    // file could not be loaded
+    void loadTexture(const char* filename, std::function<void(Textures::Handle)> done);
+    void loadMesh(const char* filename, std::function<void(Meshes::Handle)> done);
+
+    // Once per frame on the render thread
+    void adopt();
+    int pending();
+    void report();
+
+  private:
+    GLFWwindow* context;
+    std::thread thread;
+    std::vector<job_t> fenced; // render thread only
+
+    // Shared with the loader thread, guarded by lock
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<job_t> requests;
+    std::vector<job_t> finished;
+    int busy;
+    bool quit;
+
+    void queue(job_t &&job);
+    void work();
+    void run(job_t &job);
+    static void discard(job_t &job);
+};
+
+void Loader::init(GLFWwindow* main)
+{
+  // Windows have to be created on the main thread
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  context = glfwCreateWindow(1, 1, "loader", NULL, main);
+  glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+  if (!context) {
+    logError("Could not create the loader context");
+    exit(13);
+  }
+  adopted = 0;
+  adopted_bytes = 0;
+  loader_ms = adopt_ms = 0;
+  busy = 0;
+  thread = std::thread([this]() { work(); });
+}
+
+void Loader::stop()
+{
+  if (!thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_one();
+  thread.join();
+  for(job_t &j : fenced) discard(j);
+  for(job_t &j : finished) discard(j);
+  fenced.clear();
+  finished.clear();
+  requests.clear();
+  glfwDestroyWindow(context);
+}
+
+void Loader::queue(job_t &&job)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    requests.push_back(std::move(job));
+  }
+  wake.notify_one();
+}
+
+void Loader::loadTexture(const char* filename, std::function<void(Textures::Handle)> done)
+{
+  job_t job = {};
+  job.kind = JOB_TEXTURE;
+  job.filename = filename;
+  job.done = done;
+  queue(std::move(job));
+}
+
+void Loader::loadMesh(const char* filename, std::function<void(Meshes::Handle)> done)
+{
+  job_t job = {};
+  job.kind = JOB_MESH;
+  job.filename = filename;
+  job.done = done;
+  queue(std::move(job));
+}
+
+void Loader::work()
+{
+  glfwMakeContextCurrent(context);
+  while(true) {
+    job_t job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]() { return quit || !requests.empty(); });
+      if (quit) break;
+      job = std::move(requests.front());
+      requests.pop_front();
+      busy++;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    run(job);
+    job.ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> guard(lock);
+    finished.push_back(std::move(job));
+    busy--;
+  }
+  glfwMakeContextCurrent(NULL);
+}
+
+// Loader thread. The flush makes sure the fence reaches the GPU, the
+// render thread would otherwise wait on it forever.
+void Loader::run(job_t &job)
+{
+  if (job.kind == JOB_TEXTURE) {
+    unsigned char* data = Textures::decode(job.filename.c_str(), job.width, job.height);
+    if (!data) {
+      job.failed = true;
+      return;
+    }
+    job.texture = Textures::createTexture(job.width, job.height, data);
+    job.bytes = (size_t)job.width * job.height * 3;
+    stbi_image_free(data);
+  } else {
+    std::vector<float> vertices;
+    std::vector<GLuint> indices;
+    Meshes::readObj(job.filename.c_str(), vertices, indices);
+    if (vertices.empty()) {
+      job.failed = true;
+      return;
+    }
+    const int floats = Geometry::formats[Geometry::FORMAT_STANDARD].floats;
+    job.vertex_count = vertices.size() / floats;
+    job.index_count = indices.size();
+    Meshes::computeBounds(&job.bounds, vertices.data(), job.vertex_count, floats);
+
+    // Immutable staging buffers, only ever the source of a copy
+    glCreateBuffers(1, &job.vertices);
+    glNamedBufferStorage(job.vertices, vertices.size() * sizeof(float), vertices.data(), 0);
+    glCreateBuffers(1, &job.indices);
+    glNamedBufferStorage(job.indices, std::max(indices.size(), (size_t)1) * sizeof(GLuint), indices.data(), 0);
+    job.bytes = (vertices.size() * sizeof(float)) + indices.size() * sizeof(GLuint);
+  }
+  job.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glFlush();
+}
+
+void Loader::discard(job_t &job)
+{
+  if (job.fence) glDeleteSync(job.fence);
+  if (job.texture) glDeleteTextures(1, &job.texture);
+  if (job.vertices) glDeleteBuffers(1, &job.vertices);
+  if (job.indices) glDeleteBuffers(1, &job.indices);
+}
+
+// Never waits: a job whose fence has not signaled yet stays for the next
+// frame, as does everything past max_adopt
+void Loader::adopt()
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    for(job_t &j : finished) fenced.push_back(std::move(j));
+    finished.clear();
+  }
+
+  int n = 0;
+  size_t kept = 0;
+  for(size_t i=0; i<fenced.size(); i++) {
+    job_t &job = fenced[i];
+    if (n == max_adopt || (job.fence && glClientWaitSync(job.fence, 0, 0) == GL_TIMEOUT_EXPIRED)) {
+      if (kept != i) fenced[kept] = std::move(job);
+      kept++;
+      continue;
+    }
+    n++;
+
+    Resources::handle_t handle = { 0, 0 };
+    if (job.failed) {
+      logError("Could not stream %s", job.filename.c_str());
+    } else {
+      glDeleteSync(job.fence);
+      if (job.kind == JOB_TEXTURE) {
+        handle = Textures::adopt(job.texture, job.width, job.height, job.filename.c_str());
+      } else {
+        handle = Meshes::createMesh(Geometry::FORMAT_STANDARD, job.vertices, job.vertex_count,
+            job.indices, job.index_count, job.bounds, job.filename.c_str());
+        // Retired, so they outlive the copy out of them
+        Resources::Object(Resources::KIND_BUFFER, job.vertices).reset();
+        Resources::Object(Resources::KIND_BUFFER, job.indices).reset();
+      }
+      adopted++;
+      adopted_bytes += job.bytes;
+      loader_ms += job.ms;
+    }
+    if (job.done) job.done(handle);
+  }
+  fenced.resize(kept);
+  adopt_ms += std::chrono::duration<double, std::milli>(
+      std::chrono::high_resolution_clock::now() - start).count();
+}
+
+int Loader::pending()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return requests.size() + busy + finished.size() + fenced.size();
+}
+
+void Loader::report()
+{
+  logDebug("Streaming: %i assets adopted (%i KB), %.1fms on the loader thread, %.3fms adopting, %i pending",
+      adopted, (int)(adopted_bytes / 1024), loader_ms, adopt_ms, pending());
+  adopted = 0;
+  adopted_bytes = 0;
+  loader_ms = adopt_ms = 0;
+}
+
+Loader loader;
+
+}
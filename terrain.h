@@ -0,0 +1,273 @@
+namespace Terrain {
+
+enum mode {
+  MODE_BAKED,           // static indexed mesh from the CPU heightfield
+  MODE_GEOMETRY_SHADER, // point grid expanded by plane_gs_src every frame
+  MODE_CAPTURED,        // plane_gs_src output captured once and replayed
+  MODE_CHUNKED,         // streamed quadtree of chunks with morphing lods
+  MODE_TESSELLATED,     // coarse patches subdivided by the tessellator
+  MODE_COUNT,
+};
+
+// The value noise from plane_gs_src, operation for operation so every
+// width gives the same bits. Each GLSL vec4 is spelled out per component.
+template <int W>
+struct noise_kernel {
+  typedef lanes<W> L;
+  typedef typename L::V V;
+
+  static V fract(V x) { return L::sub(x, L::floor(x)); }
+  static V mod289(V x) {
+    return L::sub(x, L::mul(L::floor(L::mul(x, L::set(1.0f / 289.0f))), L::set(289.0f)));
+  }
+  static V perm(V x) {
+    return mod289(L::mul(L::add(L::mul(x, L::set(34.0f)), L::set(1.0f)), x));
+  }
+
+  static V noise(V px, V py, V pz) {
+    V ax = L::floor(px), ay = L::floor(py), az = L::floor(pz);
+    V dx = L::sub(px, ax), dy = L::sub(py, ay), dz = L::sub(pz, az);
+    V three = L::set(3.0f), two = L::set(2.0f), one = L::set(1.0f);
+    dx = L::mul(L::mul(dx, dx), L::sub(three, L::mul(two, dx)));
+    dy = L::mul(L::mul(dy, dy), L::sub(three, L::mul(two, dy)));
+    dz = L::mul(L::mul(dz, dz), L::sub(three, L::mul(two, dz)));
+
+    // b = a.xxyy + (0, 1, 0, 1), k1 = perm(b.xyxy)
+    V bx = ax, by = L::add(ax, one), bz = ay, bw = L::add(ay, one);
+    V k1x = perm(bx), k1y = perm(by);
+
+    // k2 = perm(k1.xyxy + b.zzww), c = k2 + a.zzzz
+    V cx = L::add(perm(L::add(k1x, bz)), az);
+    V cy = L::add(perm(L::add(k1y, bz)), az);
+    V cz = L::add(perm(L::add(k1x, bw)), az);
+    V cw = L::add(perm(L::add(k1y, bw)), az);
+
+    V inv41 = L::set(1.0f / 41.0f);
+    V o3[4], c[4] = { cx, cy, cz, cw };
+    for(int i=0; i<4; i++) {
+      V o1 = fract(L::mul(perm(c[i]), inv41));
+      V o2 = fract(L::mul(perm(L::add(c[i], one)), inv41));
+      o3[i] = L::add(L::mul(o2, dz), L::mul(o1, L::sub(one, dz)));
+    }
+
+    V o4x = L::add(L::mul(o3[1], dx), L::mul(o3[0], L::sub(one, dx)));
+    V o4y = L::add(L::mul(o3[3], dx), L::mul(o3[2], L::sub(one, dx)));
+    return L::add(L::mul(o4y, dy), L::mul(o4x, L::sub(one, dy)));
+  }
+};
+
+inline float noise(float x, float y, float z) {
+  return noise_kernel<1>::noise(x, y, z);
+}
+
+// Noise at ((x0 + i * step) / 4, y, z) for i below count, a register
+// at a time
+static void noiseRow(float* out, int count, float x0, float step, float y, float z)
+{
+  typedef lanes<wide> L;
+  const int w = L::width;
+  float xs[w];
+  int i = 0;
+  for(; i + w <= count; i += w) {
+    for(int l=0; l<w; l++) xs[l] = x0 + (i + l) * step;
+    L::V v;
+    memcpy(&v, xs, sizeof(v));
+    v = noise_kernel<wide>::noise(L::mul(v, L::set(0.25f)), L::set(y), L::set(z));
+    memcpy(out + i, &v, sizeof(v));
+  }
+  for(; i<count; i++) out[i] = noise((x0 + i * step) * 0.25f, y, z);
+}
+
+// n x n noise samples starting at (x0, z0), step apart, rows split
+// between worker threads
+static void noiseGrid(float* out, int n, float x0, float z0, float step)
+{
+  int workers = std::max(1, std::min((int)std::thread::hardware_concurrency(), n));
+  std::vector<std::thread> threads;
+  for(int t=0; t<workers; t++) {
+    threads.push_back(std::thread([=]() {
+      for(int z=t; z<n; z+=workers)
+        noiseRow(&out[z * n], n, x0, step, 0, (z0 + z * step) * 0.25f);
+    }));
+  }
+  for(auto &t : threads) t.join();
+}
+
+// The terrain the point grid and plane_gs_src used to build every frame,
+// baked once. Vertices are in the plane's local space, model places them.
+struct heightfield_t {
+  static const int size = 25;   // cells per side
+  float scale;                  // world units per cell
+  Vector3 offset;               // local space translation before scaling
+  float amplitude;              // local height of noise 1
+  std::vector<float> heights;   // (size + 3)^2, noise with a one sample border
+  Meshes::Handle mesh;
+  double bake_ms;
+
+  Matrix4 model() const {
+    return Matrix4::FromScale(scale) * Matrix4::FromTranslation(offset.x, offset.y, offset.z);
+  }
+
+  float sample(int x, int z) const { return heights[(z + 1) * (size + 3) + x + 1]; }
+
+  void bake() {
+    auto start = std::chrono::high_resolution_clock::now();
+    const int n = size + 3;
+    heights.resize(n * n);
+
+    noiseGrid(heights.data(), n, -1, -1, 1);
+
+    // Position, normal and the raw noise for the material blend
+    std::vector<float> vertices;
+    vertices.reserve((size + 1) * (size + 1) * 7);
+    for(int z=0; z<=size; z++) {
+      for(int x=0; x<=size; x++) {
+        float h = sample(x, z);
+        Vector3 normal = Vector3(
+            -(sample(x + 1, z) - sample(x - 1, z)) * amplitude / 2, 1,
+            -(sample(x, z + 1) - sample(x, z - 1)) * amplitude / 2).normalize();
+        float v[] = { (float)x, h * amplitude, (float)z, normal.x, normal.y, normal.z, h };
+        vertices.insert(vertices.end(), v, v + 7);
+      }
+    }
+
+    // Same split as the geometry shader, (p0 p1 p2) and (p1 p2 p3)
+    std::vector<unsigned int> indices;
+    indices.reserve(size * size * 6);
+    for(int z=0; z<size; z++) {
+      for(int x=0; x<size; x++) {
+        unsigned int p0 = z * (size + 1) + x, p1 = p0 + 1;
+        unsigned int p2 = p0 + size + 1, p3 = p2 + 1;
+        unsigned int q[] = { p0, p1, p2, p1, p2, p3 };
+        indices.insert(indices.end(), q, q + 6);
+      }
+    }
+    mesh = Meshes::loadMeshHeightfield(vertices, indices);
+
+    bake_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    logInfo("Terrain baked %i samples in %.3fms (%i wide)", n * n, bake_ms, wide);
+  }
+
+  void init() {
+    scale = 10;
+    offset = Vector3(-size / 2.0f, -10, -size / 2.0f);
+    amplitude = 10;
+    bake();
+  }
+
+  // The baked triangles in local space, for the cpu
+  void surface(std::vector<Vector3> &vertices, std::vector<unsigned int> &indices) const {
+    for(int z=0; z<=size; z++)
+      for(int x=0; x<=size; x++)
+        vertices.push_back(Vector3(x, sample(x, z) * amplitude, z));
+    for(int z=0; z<size; z++) {
+      for(int x=0; x<size; x++) {
+        unsigned int p0 = z * (size + 1) + x, p1 = p0 + 1;
+        unsigned int p2 = p0 + size + 1, p3 = p2 + 1;
+        unsigned int q[] = { p0, p1, p2, p1, p2, p3 };
+        indices.insert(indices.end(), q, q + 6);
+      }
+    }
+  }
+
+  // World space height of the drawn surface, interpolated over the same
+  // triangles. Outside the grid it follows the noise further out.
+  float height(float wx, float wz) const {
+    float lx = wx / scale - offset.x, lz = wz / scale - offset.z;
+    float x0 = floorf(lx), z0 = floorf(lz);
+    float fx = lx - x0, fz = lz - z0;
+    float h00 = noise(x0 / 4, 0, z0 / 4),     h10 = noise((x0 + 1) / 4, 0, z0 / 4);
+    float h01 = noise(x0 / 4, 0, (z0 + 1) / 4), h11 = noise((x0 + 1) / 4, 0, (z0 + 1) / 4);
+    float h = fx + fz <= 1 ?
+      h00 + fx * (h10 - h00) + fz * (h01 - h00) :
+      h11 + (1 - fx) * (h01 - h11) + (1 - fz) * (h10 - h11);
+    return (h * amplitude + offset.y) * scale;
+  }
+} heightfield;
+
+// Input for the tessellated terrain: the heightfield noise over a wider
+// area in a height texture, and a grid of coarse patches. Each patch
+// corner carries how rough the patches around it are, edges take the
+// larger of their two corners so neighbours agree on the factors.
+struct patches_t {
+  Resources::Object heights;
+  int samples;    // per side of the height texture
+  Resources::Object vao, vbo, ibo;
+  int index_count;
+  float origin;   // world x and z of the first sample
+
+  void init() {
+    const heightfield_t &hf = heightfield;
+    samples = (int)(D_TERRAIN_TESS_EXTENT / D_TERRAIN_TESS_SPACING) + 1;
+    origin = -D_TERRAIN_TESS_EXTENT / 2;
+    float step = D_TERRAIN_TESS_SPACING / hf.scale;
+    std::vector<float> data(samples * samples);
+    noiseGrid(data.data(), samples, origin / hf.scale - hf.offset.x, origin / hf.scale - hf.offset.z, step);
+
+    heights = Resources::createTexture(GL_TEXTURE_2D);
+    glTextureStorage2D(heights, 1, GL_R32F, samples, samples);
+    glTextureSubImage2D(heights, 0, 0, 0, samples, samples, GL_RED, GL_FLOAT, data.data());
+    glTextureParameteri(heights, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(heights, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(heights, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(heights, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Roughness is the standard deviation of the world heights in a
+    // patch, 10 units and up counts as fully rough
+    const int patches = (int)(D_TERRAIN_TESS_EXTENT / D_TERRAIN_PATCH);
+    const int per_patch = (int)(D_TERRAIN_PATCH / D_TERRAIN_TESS_SPACING);
+    std::vector<float> rough((patches + 1) * (patches + 1), 0);
+    for(int pz=0; pz<patches; pz++) {
+      for(int px=0; px<patches; px++) {
+        double sum = 0, sum2 = 0;
+        int count = 0;
+        for(int z=pz * per_patch; z<=(pz + 1) * per_patch; z++)
+          for(int x=px * per_patch; x<=(px + 1) * per_patch; x++) {
+            double h = data[z * samples + x] * hf.amplitude * hf.scale;
+            sum += h;
+            sum2 += h * h;
+            count++;
+          }
+        double variance = std::max(sum2 / count - (sum / count) * (sum / count), 0.0);
+        float r = std::min((float)sqrt(variance) / 10, 1.0f);
+        for(int c=0; c<4; c++) {
+          float &corner = rough[(pz + (c >> 1)) * (patches + 1) + px + (c & 1)];
+          corner = std::max(corner, r);
+        }
+      }
+    }
+
+    std::vector<float> vertices;
+    for(int z=0; z<=patches; z++)
+      for(int x=0; x<=patches; x++) {
+        float v[] = { origin + x * (float)D_TERRAIN_PATCH, origin + z * (float)D_TERRAIN_PATCH, rough[z * (patches + 1) + x] };
+        vertices.insert(vertices.end(), v, v + 3);
+      }
+
+    // Corners go around the patch: (0,0) (1,0) (1,1) (0,1)
+    std::vector<unsigned int> indices;
+    for(int z=0; z<patches; z++)
+      for(int x=0; x<patches; x++) {
+        unsigned int p0 = z * (patches + 1) + x;
+        unsigned int q[] = { p0, p0 + 1, p0 + patches + 2, p0 + patches + 1 };
+        indices.insert(indices.end(), q, q + 4);
+      }
+    index_count = indices.size();
+
+    vao = Resources::createVertexArray();
+    vbo = Resources::Object(Resources::KIND_BUFFER, Meshes::createBuffer(vertices.size() * sizeof(float), vertices.data()));
+    ibo = Resources::Object(Resources::KIND_BUFFER, Meshes::createBuffer(indices.size() * sizeof(unsigned int), indices.data()));
+    glVertexArrayElementBuffer(vao, ibo);
+    Meshes::attribute(vao, D_POS_BUFFER_INDEX, vbo, 3, GL_FALSE, 3 * sizeof(float), 0);
+  }
+
+  void release() {
+    heights.reset();
+    vao.reset();
+    vbo.reset();
+    ibo.reset();
+  }
+} patches;
+
+}
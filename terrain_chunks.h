@@ -0,0 +1,296 @@
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace Terrain {
+
+using namespace Textures;
+
+// The heightfield noise over a much larger area, as a quadtree of chunks
+// drawn with continuous distance based lod (CDLOD). Every chunk is the
+// same grid scaled to its node, so the triangle count only depends on
+// how many lod ranges the view reaches into, not on the view distance.
+// Chunk heights are generated on a worker thread and live in a fixed
+// number of texture array layers, the least recently used being
+// recycled. Until a chunk arrives its parent covers the area.
+class ChunkedTerrain
+{
+  private:
+    static const int samples = D_TERRAIN_GRID + 3; // one sample border for the normals
+
+    struct slot_t {
+      uint64_t key;
+      int last_used;
+      bool pinned;
+    };
+
+    struct draw_t {
+      float x, z, size;
+      int level, layer;
+      int quadrants; // bit per quarter of the grid
+    };
+
+    struct result_t {
+      uint64_t key;
+      std::vector<float> heights;
+    };
+
+    Meshes::Handle grid;
+    Resources::Object heights;
+    std::vector<slot_t> slots;
+    std::unordered_map<uint64_t, int> resident;
+    std::vector<draw_t> selection;
+    std::vector<uint64_t> wanted;
+    float ranges[D_TERRAIN_LEVELS];
+    Vector3 cam_pos;
+    int frame;
+
+    // Shared with the worker, guarded by lock
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<uint64_t> requests;
+    std::unordered_set<uint64_t> in_flight;
+    std::vector<result_t> finished;
+    bool quit;
+
+    static uint64_t key(int level, int x, int z) {
+      return (uint64_t)level << 48 | (uint64_t)x << 24 | (uint64_t)z;
+    }
+    static float nodeSize(int level) { return D_TERRAIN_LEAF * (1 << level); }
+    static float nodeOrigin(int level, int i) {
+      return -nodeSize(D_TERRAIN_LEVELS - 1) / 2 + i * nodeSize(level);
+    }
+    AABB nodeBox(int level, int x, int z) const;
+    void generate(uint64_t k, std::vector<float> &out) const;
+    int acquireSlot();
+    void upload(const result_t &result);
+    bool select(int level, int x, int z, const Frustum &frustum);
+    void work();
+
+  public:
+    int max_uploads;   // chunks adopted per frame
+    int drawn_chunks;  // last frame
+    int triangles;     // last frame
+    int evictions;
+
+    ChunkedTerrain() : quit(false) {}
+    ~ChunkedTerrain();
+    // Gives the grid and the heights back, before the leak report at shutdown
+    void release() { Meshes::destroy(grid); heights.reset(); }
+
+    void init();
+    void update(const Matrix4 &camera, const Vector3 &cam_pos);
+    void draw(const Matrix4 &camera, Texture water, Texture grass, Texture stone);
+};
+
+ChunkedTerrain::~ChunkedTerrain()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_one();
+  if (worker.joinable()) worker.join();
+}
+
+AABB ChunkedTerrain::nodeBox(int level, int x, int z) const
+{
+  const heightfield_t &hf = heightfield;
+  float size = nodeSize(level);
+  float bias = hf.offset.y * hf.scale;
+  Vector3 min = Vector3(nodeOrigin(level, x), bias, nodeOrigin(level, z));
+  return AABB(min, min + Vector3(size, hf.amplitude * hf.scale, size));
+}
+
+// Same noise and mapping as the baked heightfield, at this node's spacing
+void ChunkedTerrain::generate(uint64_t k, std::vector<float> &out) const
+{
+  const heightfield_t &hf = heightfield;
+  int level = k >> 48, x = (k >> 24) & 0xffffff, z = k & 0xffffff;
+  float step = nodeSize(level) / D_TERRAIN_GRID / hf.scale;
+  float lx = nodeOrigin(level, x) / hf.scale - hf.offset.x - step;
+  float lz = nodeOrigin(level, z) / hf.scale - hf.offset.z - step;
+
+  out.resize(samples * samples);
+  for(int row=0; row<samples; row++)
+    noiseRow(&out[row * samples], samples, lx, step, 0, (lz + row * step) * 0.25f);
+}
+
+int ChunkedTerrain::acquireSlot()
+{
+  if ((int)slots.size() < D_TERRAIN_BUDGET) {
+    slots.push_back(slot_t());
+    return slots.size() - 1;
+  }
+
+  // Nothing drawn last frame or this one is taken
+  int victim = -1;
+  for(int i=0; i<(int)slots.size(); i++)
+    if (!slots[i].pinned && slots[i].last_used < frame - 1 &&
+        (victim == -1 || slots[i].last_used < slots[victim].last_used))
+      victim = i;
+  if (victim != -1) {
+    resident.erase(slots[victim].key);
+    evictions++;
+  }
+  return victim;
+}
+
+void ChunkedTerrain::upload(const result_t &result)
+{
+  int slot = acquireSlot();
+  if (slot == -1) return; // over budget, it gets asked for again
+
+  slots[slot].key = result.key;
+  slots[slot].last_used = frame;
+  slots[slot].pinned = false;
+  resident[result.key] = slot;
+  glTextureSubImage3D(heights, 0, 0, 0, slot, samples, samples, 1, GL_RED, GL_FLOAT, result.heights.data());
+}
+
+void ChunkedTerrain::init()
+{
+  grid = Meshes::loadMeshGrid(D_TERRAIN_GRID);
+  for(int l=0; l<D_TERRAIN_LEVELS; l++) ranges[l] = D_TERRAIN_RANGE * (1 << l);
+  frame = 0;
+  max_uploads = 8;
+  drawn_chunks = triangles = evictions = 0;
+
+  heights = Resources::createTexture(GL_TEXTURE_2D_ARRAY);
+  glTextureStorage3D(heights, 1, GL_R32F, samples, samples, D_TERRAIN_BUDGET);
+  glTextureParameteri(heights, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTextureParameteri(heights, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTextureParameteri(heights, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTextureParameteri(heights, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  // The root always has to be there to fall back on
+  result_t root = { key(D_TERRAIN_LEVELS - 1, 0, 0), {} };
+  generate(root.key, root.heights);
+  upload(root);
+  slots[resident[root.key]].pinned = true;
+
+  const heightfield_t &hf = heightfield;
+  GLState::useProgram(Shaders::sh_terrain_chunk.program_id);
+  Shaders::sh_terrain_chunk.setHeightMap(hf.amplitude * hf.scale, hf.offset.y * hf.scale);
+
+  worker = std::thread([this]() { work(); });
+  logInfo("Chunked terrain: %i levels, %i chunks resident at most (%i KB)",
+      D_TERRAIN_LEVELS, D_TERRAIN_BUDGET, samples * samples * 4 * D_TERRAIN_BUDGET / 1024);
+}
+
+void ChunkedTerrain::work()
+{
+  while (true) {
+    uint64_t k;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]() { return quit || !requests.empty(); });
+      if (quit) return;
+      k = requests.front();
+      requests.pop_front();
+      in_flight.insert(k);
+    }
+
+    result_t result = { k, {} };
+    generate(k, result.heights);
+
+    std::lock_guard<std::mutex> guard(lock);
+    finished.push_back(std::move(result));
+  }
+}
+
+// Returns false when the node is outside its lod range, the parent then
+// draws that quarter itself
+bool ChunkedTerrain::select(int level, int x, int z, const Frustum &frustum)
+{
+  AABB box = nodeBox(level, x, z);
+  if (!box.overlaps(cam_pos, ranges[level])) return false;
+
+  int layer = resident[key(level, x, z)];
+  slots[layer].last_used = frame;
+  if (frustum.classify(box) == Frustum::OUTSIDE) return true;
+
+  if (level == 0 || !box.overlaps(cam_pos, ranges[level - 1])) {
+    selection.push_back({ box.min.x, box.min.z, nodeSize(level), level, layer, 15 });
+    return true;
+  }
+
+  int quadrants = 0;
+  for(int c=0; c<4; c++) {
+    int cx = x * 2 + (c & 1), cz = z * 2 + (c >> 1);
+    uint64_t ck = key(level - 1, cx, cz);
+    if (nodeBox(level - 1, cx, cz).overlaps(cam_pos, ranges[level - 1]) && !resident.count(ck)) {
+      wanted.push_back(ck);
+      quadrants |= 1 << c;
+    } else if (!select(level - 1, cx, cz, frustum)) {
+      quadrants |= 1 << c;
+    }
+  }
+  if (quadrants) selection.push_back({ box.min.x, box.min.z, nodeSize(level), level, layer, quadrants });
+  return true;
+}
+
+void ChunkedTerrain::update(const Matrix4 &camera, const Vector3 &cam_pos)
+{
+  frame++;
+  this->cam_pos = cam_pos;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    int n = std::min(max_uploads, (int)finished.size());
+    for(int i=0; i<n; i++) {
+      upload(finished[i]);
+      in_flight.erase(finished[i].key);
+    }
+    finished.erase(finished.begin(), finished.begin() + n);
+  }
+
+  selection.clear();
+  wanted.clear();
+  select(D_TERRAIN_LEVELS - 1, 0, 0, Frustum(camera));
+
+  // Only what this frame still misses is worth generating, coarse first
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    requests.clear();
+    for(uint64_t k : wanted)
+      if (!in_flight.count(k)) requests.push_back(k);
+  }
+  wake.notify_one();
+}
+
+void ChunkedTerrain::draw(const Matrix4 &camera, Texture water, Texture grass, Texture stone)
+{
+  const Meshes::Mesh* mesh = Meshes::get(grid);
+  const int quarter = mesh->vertex_count / 4;
+  Shaders::sh_terrain_chunk.use(camera, cam_pos, water, grass, stone, heights);
+  Shaders::sh_terrain_chunk.setTextureScale(0.005);
+
+  drawn_chunks = selection.size();
+  triangles = 0;
+  for(const draw_t &d : selection) {
+    Shaders::sh_terrain_chunk.setNode(d.x, d.z, d.size, d.layer);
+    Shaders::sh_terrain_chunk.setMorph(ranges[d.level] * 0.7f, ranges[d.level] * 0.95f);
+    if (d.quadrants == 15) {
+      Meshes::draw(mesh);
+      triangles += mesh->vertex_count / 3;
+      continue;
+    }
+    for(int q=0; q<4; q++) {
+      if (!(d.quadrants & (1 << q))) continue;
+      Meshes::drawRange(mesh, GL_TRIANGLES, q * quarter, quarter);
+      triangles += quarter / 3;
+    }
+  }
+
+  if (frame % 600 == 0)
+    logDebug("Terrain: %i chunks, %i triangles, %i resident, %i evicted",
+        drawn_chunks, triangles, (int)resident.size(), evictions);
+}
+
+ChunkedTerrain chunks;
+
+}
@@ -1,33 +1,70 @@
 namespace Textures {
 
 typedef GLuint Texture;
+typedef Resources::handle_t Handle;
 
-Texture loadTexture(const char* filename) {
-  int width, height, nrChannels;
+struct texture_t {
+  Resources::Object texture;
+  int width, height;
+};
 
-  unsigned char* data = stbi_load(filename, &width, &height, &nrChannels, 0);
+// Every texture loaded or created here, owned by the pool
+Resources::Pool<texture_t> pool;
+
+// The name to bind, zero once the texture is destroyed
+Texture get(Handle handle) {
+  const texture_t* t = pool.get(handle);
+  return t ? t->texture.get() : 0;
+}
+
+// Deleted once the frames in flight are done with it
+void destroy(Handle handle) {
+  pool.destroy(handle);
+}
+
+// Takes ownership of a texture made elsewhere, e.g. by the loader thread
+Handle adopt(GLuint texture, int width, int height, const char* label) {
+  return pool.create({ Resources::Object(Resources::KIND_TEXTURE, texture), width, height }, label);
+}
+
+// Repeating RGB texture, made with DSA only so it works in any context
+GLuint createTexture(int width, int height, const unsigned char* rgb) {
+  GLuint texture;
+  glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+  glTextureStorage2D(texture, 1, GL_RGB8, width, height);
+  glTextureSubImage2D(texture, 0, 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+  glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  return texture;
+}
+
+// Decoded to RGB whatever the file holds, free with stbi_image_free
+unsigned char* decode(const char* filename, int &width, int &height) {
+  int channels;
+  return stbi_load(filename, &width, &height, &channels, 3);
+}
+
+Handle loadTexture(const char* filename) {
+  int width, height;
+
+  unsigned char* data = decode(filename, width, height);
   if (!data) {
     logError("Could not load texture: %s", filename);
     exit(8);
   } else { logInfo("Loaded texture %s (%ix%i)", filename, width, height);
   }
 
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  GLuint texture = createTexture(width, height, data);
 
   // free image data on host
   stbi_image_free(data);
 
-  return texture;
+  return adopt(texture, width, height, filename);
 }
 
-Texture createTextureColor(float rf, float gf, float bf) {
+Handle createTextureColor(float rf, float gf, float bf) {
   unsigned char r = (char)(255 * rf);
   unsigned char g = (char)(255 * gf);
   unsigned char b = (char)(255 * bf);
@@ -35,35 +72,29 @@ Texture createTextureColor(float rf, float gf, float bf) {
 
   printf("the color is %u, %u, %u\n", data[0],data[1],data[2]);
 
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-  return texture;
+  char label[32];
+  snprintf(label, sizeof(label), "color %u %u %u", r, g, b);
+  return adopt(createTexture(1, 1, data), 1, 1, label);
 }
 
-static Texture __blue;
+static Handle __blue;
 
 void setTexture(Texture texture, int slot = 0) {
-  glActiveTexture(GL_TEXTURE0 + slot);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glActiveTexture(GL_TEXTURE0);
+  GLState::bindTexture(slot, texture);
 }
 
 void setNormalMap(Texture texture) {
-  glActiveTexture(GL_TEXTURE1);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glActiveTexture(GL_TEXTURE0);
+  GLState::bindTexture(1, texture);
+}
+
+// Normal map that leaves the surface normal as it is
+Texture flatNormal() {
+  return get(__blue);
 }
 
 void disableNormalMap() {
 
-  setNormalMap(__blue);
+  setNormalMap(get(__blue));
 }
 
 void init() {
@@ -71,5 +102,12 @@ void init() {
    disableNormalMap(); // sets up default normal map
 }
 
+// Anything the callers did not destroy is reported as a leak
+void shutdown() {
+  destroy(__blue);
+  pool.report("textures");
+  pool.clear();
+}
+
 
 }
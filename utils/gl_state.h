@@ -0,0 +1,147 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+// Shadow of the bindings and switches that change every frame, calls that
+// would not change anything are dropped. Whatever binds one of these must
+// go through here, a raw call leaves the shadow stale. Objects are
+// created and edited with direct state access so that never needs a bind.
+namespace GLState {
+
+static const int max_units = 32;
+static const GLuint unknown = ~0u;
+
+// Capabilities that get switched per pass, anything else goes straight
+// through to glEnable
+static const GLenum caps[] = {
+  GL_BLEND, GL_DEPTH_TEST, GL_SCISSOR_TEST, GL_POLYGON_OFFSET_FILL, GL_RASTERIZER_DISCARD };
+static const int cap_count = sizeof(caps) / sizeof(caps[0]);
+
+struct state_t {
+  GLuint program, vao, framebuffer;
+  GLuint textures[max_units];
+  int enabled[cap_count];      // -1 until the first call
+  GLenum blend_src, blend_dst;
+  GLenum depth_func;
+  int depth_mask, color_mask;  // -1 until the first call, color a bit per channel
+  int swap_interval;
+
+  // This frame
+  int issued, elided;
+};
+
+static state_t state;
+
+// Forgets everything, for a fresh context
+inline void init() {
+  state.program = state.vao = state.framebuffer = unknown;
+  for(int i=0; i<max_units; i++) state.textures[i] = unknown;
+  for(int i=0; i<cap_count; i++) state.enabled[i] = -1;
+  state.blend_src = state.blend_dst = GL_NONE;
+  state.depth_func = GL_NONE;
+  state.depth_mask = state.color_mask = -1;
+  state.swap_interval = -1;
+  state.issued = state.elided = 0;
+}
+
+inline bool changed(GLuint &shadow, GLuint value) {
+  if (shadow == value) { state.elided++; return false; }
+  shadow = value;
+  state.issued++;
+  return true;
+}
+
+inline void useProgram(GLuint program) {
+  if (changed(state.program, program)) glUseProgram(program);
+}
+
+inline void bindVertexArray(GLuint vao) {
+  if (changed(state.vao, vao)) glBindVertexArray(vao);
+}
+
+inline void bindFramebuffer(GLuint framebuffer) {
+  if (changed(state.framebuffer, framebuffer)) glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+
+// Any target, the unit takes the texture's own
+inline void bindTexture(int unit, GLuint texture) {
+  if (changed(state.textures[unit], texture)) glBindTextureUnit(unit, texture);
+}
+
+// A deleted name can come back for a new object, whatever still shadows
+// it is unknown from then on. identifier as for glObjectLabel.
+inline void forget(GLenum identifier, GLuint name) {
+  switch(identifier) {
+    case GL_PROGRAM:      if (state.program == name) state.program = unknown; break;
+    case GL_VERTEX_ARRAY: if (state.vao == name) state.vao = unknown; break;
+    case GL_FRAMEBUFFER:  if (state.framebuffer == name) state.framebuffer = unknown; break;
+    case GL_TEXTURE:
+      for(int i=0; i<max_units; i++)
+        if (state.textures[i] == name) state.textures[i] = unknown;
+      break;
+    default: break;
+  }
+}
+
+inline void setEnabled(GLenum cap, bool on) {
+  for(int i=0; i<cap_count; i++) {
+    if (caps[i] != cap) continue;
+    if (state.enabled[i] == (int)on) { state.elided++; return; }
+    state.enabled[i] = on;
+    break;
+  }
+  state.issued++;
+  if (on) glEnable(cap);
+  else    glDisable(cap);
+}
+
+inline void enable(GLenum cap)  { setEnabled(cap, true); }
+inline void disable(GLenum cap) { setEnabled(cap, false); }
+
+inline void blendFunc(GLenum src, GLenum dst) {
+  if (state.blend_src == src && state.blend_dst == dst) { state.elided++; return; }
+  state.blend_src = src;
+  state.blend_dst = dst;
+  state.issued++;
+  glBlendFunc(src, dst);
+}
+
+inline void depthFunc(GLenum func) {
+  if (state.depth_func == func) { state.elided++; return; }
+  state.depth_func = func;
+  state.issued++;
+  glDepthFunc(func);
+}
+
+inline void depthMask(bool write) {
+  if (state.depth_mask == (int)write) { state.elided++; return; }
+  state.depth_mask = write;
+  state.issued++;
+  glDepthMask(write);
+}
+
+inline void colorMask(bool r, bool g, bool b, bool a) {
+  int mask = r | g << 1 | b << 2 | a << 3;
+  if (state.color_mask == mask) { state.elided++; return; }
+  state.color_mask = mask;
+  state.issued++;
+  glColorMask(r, g, b, a);
+}
+
+inline void swapInterval(int interval) {
+  if (state.swap_interval == interval) { state.elided++; return; }
+  state.swap_interval = interval;
+  state.issued++;
+  glfwSwapInterval(interval);
+}
+
+// Call once per frame, returns how many calls went through and how many
+// were dropped since the last call
+inline void endFrame(int &issued, int &elided) {
+  issued = state.issued;
+  elided = state.elided;
+  state.issued = state.elided = 0;
+}
+
+}
+
+#endif
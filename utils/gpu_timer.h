@@ -0,0 +1,85 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+// Times a span of GL commands without stalling, the result lags a frame
+// behind and stays at the last known value until the driver has it
+struct GpuTimer {
+  GLuint queries[2];
+  int frame;
+  double ms;
+
+  void init() {
+    glGenQueries(2, queries);
+    frame = 0;
+    ms = 0;
+  }
+  void begin() const { glBeginQuery(GL_TIME_ELAPSED, queries[frame % 2]); }
+  void end() {
+    glEndQuery(GL_TIME_ELAPSED);
+    frame++;
+    if (frame < 2) return;
+
+    GLuint other = queries[frame % 2];
+    GLint available = 0;
+    glGetQueryObjectiv(other, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint64 ns;
+      glGetQueryObjectui64v(other, GL_QUERY_RESULT, &ns);
+      ms = ns / 1e6;
+    }
+  }
+};
+
+// Counts a pipeline statistic, one of the counters of
+// ARB_pipeline_statistics_query, over a span of GL commands. Each span
+// carries a tag given to begin(). end() returns true when it collected
+// the result of an earlier span, which is then in value and tag. Every
+// result is handed out once. A span whose result is still not there
+// when its slot comes around again is dropped.
+struct GpuCounter {
+  GLenum target;
+  GLuint queries[2];
+  int tags[2];
+  bool pending[2];
+  int frame;
+  bool supported;
+  GLuint64 value;
+  int tag;
+  int dropped;
+
+  void init(GLenum target) {
+    this->target = target;
+    supported = glfwExtensionSupported("GL_ARB_pipeline_statistics_query");
+    glGenQueries(2, queries);
+    pending[0] = pending[1] = false;
+    frame = 0;
+    value = 0;
+    tag = 0;
+    dropped = 0;
+  }
+  void begin(int tag) {
+    if (!supported) return;
+    int slot = frame % 2;
+    if (pending[slot]) dropped++;
+    tags[slot] = tag;
+    pending[slot] = true;
+    glBeginQuery(target, queries[slot]);
+  }
+  bool end() {
+    if (!supported) return false;
+    glEndQuery(target);
+    frame++;
+
+    int other = frame % 2;
+    if (!pending[other]) return false;
+    GLint available = 0;
+    glGetQueryObjectiv(queries[other], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return false;
+    glGetQueryObjectui64v(queries[other], GL_QUERY_RESULT, &value);
+    tag = tags[other];
+    pending[other] = false;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+#include <vector>
+#include <string>
+#include <utility>
+
+namespace Resources {
+
+enum kind {
+  KIND_BUFFER,
+  KIND_TEXTURE,
+  KIND_VERTEX_ARRAY,
+  KIND_FRAMEBUFFER,
+  KIND_PROGRAM,
+  KIND_COUNT,
+};
+
+static const char* kind_names[KIND_COUNT] = { "buffers", "textures", "vertex arrays", "framebuffers", "programs" };
+
+// Names owned through Object, per kind
+static int created[KIND_COUNT], deleted[KIND_COUNT];
+
+struct retired_t {
+  kind k;
+  GLuint name;
+  uint64_t frame;
+};
+
+static std::vector<retired_t> retired;
+static uint64_t frame = 0;
+
+inline void destroy(kind k, GLuint name)
+{
+  switch(k) {
+    case KIND_BUFFER:       glDeleteBuffers(1, &name); break;
+    case KIND_TEXTURE:      glDeleteTextures(1, &name); GLState::forget(GL_TEXTURE, name); break;
+    case KIND_VERTEX_ARRAY: glDeleteVertexArrays(1, &name); GLState::forget(GL_VERTEX_ARRAY, name); break;
+    case KIND_FRAMEBUFFER:  glDeleteFramebuffers(1, &name); GLState::forget(GL_FRAMEBUFFER, name); break;
+    case KIND_PROGRAM:      glDeleteProgram(name); GLState::forget(GL_PROGRAM, name); break;
+    default: break;
+  }
+  deleted[k]++;
+}
+
+// Deletes the name once no frame that may still read it is in flight.
+// GL thread only.
+inline void retire(kind k, GLuint name)
+{
+  if (name) retired.push_back({ k, name, frame });
+}
+
+// Right after the frame ring waited for its region, which means the frame
+// RingBuffer::frames ago has finished on the GPU
+inline void beginFrame()
+{
+  frame++;
+  size_t kept = 0;
+  for(const retired_t &r : retired) {
+    if (r.frame + RingBuffer::frames <= frame) destroy(r.k, r.name);
+    else retired[kept++] = r;
+  }
+  retired.resize(kept);
+}
+
+// Move-only owner of a GL name, retires it when it goes out of scope or
+// is assigned over. Converts to the name so it can be passed anywhere a
+// GLuint is expected.
+class Object {
+  public:
+    Object() : k(KIND_BUFFER), name(0) {}
+    Object(kind k, GLuint name) : k(k), name(name) { if (name) created[k]++; }
+    Object(Object &&o) : k(o.k), name(o.name) { o.name = 0; }
+    Object &operator=(Object &&o) {
+      if (this != &o) {
+        reset();
+        k = o.k;
+        name = o.name;
+        o.name = 0;
+      }
+      return *this;
+    }
+    Object(const Object&) = delete;
+    Object &operator=(const Object&) = delete;
+    ~Object() { reset(); }
+
+    operator GLuint() const { return name; }
+    GLuint get() const { return name; }
+
+    void reset() {
+      retire(k, name);
+      name = 0;
+    }
+
+  private:
+    kind k;
+    GLuint name;
+};
+
+inline Object createBuffer()
+{
+  GLuint name;
+  glCreateBuffers(1, &name);
+  return Object(KIND_BUFFER, name);
+}
+
+inline Object createTexture(GLenum target)
+{
+  GLuint name;
+  glCreateTextures(target, 1, &name);
+  return Object(KIND_TEXTURE, name);
+}
+
+inline Object createVertexArray()
+{
+  GLuint name;
+  glCreateVertexArrays(1, &name);
+  return Object(KIND_VERTEX_ARRAY, name);
+}
+
+inline Object createFramebuffer()
+{
+  GLuint name;
+  glCreateFramebuffers(1, &name);
+  return Object(KIND_FRAMEBUFFER, name);
+}
+
+// Slot index and the generation it had when the handle was made. A slot
+// that is reused gets a new generation so stale handles stop resolving,
+// generation zero never does.
+struct handle_t {
+  uint32_t index, generation;
+  bool operator==(const handle_t &o) const { return index == o.index && generation == o.generation; }
+  bool operator!=(const handle_t &o) const { return !(*this == o); }
+};
+
+// Live values are kept packed at the front of their arrays, in no
+// particular order, so going over all of them touches nothing else.
+// Handles go through a sparse slot table to find their value, which moves
+// when another one is destroyed.
+template <typename T>
+class Pool {
+  public:
+    handle_t create(T &&value, const std::string &label) {
+      uint32_t slot;
+      if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      } else {
+        slot = generations.size();
+        generations.push_back(0);
+        dense.push_back(0);
+      }
+      generations[slot]++;
+      dense[slot] = values.size();
+      values.push_back(std::move(value));
+      labels.push_back(label);
+      owners.push_back(slot);
+      return { slot, generations[slot] };
+    }
+
+    bool valid(handle_t h) const {
+      return h.index < generations.size() && generations[h.index] == h.generation && dense[h.index] != none;
+    }
+
+    // Valid until the next create or destroy
+    T* get(handle_t h) { return valid(h) ? &values[dense[h.index]] : nullptr; }
+    const T* get(handle_t h) const { return valid(h) ? &values[dense[h.index]] : nullptr; }
+
+    // The last value moves into the hole
+    void destroy(handle_t h) {
+      if (!valid(h)) return;
+      uint32_t at = dense[h.index];
+      uint32_t last = values.size() - 1;
+      if (at != last) {
+        values[at] = std::move(values[last]);
+        labels[at] = std::move(labels[last]);
+        owners[at] = owners[last];
+        dense[owners[at]] = at;
+      }
+      values.pop_back();
+      labels.pop_back();
+      owners.pop_back();
+      dense[h.index] = none;
+      free_slots.push_back(h.index);
+    }
+
+    void clear() {
+      while(!values.empty()) destroy({ owners.back(), generations[owners.back()] });
+    }
+
+    int size() const { return values.size(); }
+    std::vector<T> &items() { return values; }
+    const std::vector<T> &items() const { return values; }
+
+    // Whatever is still alive, by label
+    void report(const char* what) const {
+      if (values.empty()) return;
+      logError("%i %s still alive:", (int)values.size(), what);
+      for(const std::string &l : labels) logError("  %s", l.c_str());
+    }
+
+  private:
+    static constexpr uint32_t none = ~0u;
+
+    std::vector<T> values;
+    std::vector<std::string> labels;
+    std::vector<uint32_t> owners;   // slot of each value
+    std::vector<uint32_t> generations, dense; // per slot
+    std::vector<uint32_t> free_slots;
+};
+
+// Waits for the GPU, deletes everything retired and reports the names
+// that were never given back
+inline void shutdown()
+{
+  glFinish();
+  for(const retired_t &r : retired) destroy(r.k, r.name);
+  retired.clear();
+  for(int k=0; k<KIND_COUNT; k++) {
+    int live = created[k] - deleted[k];
+    if (live) logError("Leaked %i of %i %s", live, created[k], kind_names[k]);
+    else logInfo("Released all %i %s", created[k], kind_names[k]);
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+#include <atomic>
+#include <string.h>
+
+// Persistently mapped buffer split in one region per frame in flight.
+// Everything the GPU reads this frame is copied into the current region
+// and bound by offset, a fence per region keeps the CPU from writing
+// over data a frame that is still in flight reads.
+class RingBuffer {
+  public:
+    static const int frames = 3;
+
+    GLuint buffer;
+
+    // Counters, reset by report()
+    size_t peak;       // most bytes used by a single frame
+    int fence_waits;   // frames that had to wait on the GPU
+    double wait_ms;
+
+    void init(size_t frame_size) {
+      GLint ubo_align, ssbo_align;
+      glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_align);
+      glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_align);
+      align = std::max(ubo_align, ssbo_align);
+      region_size = (frame_size + align - 1) / align * align;
+
+      const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glCreateBuffers(1, &buffer);
+      glNamedBufferStorage(buffer, region_size * frames, NULL, flags);
+      data = (uint8_t*)glMapNamedBufferRange(buffer, 0, region_size * frames, flags);
+      if (!data) {
+        logError("Could not map the ring buffer");
+        exit(11);
+      }
+      for(int i=0; i<frames; i++) fences[i] = 0;
+      region = 0;
+      head = 0;
+      peak = 0;
+      fence_waits = 0;
+      wait_ms = 0;
+    }
+
+    // Moves on to the next region, waiting for the GPU only if it has
+    // not finished the frame that last used it
+    void beginFrame() {
+      region = (region + 1) % frames;
+      head = 0;
+      GLsync fence = fences[region];
+      if (!fence) return;
+      if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        fence_waits++;
+        auto start = std::chrono::high_resolution_clock::now();
+        while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+        wait_ms += std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - start).count();
+      }
+      glDeleteSync(fence);
+      fences[region] = 0;
+    }
+
+    // After the last command that reads this frame's region
+    void endFrame() {
+      fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      peak = std::max(peak, (size_t)head);
+    }
+
+    // Copies size bytes into this frame's region and returns their offset
+    // in the buffer, aligned for a uniform or storage binding. Safe to
+    // call from several threads.
+    GLintptr push(const void* src, size_t size) {
+      size_t aligned = (size + align - 1) / align * align;
+      size_t at = head.fetch_add(aligned);
+      if (at + aligned > region_size) {
+        logError("Ring buffer region of %i KB is full", (int)(region_size / 1024));
+        exit(11);
+      }
+      GLintptr offset = region * region_size + at;
+      memcpy(data + offset, src, size);
+      return offset;
+    }
+
+    template <typename T>
+    GLintptr push(const T &value) { return push(&value, sizeof(T)); }
+
+    size_t regionSize() const { return region_size; }
+
+    void report() {
+      logDebug("Ring buffer: %.1f%% of a %i KB region used at most, %i fence waits (%.3fms)",
+          100.0 * peak / region_size, (int)(region_size / 1024), fence_waits, wait_ms);
+      peak = 0;
+      fence_waits = 0;
+      wait_ms = 0;
+    }
+
+  private:
+    uint8_t* data;
+    size_t region_size, align;
+    int region;
+    std::atomic<size_t> head;
+    GLsync fences[frames];
+};
+
+#endif
@@ -56,6 +56,28 @@ inline static GLuint GenerateProgram(GLuint vs, GLuint fs)
   return program;
 }
 
+inline static GLuint GenerateProgram(GLuint cs)
+{
+  GLuint program = glCreateProgram();
+  glAttachShader(program, cs);
+  glLinkProgram(program);
+  GLint isLinked = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+  if (!isLinked)
+  {
+    GLint maxLength = 0;  
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+    GLchar* errorLog = (GLchar*)malloc(maxLength);
+    glGetProgramInfoLog(program, maxLength, &maxLength, errorLog);
+
+    printf("Shader linker error: %s", errorLog);
+
+    glDeleteProgram(program);
+    exit(5);
+  }
+  return program;
+}
+
 inline static GLuint GenerateProgram(GLuint vs, GLuint gs, GLuint fs)
 {
   GLuint program = glCreateProgram();
@@ -80,4 +102,55 @@ inline static GLuint GenerateProgram(GLuint vs, GLuint gs, GLuint fs)
   return program;
 }
 
+inline static GLuint GenerateProgram(GLuint vs, GLuint tcs, GLuint tes, GLuint fs)
+{
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, tcs);
+  glAttachShader(program, tes);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  GLint isLinked = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+  if (!isLinked)
+  {
+    GLint maxLength = 0;  
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+    GLchar* errorLog = (GLchar*)malloc(maxLength);
+    glGetProgramInfoLog(program, maxLength, &maxLength, errorLog);
+
+    printf("Shader linker error: %s", errorLog);
+
+    glDeleteProgram(program);
+    exit(5);
+  }
+  return program;
+}
+
+// Vertex and geometry stage only, linked to capture the named outputs
+// interleaved with transform feedback
+inline static GLuint GenerateFeedbackProgram(GLuint vs, GLuint gs, const char** varyings, int count)
+{
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, gs);
+  glTransformFeedbackVaryings(program, count, varyings, GL_INTERLEAVED_ATTRIBS);
+  glLinkProgram(program);
+  GLint isLinked = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+  if (!isLinked)
+  {
+    GLint maxLength = 0;  
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+    GLchar* errorLog = (GLchar*)malloc(maxLength);
+    glGetProgramInfoLog(program, maxLength, &maxLength, errorLog);
+
+    printf("Shader linker error: %s", errorLog);
+
+    glDeleteProgram(program);
+    exit(5);
+  }
+  return program;
+}
+
 #endif
@@ -0,0 +1,65 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <immintrin.h>
+
+// Lane wise operations, the same code then runs on one float or on a
+// whole register of them. Comparisons give all bits set where true and
+// mask() packs one bit per lane.
+template <int W> struct lanes;
+
+template <> struct lanes<1> {
+  typedef float V;
+  static const int width = 1;
+  static float set(float f) { return f; }
+  static float load(const float* p) { return *p; }
+  static float add(float a, float b) { return a + b; }
+  static float sub(float a, float b) { return a - b; }
+  static float mul(float a, float b) { return a * b; }
+  static float floor(float a) { return floorf(a); }
+  static float cmpgt(float a, float b) { return a > b ? 1.0f : 0.0f; }
+  static float cmpge(float a, float b) { return a >= b ? 1.0f : 0.0f; }
+  static float and_(float a, float b) { return a * b; }
+  static int mask(float a) { return a != 0; }
+};
+
+template <> struct lanes<4> {
+  typedef __m128 V;
+  static const int width = 4;
+  static __m128 set(float f) { return _mm_set1_ps(f); }
+  static __m128 load(const float* p) { return _mm_loadu_ps(p); }
+  static __m128 add(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+  static __m128 sub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+  static __m128 mul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+  // SSE2 has no floor, truncate and step down where that rounded up
+  static __m128 floor(__m128 a) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1)));
+  }
+  static __m128 cmpgt(__m128 a, __m128 b) { return _mm_cmpgt_ps(a, b); }
+  static __m128 cmpge(__m128 a, __m128 b) { return _mm_cmpge_ps(a, b); }
+  static __m128 and_(__m128 a, __m128 b) { return _mm_and_ps(a, b); }
+  static int mask(__m128 a) { return _mm_movemask_ps(a); }
+};
+
+#ifdef __AVX__
+template <> struct lanes<8> {
+  typedef __m256 V;
+  static const int width = 8;
+  static __m256 set(float f) { return _mm256_set1_ps(f); }
+  static __m256 load(const float* p) { return _mm256_loadu_ps(p); }
+  static __m256 add(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+  static __m256 sub(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+  static __m256 mul(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+  static __m256 floor(__m256 a) { return _mm256_floor_ps(a); }
+  static __m256 cmpgt(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static __m256 cmpge(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+  static __m256 and_(__m256 a, __m256 b) { return _mm256_and_ps(a, b); }
+  static int mask(__m256 a) { return _mm256_movemask_ps(a); }
+};
+static const int wide = 8;
+#else
+static const int wide = 4;
+#endif
+
+#endif
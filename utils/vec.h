@@ -131,6 +131,7 @@ public:
   }
   void unpack(mat4x4 f) const { mat4x4_dup(f, data); }
   float* operator[] (int column) { return data[column]; }
+  const float* operator[] (int column) const { return data[column]; }
   Matrix4 inverted() const { mat4x4 r; mat4x4_invert(r, data); return Matrix4(r); }
   Vector4 operator* (const Vector4 &o) const {
     vec4 r;
@@ -186,6 +187,14 @@ public:
     mat4x4_perspective(r, fov, ratio, znear, zfar);
     return Matrix4(r);
   }
+  static Matrix4 FromLookAt(Vector3 eye, Vector3 center, Vector3 up) {
+    mat4x4 r;
+    vec3 e = { eye.x, eye.y, eye.z };
+    vec3 c = { center.x, center.y, center.z };
+    vec3 u = { up.x, up.y, up.z };
+    mat4x4_look_at(r, e, c, u);
+    return Matrix4(r);
+  }
   void print() const {
     for(int i=0; i<4; i++) {
       printf("%f, %f, %f, %f\n", data[0][i], data[1][i], data[2][i], data[3][i]);
@@ -199,13 +208,23 @@ public:
   Vector3 origin, dir;
   float length;
 
-  Ray() {}
-  Ray(Vector3 origin, Vector3 dir) : origin(origin), dir(dir) {}
+  Ray() : length(std::numeric_limits<float>::infinity()) {}
+  Ray(Vector3 origin, Vector3 dir) : origin(origin), dir(dir), length(std::numeric_limits<float>::infinity()) {}
+  Ray(Vector3 origin, Vector3 dir, float length) : origin(origin), dir(dir), length(length) {}
+  Vector3 at(float t) const { return origin + dir * t; }
 };
 
 class Plane {
 public:
   Vector3 pos, normal, tangent, bitangent;
+  Plane() {}
+  // Unbounded plane dot(normal, p) + d = 0, normal need not be unit length
+  Plane(Vector3 n, float d) {
+    float l = n.length();
+    normal = n * (1 / l);
+    pos = normal * (-d / l);
+  }
+  float distance(const Vector3 &p) const { return Vector3::dot(p - pos, normal); }
   bool intersects(const Ray &ray) const {
     // for any point p on the Plane, dot(p - pos, normal) = 0 holds
     // so we solve the t at which the ray intersects by using the parametric form as p.
@@ -231,6 +250,92 @@ public:
   }
 }; 
 
+class AABB {
+public:
+  Vector3 min, max;
+  AABB() : min(std::numeric_limits<float>::infinity()), max(-std::numeric_limits<float>::infinity()) {}
+  AABB(Vector3 min, Vector3 max) : min(min), max(max) {}
+  static AABB FromSphere(const Vector3 &center, float radius) {
+    return AABB(center - Vector3(radius), center + Vector3(radius));
+  }
+  static AABB Merge(const AABB &a, const AABB &b) {
+    return AABB(
+      Vector3(std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z)),
+      Vector3(std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z)));
+  }
+  void grow(const Vector3 &p) { *this = Merge(*this, AABB(p, p)); }
+  AABB fattened(float margin) const { return AABB(min - Vector3(margin), max + Vector3(margin)); }
+  Vector3 center() const { return (min + max) * 0.5f; }
+  Vector3 extent() const { return max - min; }
+  float surfaceArea() const {
+    Vector3 e = extent();
+    return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+  }
+  bool contains(const AABB &o) const {
+    return o.min.x >= min.x && o.min.y >= min.y && o.min.z >= min.z &&
+           o.max.x <= max.x && o.max.y <= max.y && o.max.z <= max.z;
+  }
+  bool overlaps(const Vector3 &c, float radius) const {
+    float dx = std::max(std::max(min.x - c.x, c.x - max.x), 0.0f);
+    float dy = std::max(std::max(min.y - c.y, c.y - max.y), 0.0f);
+    float dz = std::max(std::max(min.z - c.z, c.z - max.z), 0.0f);
+    return dx * dx + dy * dy + dz * dz <= radius * radius;
+  }
+  // Slab test, t is the distance along the ray where it enters the box
+  bool intersects(const Ray &ray, float* t) const {
+    float t0 = 0, t1 = ray.length;
+    const float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float d[3] = { ray.dir.x, ray.dir.y, ray.dir.z };
+    const float lo[3] = { min.x, min.y, min.z };
+    const float hi[3] = { max.x, max.y, max.z };
+    for(int i=0; i<3; i++) {
+      float inv = 1 / d[i];
+      float t_near = (lo[i] - o[i]) * inv;
+      float t_far  = (hi[i] - o[i]) * inv;
+      if (t_near > t_far) std::swap(t_near, t_far);
+      t0 = std::max(t0, t_near);
+      t1 = std::min(t1, t_far);
+      if (t0 > t1) return false;
+    }
+    *t = t0;
+    return true;
+  }
+};
+
+class Frustum {
+public:
+  enum { OUTSIDE, INTERSECTS, INSIDE };
+  Plane planes[6]; // left, right, bottom, top, near, far, normals point inwards
+
+  Frustum() {}
+  // Gribb/Hartmann extraction from a projection * view matrix
+  Frustum(const Matrix4 &m) {
+    for(int i=0; i<3; i++) {
+      Vector3 n0 = Vector3(m[0][3] + m[0][i], m[1][3] + m[1][i], m[2][3] + m[2][i]);
+      Vector3 n1 = Vector3(m[0][3] - m[0][i], m[1][3] - m[1][i], m[2][3] - m[2][i]);
+      planes[i * 2 + 0] = Plane(n0, m[3][3] + m[3][i]);
+      planes[i * 2 + 1] = Plane(n1, m[3][3] - m[3][i]);
+    }
+  }
+  bool intersects(const Vector3 &center, float radius) const {
+    for(int i=0; i<6; i++)
+      if (planes[i].distance(center) < -radius) return false;
+    return true;
+  }
+  int classify(const AABB &box) const {
+    int result = INSIDE;
+    for(int i=0; i<6; i++) {
+      const Vector3 &n = planes[i].normal;
+      // Corners furthest along and against the normal
+      Vector3 p = Vector3(n.x >= 0 ? box.max.x : box.min.x, n.y >= 0 ? box.max.y : box.min.y, n.z >= 0 ? box.max.z : box.min.z);
+      Vector3 q = Vector3(n.x >= 0 ? box.min.x : box.max.x, n.y >= 0 ? box.min.y : box.max.y, n.z >= 0 ? box.min.z : box.max.z);
+      if (planes[i].distance(p) < 0) return OUTSIDE;
+      if (planes[i].distance(q) < 0) result = INTERSECTS;
+    }
+    return result;
+  }
+};
+
 struct Line {
   Vector3 dir;
   float a, b;
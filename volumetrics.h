@@ -0,0 +1,76 @@
+namespace Volumetrics {
+
+using namespace Textures;
+
+// Low resolution grid aligned with the camera frustum. Every frame each
+// froxel is lit once by all lights, blended with last frame's result and
+// then integrated front to back, so the combinator only has to do a
+// single lookup per pixel and the cost does not depend on the lights.
+struct froxels_t {
+  Resources::Object scatter[2], integrated, empty;
+  int frame;
+  Matrix4 prev_camera;
+  Vector3 prev_cam_pos;
+
+  static Resources::Object createVolume(int w, int h, int d, const float* data) {
+    Resources::Object tex = Resources::createTexture(GL_TEXTURE_3D);
+    glTextureStorage3D(tex, 1, GL_RGBA16F, w, h, d);
+    if (data) glTextureSubImage3D(tex, 0, 0, 0, 0, w, h, d, GL_RGBA, GL_FLOAT, data);
+    glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(tex, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    return tex;
+  }
+
+  void init() {
+    scatter[0] = createVolume(D_FROXEL_X, D_FROXEL_Y, D_FROXEL_Z, NULL);
+    scatter[1] = createVolume(D_FROXEL_X, D_FROXEL_Y, D_FROXEL_Z, NULL);
+    integrated = createVolume(D_FROXEL_X, D_FROXEL_Y, D_FROXEL_Z, NULL);
+
+    // Nothing scattered and everything transmitted, for when fog is off
+    const float clear[4] = { 0, 0, 0, 1 };
+    empty = createVolume(1, 1, 1, clear);
+    frame = 0;
+  }
+
+  void release() {
+    scatter[0].reset();
+    scatter[1].reset();
+    integrated.reset();
+    empty.reset();
+  }
+
+  void update(const Matrix4 &camera, const Vector3 &cam_pos, Texture shadow_atlas) {
+    GLuint current = scatter[frame % 2];
+    GLuint history = scatter[(frame + 1) % 2];
+
+    // Stratified offsets along the slice so the history converges
+    float jitter = ((frame * 5) % 8 + 0.5f) / 8;
+
+    Shaders::sh_froxel_inject.use(
+        camera,
+        cam_pos,
+        frame == 0 ? camera : prev_camera,
+        frame == 0 ? cam_pos : prev_cam_pos,
+        jitter,
+        frame == 0 ? 0.0f : 0.9f,
+        history,
+        shadow_atlas);
+    glBindImageTexture(0, current, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    glDispatchCompute((D_FROXEL_X + 7) / 8, (D_FROXEL_Y + 7) / 8, D_FROXEL_Z);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    Shaders::sh_froxel_integrate.use(current);
+    glBindImageTexture(0, integrated, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    glDispatchCompute((D_FROXEL_X + 7) / 8, (D_FROXEL_Y + 7) / 8, 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    prev_camera = camera;
+    prev_cam_pos = cam_pos;
+    frame++;
+  }
+} froxels;
+
+}